@@ -0,0 +1,473 @@
+// Reproducible benchmarks of sorter components (entries, reader, sort, writer, merger)
+// and of the whole sorting. Data is generated with fixed seeds, so results of different
+// versions are comparable; they are written as JSON.
+//
+// Usage: bench [--filter <text>] [--repeat <N>] [--size <size>] [--dir <dir>] [--output <json-file>]
+
+#include "common/Clock.h"
+#include "common/Utils.h"
+
+#include "sorter/SortingEntry.h"
+#include "sorter/FileReader.h"
+#include "sorter/FileWriter.h"
+#include "sorter/FileRegistry.h"
+#include "sorter/InitialSorter.h"
+#include "sorter/Merger.h"
+#include "sorter/Metrics.h"
+#include "generator/DataGenerator.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+namespace
+{
+
+const uint64_t Seed = 20161019;
+
+// Result of one run of a benchmark
+struct Measurement
+{
+    double time = 0; // sec
+    uint64_t operations = 0;
+    uint64_t bytes = 0;
+};
+
+struct Benchmark
+{
+    std::string name;
+    std::function<Measurement()> run;
+};
+
+struct Result
+{
+    std::string name;
+    Measurement best;
+    double median = 0;
+};
+
+enum class Dataset
+{
+    Random,
+    Duplicates, // 1000 distinct lines
+    Sorted // random lines in sorted order
+};
+
+const char* GetDatasetName(Dataset dataset)
+{
+    switch (dataset)
+    {
+    case Dataset::Random: return "random";
+    case Dataset::Duplicates: return "duplicates";
+    case Dataset::Sorted: return "sorted";
+    }
+    return "";
+}
+
+// Lines "<number>. <words>" made by the generator with the same seed.
+std::string GenerateLines(size_t size, Dataset dataset, uint64_t seed)
+{
+    GeneratorSettings settings;
+    settings.seed = seed;
+    settings.duplicates = dataset == Dataset::Duplicates ? 1 : 0;
+    settings.duplicatePool = 1000;
+    settings.sorted = dataset == Dataset::Sorted ? 1 : 0;
+
+    std::string data;
+    DataGenerator(settings).GenerateBlock(0, size, &data);
+    return data;
+}
+
+void WriteFile(const std::string& fileName, const std::string& data)
+{
+    std::ofstream file(fileName, std::ofstream::binary);
+    file.write(data.data(), data.size());
+    if (!file)
+        throw std::runtime_error("Cannot write " + fileName);
+}
+
+// lines of data without EOL
+std::vector<std::pair<const char*, size_t>> SplitLines(const std::string& data)
+{
+    std::vector<std::pair<const char*, size_t>> lines;
+    for (size_t begin = 0; begin < data.size(); )
+    {
+        size_t end = data.find('\n', begin);
+        lines.emplace_back(&data[begin], end - begin);
+        begin = end + 1;
+    }
+    return lines;
+}
+
+template <class TEntry>
+std::vector<TEntry> MakeEntries(const std::vector<std::pair<const char*, size_t>>& lines)
+{
+    std::vector<TEntry> entries;
+    entries.reserve(lines.size());
+    for (const auto& line : lines)
+        entries.emplace_back(line.first, line.second);
+    return entries;
+}
+
+// Data shared by micro benchmarks, generated once by Generate() if any of them is run.
+struct MicroData
+{
+    std::string data;
+    std::vector<std::pair<const char*, size_t>> lines;
+    std::string fileName;
+
+    MicroData(const std::string& dir) : fileName((boost::filesystem::path(dir) / "bench.micro.txt").string()) {}
+
+    void Generate()
+    {
+        data = GenerateLines(GetSize("16M"), Dataset::Random, Seed);
+        lines = SplitLines(data);
+        WriteFile(fileName, data);
+    }
+
+    ~MicroData()
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(fileName, ec);
+    }
+};
+
+template <class TEntry>
+Measurement ConstructEntries(const MicroData& micro)
+{
+    std::vector<TEntry> entries;
+    entries.reserve(micro.lines.size());
+
+    Clock c;
+    c.Start();
+    for (const auto& line : micro.lines)
+        entries.emplace_back(line.first, line.second);
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = entries.size();
+    result.bytes = micro.data.size();
+    return result;
+}
+
+// compares of random pairs, like the first passes of sorting
+template <class TEntry>
+Measurement CompareEntries(const MicroData& micro)
+{
+    std::vector<TEntry> entries = MakeEntries<TEntry>(micro.lines);
+    std::mt19937_64 random(Seed);
+    std::vector<uint32_t> pairs(2 * entries.size());
+    for (uint32_t& index : pairs)
+        index = static_cast<uint32_t>(random() % entries.size());
+
+    Clock c;
+    c.Start();
+    size_t lessCount = 0;
+    for (size_t n = 0; n < pairs.size(); n += 2)
+        lessCount += entries[pairs[n]] < entries[pairs[n + 1]] ? 1 : 0;
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = entries.size();
+    if (lessCount > entries.size())
+        throw std::logic_error("Invalid compare");
+    return result;
+}
+
+Measurement ReadLines(const MicroData& micro)
+{
+    auto buffer = std::make_shared<std::vector<char>>(GetSize("4M"));
+
+    Clock c;
+    c.Start();
+    FileReader reader(micro.fileName.c_str());
+    Measurement result;
+    while (reader.LoadNextChunk(buffer))
+    {
+        FileReader::Buffer line;
+        while (reader.TryGetLine(&line))
+        {
+            ++result.operations;
+            result.bytes += line.size + 1;
+        }
+    }
+    result.time = c.ElapsedTime();
+    return result;
+}
+
+template <class TEntry>
+Measurement SortEntries(const MicroData& micro, DuplicateMode duplicates)
+{
+    std::vector<TEntry> entries = MakeEntries<TEntry>(micro.lines);
+
+    Clock c;
+    c.Start();
+    Sort(entries, 0, duplicates);
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = micro.lines.size();
+    result.bytes = micro.data.size();
+    return result;
+}
+
+Measurement SaveEntries(const MicroData& micro)
+{
+    std::vector<FastEntry> entries = MakeEntries<FastEntry>(micro.lines);
+    std::string fileName = micro.fileName + ".out";
+
+    Clock c;
+    c.Start();
+    FileInfo info = SaveFile(fileName.c_str(), entries, micro.data.size());
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = entries.size();
+    result.bytes = info.size;
+    boost::filesystem::remove(fileName);
+    return result;
+}
+
+// merges fanIn sorted runs of the micro data
+Measurement MergeRuns(const MicroData& micro, size_t fanIn)
+{
+    std::vector<FastEntry> entries = MakeEntries<FastEntry>(micro.lines);
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<std::string> runs;
+    for (size_t n = 0; n < fanIn; ++n)
+    {
+        runs.push_back(micro.fileName + ".run" + std::to_string(n));
+        FileWriter file(runs.back());
+        for (size_t index = n; index < entries.size(); index += fanIn)
+            entries[index].ToStream(file);
+        file.Close();
+    }
+
+    FileRegistry registry(micro.fileName);
+    std::string outputFile = micro.fileName + ".out";
+
+    Clock c;
+    c.Start();
+    Merger<FastEntry> merger(fanIn, GetSize("1M"));
+    merger.SetReclaimSpace(false);
+    size_t totalSize = merger.Open(runs, registry);
+    FileInfo info = merger.DoMergeIteration(outputFile, totalSize, false);
+    merger.Close();
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = entries.size();
+    result.bytes = info.size;
+
+    boost::filesystem::remove(outputFile);
+    for (const std::string& run : runs)
+        boost::filesystem::remove(run);
+    return result;
+}
+
+// the whole sorting of generated file, chunk is 1/4 of data as recommended
+Measurement SortFile(const std::string& dir, size_t size, Dataset dataset, DuplicateMode duplicates)
+{
+    std::string inputFile = (boost::filesystem::path(dir) / "bench.input.txt").string();
+    std::string resultFile = (boost::filesystem::path(dir) / "bench.result.txt").string();
+    std::string data = GenerateLines(size, dataset, Seed);
+    WriteFile(inputFile, data);
+
+    Clock c;
+    c.Start();
+    FileRegistry registry(inputFile, resultFile);
+
+    InitialSorter<FastEntry> sorter(std::max<size_t>(size / 4, GetSize("1M")));
+    sorter.SetReaderCount(std::thread::hardware_concurrency());
+    sorter.SetDuplicateMode(duplicates);
+    sorter.Process(registry);
+
+    Merger<FastEntry> merger(8, GetSize("32M"));
+    merger.SetDuplicateMode(duplicates);
+    merger.Process(registry);
+
+    Measurement result;
+    result.time = c.ElapsedTime();
+    result.operations = std::count(data.begin(), data.end(), '\n');
+    result.bytes = data.size();
+
+    boost::filesystem::remove(inputFile);
+    boost::filesystem::remove(resultFile);
+    return result;
+}
+
+std::vector<Benchmark> GetBenchmarks(const MicroData& micro, const std::string& dir, size_t macroSize)
+{
+    const MicroData* m = &micro;
+    std::vector<Benchmark> benchmarks = {
+        {"micro/entry-construct/SimpleEntry", [m]() { return ConstructEntries<SimpleEntry>(*m); }},
+        {"micro/entry-construct/SmallEntry", [m]() { return ConstructEntries<SmallEntry>(*m); }},
+        {"micro/entry-construct/FastEntry", [m]() { return ConstructEntries<FastEntry>(*m); }},
+        {"micro/entry-compare/SimpleEntry", [m]() { return CompareEntries<SimpleEntry>(*m); }},
+        {"micro/entry-compare/SmallEntry", [m]() { return CompareEntries<SmallEntry>(*m); }},
+        {"micro/entry-compare/FastEntry", [m]() { return CompareEntries<FastEntry>(*m); }},
+        {"micro/reader-lines", [m]() { return ReadLines(*m); }},
+        {"micro/sort/SmallEntry", [m]() { return SortEntries<SmallEntry>(*m, DuplicateMode::Keep); }},
+        {"micro/sort/FastEntry", [m]() { return SortEntries<FastEntry>(*m, DuplicateMode::Keep); }},
+        {"micro/sort/PrefixEntry<1>", [m]() { return SortEntries<PrefixEntry<1>>(*m, DuplicateMode::Keep); }},
+        {"micro/sort/PrefixEntry<4>", [m]() { return SortEntries<PrefixEntry<4>>(*m, DuplicateMode::Keep); }},
+        {"micro/sort-unique/FastEntry", [m]() { return SortEntries<FastEntry>(*m, DuplicateMode::Remove); }},
+        {"micro/save-file", [m]() { return SaveEntries(*m); }},
+    };
+
+    for (size_t fanIn : {2, 8, 32})
+        benchmarks.push_back({"micro/merge-fan-in/" + std::to_string(fanIn), [m, fanIn]() { return MergeRuns(*m, fanIn); }});
+
+    for (Dataset dataset : {Dataset::Random, Dataset::Duplicates, Dataset::Sorted})
+    {
+        benchmarks.push_back({std::string("macro/sort/") + GetDatasetName(dataset), [dir, macroSize, dataset]()
+        {
+            return SortFile(dir, macroSize, dataset, DuplicateMode::Keep);
+        }});
+    }
+    benchmarks.push_back({"macro/sort-unique/duplicates", [dir, macroSize]()
+    {
+        return SortFile(dir, macroSize, Dataset::Duplicates, DuplicateMode::Remove);
+    }});
+    return benchmarks;
+}
+
+Result Run(const Benchmark& benchmark, size_t repeat)
+{
+    std::vector<double> times;
+    Result result;
+    result.name = benchmark.name;
+    for (size_t n = 0; n < repeat; ++n)
+    {
+        Measurement measurement = benchmark.run();
+        times.push_back(measurement.time);
+        if (n == 0 || measurement.time < result.best.time)
+            result.best = measurement;
+    }
+
+    std::sort(times.begin(), times.end());
+    result.median = times[times.size() / 2];
+    return result;
+}
+
+std::string ToJson(const std::vector<Result>& results, size_t repeat, size_t macroSize)
+{
+#ifdef __OPTIMIZE__
+    const char* build = "optimized";
+#else
+    const char* build = "debug";
+#endif
+
+    std::ostringstream json;
+    json << "{\n  \"build\":\"" << build << "\",\n  \"seed\":" << Seed << ",\n  \"repeat\":" << repeat << ",\n  \"macroSize\":" << macroSize
+         << ",\n  \"benchmarks\":[";
+    const char* separator = "\n";
+    for (const Result& result : results)
+    {
+        double time = std::max(result.best.time, 1e-9);
+        json << separator << "    {\"name\":" << Metrics::Quote(result.name)
+             << ",\"operations\":" << result.best.operations
+             << ",\"bytes\":" << result.best.bytes
+             << ",\"best\":" << result.best.time
+             << ",\"median\":" << result.median
+             << ",\"nsPerOperation\":" << (result.best.operations > 0 ? time * 1e9 / result.best.operations : 0)
+             << ",\"mbPerSec\":" << result.best.bytes / time / (1024 * 1024) << "}";
+        separator = ",\n";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string filter;
+    std::string dir = ".";
+    std::string outputFile;
+    size_t repeat = 3;
+    size_t macroSize = GetSize("64M");
+
+    try
+    {
+        for (int n = 1; n < argc; ++n)
+        {
+            std::string arg = argv[n];
+            if (n + 1 >= argc)
+                throw std::logic_error("Missing value of " + arg);
+
+            std::string value = argv[++n];
+            if (arg == "--filter")
+                filter = value;
+            else if (arg == "--repeat")
+                repeat = std::max<size_t>(boost::lexical_cast<size_t>(value), 1);
+            else if (arg == "--size")
+                macroSize = GetSize(value);
+            else if (arg == "--dir")
+                dir = value;
+            else if (arg == "--output")
+                outputFile = value;
+            else
+                throw std::logic_error("Unknown option " + arg);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        std::cerr << "Usage: bench [--filter <text>] [--repeat <N>] [--size <size>] [--dir <dir>] [--output <json-file>]"
+                  << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        MicroData micro(dir);
+        std::vector<Benchmark> benchmarks;
+        for (const Benchmark& benchmark : GetBenchmarks(micro, dir, macroSize))
+        {
+            if (benchmark.name.find(filter) != std::string::npos)
+                benchmarks.push_back(benchmark);
+        }
+
+        if (std::any_of(benchmarks.begin(), benchmarks.end(),
+                        [](const Benchmark& benchmark) { return benchmark.name.compare(0, 6, "micro/") == 0; }))
+            micro.Generate();
+
+        std::vector<Result> results;
+        for (const Benchmark& benchmark : benchmarks)
+        {
+            results.push_back(Run(benchmark, repeat));
+            std::cerr << benchmark.name << ": " << results.back().best.time << "sec" << std::endl;
+        }
+
+        std::string json = ToJson(results, repeat, macroSize);
+        if (outputFile.empty())
+        {
+            std::cout << json;
+        }
+        else
+        {
+            std::ofstream file(outputFile);
+            file << json;
+            if (!file)
+                throw std::runtime_error("Cannot write " + outputFile);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
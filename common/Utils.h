@@ -12,7 +12,7 @@ inline uint64_t ReverseByteOrder(uint64_t value)
     union
     {
         uint64_t value;
-        char buffer[8ul];
+        unsigned char buffer[8ul];
     } x;
     x.value = value;
 
@@ -60,7 +60,7 @@ inline void GetPrefixTuple(const char* str, size_t size, std::tuple<uint64_t, ui
 
     std::get<0>(*result) = ReverseByteOrder(data[0]);
     std::get<1>(*result) = ReverseByteOrder(data[1]);
-    std::get<2>(*result) = ReverseByteOrder(data[1]);
+    std::get<2>(*result) = ReverseByteOrder(data[2]);
 }
 
 inline void GetPrefixTuple(const char* str, size_t size, std::tuple<uint64_t, uint64_t, uint64_t, uint64_t>* result)
@@ -90,7 +90,7 @@ inline std::string GetPlatformEol()
 }
 
 // Can parse "3000", "3K", "3.5M", 100G.
-size_t GetSize(const std::string& param)
+inline size_t GetSize(const std::string& param)
 {
     if (param.empty())
         throw std::logic_error("Empty file size");
@@ -134,7 +134,7 @@ inline uint64_t to_ui64(char c)
     return static_cast<unsigned char>(c);
 }
 
-uint32_t fast_atoi(const char* ptr)
+inline uint32_t fast_atoi(const char* ptr)
 {
     uint32_t result = 0;
     for (;;)
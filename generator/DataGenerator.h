@@ -0,0 +1,185 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+
+// Shape of generated data, lines are "<number>. <string>".
+struct GeneratorSettings
+{
+    uint64_t seed = 0;
+    size_t minWords = 1; // words of string
+    size_t maxWords = 10;
+    bool exponentialLength = false; // most lines have few words, some have up to maxWords; uniform otherwise
+    double duplicates = 1.0 / 42; // ratio of lines taken from the pool of repeated lines
+    size_t duplicatePool = 100; // number of distinct repeated lines
+    double sorted = 0; // ratio of lines which are in ascending order already
+    size_t prefixSize = 0; // bytes shared by all strings at their beginning
+    double nonAscii = 0; // ratio of words with non-ASCII (UTF-8) letters
+};
+
+// Generates data by independent blocks: a block depends on the seed and its index only,
+// so blocks are generated by parallel threads and written at their offsets,
+// and the output is the same for the seed regardless of number of threads.
+class DataGenerator
+{
+public:
+    static const size_t MaxNumber = 1000000;
+    static const size_t MinLineSize = 5; // "1. a\n"
+
+    DataGenerator(const GeneratorSettings& settings) : m_settings(settings)
+    {
+        if (settings.minWords == 0 || settings.minWords > settings.maxWords)
+            throw std::logic_error("Invalid number of words");
+        if (!IsRatio(settings.duplicates) || !IsRatio(settings.sorted) || !IsRatio(settings.nonAscii))
+            throw std::logic_error("Invalid ratio");
+
+        std::mt19937_64 random(settings.seed);
+        m_words.resize(10000);
+        for (std::string& word : m_words)
+            word = MakeWord(random, false);
+
+        m_nonAsciiWords.resize(1000);
+        for (std::string& word : m_nonAsciiWords)
+            word = MakeWord(random, true);
+
+        for (size_t n = 0; n < settings.prefixSize; ++n)
+            m_prefix += static_cast<char>('a' + random() % 26);
+
+        for (size_t n = 0; n < settings.duplicatePool; ++n)
+        {
+            std::string line;
+            AppendLine(random, false, 0, &line);
+            m_pool.push_back(line);
+        }
+    }
+
+    // Generates block of exactly size bytes (size >= MinLineSize), it contains whole lines.
+    void GenerateBlock(size_t index, size_t size, std::string* block) const
+    {
+        if (size < MinLineSize)
+            throw std::logic_error("Block is too small");
+
+        // seeds of adjacent blocks are not correlated
+        std::seed_seq seed{static_cast<uint32_t>(m_settings.seed), static_cast<uint32_t>(m_settings.seed >> 32),
+                           static_cast<uint32_t>(index), static_cast<uint32_t>(static_cast<uint64_t>(index) >> 32)};
+        std::mt19937_64 random(seed);
+        std::uniform_real_distribution<double> chance;
+
+        block->clear();
+        block->reserve(size);
+        std::string line;
+        for (uint64_t lineIndex = 0; ; ++lineIndex)
+        {
+            line.clear();
+            if (!m_pool.empty() && chance(random) < m_settings.duplicates)
+            {
+                line = m_pool[random() % m_pool.size()];
+            }
+            else
+            {
+                bool isSorted = chance(random) < m_settings.sorted;
+                AppendLine(random, isSorted, (static_cast<uint64_t>(index) << 24) + lineIndex, &line);
+            }
+
+            // the rest must fit a line, so the block ends with a whole line
+            size_t rest = size - block->size();
+            if (line.size() != rest && line.size() + MinLineSize > rest)
+                break;
+
+            block->append(line);
+            if (block->size() == size)
+                return;
+        }
+
+        AppendFiller(random, size - block->size(), block);
+    }
+
+private:
+
+    static bool IsRatio(double value) { return value >= 0 && value <= 1; }
+
+    // 1-12 letters, non-ASCII words have 2-byte UTF-8 letters (Latin-1 Supplement and Cyrillic)
+    static std::string MakeWord(std::mt19937_64& random, bool isNonAscii)
+    {
+        std::string word;
+        size_t length = 1 + random() % 12;
+        for (size_t n = 0; n < length; ++n)
+        {
+            if (isNonAscii && random() % 2 == 0)
+            {
+                bool isCyrillic = random() % 2 == 0;
+                word += static_cast<char>(isCyrillic ? 0xd0 : 0xc3);
+                word += static_cast<char>((isCyrillic ? 0xb0 : 0xa0) + random() % 16);
+            }
+            else
+            {
+                word += static_cast<char>('a' + random() % 26);
+            }
+        }
+        return word;
+    }
+
+    size_t GetWordCount(std::mt19937_64& random) const
+    {
+        size_t range = m_settings.maxWords - m_settings.minWords;
+        if (!m_settings.exponentialLength)
+            return m_settings.minWords + random() % (range + 1);
+
+        std::exponential_distribution<double> distribution(4.0 / std::max<size_t>(range, 1));
+        return m_settings.minWords + std::min(static_cast<size_t>(distribution(random)), range);
+    }
+
+    // sortKey: ascending key of sorted line
+    void AppendLine(std::mt19937_64& random, bool isSorted, uint64_t sortKey, std::string* line) const
+    {
+        std::uniform_real_distribution<double> chance;
+
+        *line += std::to_string(random() % MaxNumber);
+        *line += ". ";
+        *line += m_prefix;
+
+        if (isSorted)
+        {
+            // fixed width base-26 number, so keys are compared as strings
+            char key[10];
+            for (size_t n = sizeof(key); n > 0; --n, sortKey /= 26)
+                key[n - 1] = static_cast<char>('a' + sortKey % 26);
+            line->append(key, sizeof(key));
+            *line += ' ';
+        }
+
+        size_t wordCount = GetWordCount(random);
+        for (size_t n = 0; n < wordCount; ++n)
+        {
+            if (n > 0)
+                *line += ' ';
+
+            if (!m_nonAsciiWords.empty() && chance(random) < m_settings.nonAscii)
+                *line += m_nonAsciiWords[random() % m_nonAsciiWords.size()];
+            else
+                *line += m_words[random() % m_words.size()];
+        }
+        *line += '\n';
+    }
+
+    // line of exactly size bytes (size >= MinLineSize)
+    static void AppendFiller(std::mt19937_64& random, size_t size, std::string* block)
+    {
+        std::string number = std::to_string(random() % 10); // a digit, so the line fits MinLineSize
+        *block += number;
+        *block += ". ";
+        for (size_t n = number.size() + 3; n < size; ++n)
+            *block += static_cast<char>('a' + random() % 26);
+        *block += '\n';
+    }
+
+    GeneratorSettings m_settings;
+    std::vector<std::string> m_words;
+    std::vector<std::string> m_nonAsciiWords;
+    std::string m_prefix;
+    std::vector<std::string> m_pool; // repeated lines
+};
@@ -1,47 +1,129 @@
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <random>
 #include <stdexcept>
-#include <cstdlib>
-#include <cctype>
+#include <exception>
+#include <cstdio>
 
-#include <boost/circular_buffer.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include "common/Clock.h"
 #include "common/Utils.h"
+#include "DataGenerator.h"
 
-extern const char* words[];
+// Blocks are generated and written independently, so threads need no synchronization.
+const size_t BlockSize = 4*1024*1024;
 
-const int MaxWords = 10;
-const int MaxNum = 1000000;
-const size_t RepeatBufferSize = 100;
+const char* GetUsage()
+{
+    return
+        "Usage: generator [options] <file-name> <size>\n"
+        "Options:\n"
+        "  --seed <N>            the same seed gives the same file, random by default\n"
+        "  --threads <N>         number of generating threads, number of cores by default\n"
+        "  --words <min>-<max>   number of words in line, default 1-10\n"
+        "  --length <name>       distribution of number of words: uniform (default) or exponential\n"
+        "  --duplicates <ratio>  ratio of lines taken from the pool of repeated lines, default 0.024\n"
+        "  --duplicate-pool <N>  number of distinct repeated lines, default 100\n"
+        "  --sorted <ratio>      ratio of lines which are in ascending order already, default 0\n"
+        "  --prefix <N>          bytes shared by all strings at their beginning, default 0\n"
+        "  --non-ascii <ratio>   ratio of words with non-ASCII (UTF-8) letters, default 0\n"
+        "Example: generator --seed 1 --duplicates 0.5 data.txt 100G\n";
+}
 
-size_t GetWordsCount();
-size_t GetFileSize(const std::string& param);
-std::string MakeNewString();
-void Generate(const char* fileName, size_t requestedSize);
-void PrintStat();
+template <class T>
+T ParseValue(const std::string& name, const std::string& value)
+{
+    try
+    {
+        return boost::lexical_cast<T>(value);
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+        throw std::logic_error("Invalid value of " + name + " '" + value + "'");
+    }
+}
+
+void Generate(const std::string& fileName, size_t size, const GeneratorSettings& settings, size_t threadCount);
 
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    GeneratorSettings settings;
+    settings.seed = std::random_device()();
+    size_t threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::string> positional;
+
+    try
     {
-        std::cerr << "Usage: generator <output-file> <file-size>" << std::endl;
-        PrintStat();
+        for (int n = 1; n < argc; ++n)
+        {
+            std::string arg = argv[n];
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                positional.push_back(arg);
+                continue;
+            }
+
+            if (n + 1 >= argc)
+                throw std::logic_error("Missing value of " + arg);
+            std::string value = argv[++n];
+
+            if (arg == "--seed")
+                settings.seed = ParseValue<uint64_t>(arg, value);
+            else if (arg == "--threads")
+                threadCount = std::max<size_t>(ParseValue<size_t>(arg, value), 1);
+            else if (arg == "--words")
+            {
+                size_t dash = value.find('-');
+                settings.minWords = ParseValue<size_t>(arg, value.substr(0, dash));
+                settings.maxWords = dash == std::string::npos ? settings.minWords
+                                                              : ParseValue<size_t>(arg, value.substr(dash + 1));
+            }
+            else if (arg == "--length")
+            {
+                if (value != "uniform" && value != "exponential")
+                    throw std::logic_error("Invalid length distribution '" + value + "'");
+                settings.exponentialLength = value == "exponential";
+            }
+            else if (arg == "--duplicates")
+                settings.duplicates = ParseValue<double>(arg, value);
+            else if (arg == "--duplicate-pool")
+                settings.duplicatePool = ParseValue<size_t>(arg, value);
+            else if (arg == "--sorted")
+                settings.sorted = ParseValue<double>(arg, value);
+            else if (arg == "--prefix")
+                settings.prefixSize = ParseValue<size_t>(arg, value);
+            else if (arg == "--non-ascii")
+                settings.nonAscii = ParseValue<double>(arg, value);
+            else
+                throw std::logic_error("Unknown option " + arg);
+        }
+
+        if (positional.size() != 2)
+            throw std::logic_error("Invalid number of arguments");
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        std::cerr << GetUsage();
         return 1;
     }
 
-    srand(time(0));
-
     try
     {
-        const size_t requestedSize = GetSize(argv[2]);
+        const size_t requestedSize = GetSize(positional[1]);
 
         Clock clock;
         clock.Start();
 
-        Generate(argv[1], requestedSize);
+        Generate(positional[0], requestedSize, settings, threadCount);
 
-        std::cout << "Success! Elapsed time: " << clock.ElapsedTime() << " sec."<< std::endl;
+        std::cout << "Success! Seed: " << settings.seed << ", elapsed time: " << clock.ElapsedTime() << " sec." << std::endl;
     }
     catch(std::exception& e)
     {
@@ -52,92 +134,64 @@ int main(int argc, char** argv)
     return 0;
 }
 
-void Generate(const char* fileName, size_t requestedSize)
+// Threads take blocks one by one and write them at their offsets (the last block takes the rest of size).
+void Generate(const std::string& fileName, size_t size, const GeneratorSettings& settings, size_t threadCount)
 {
-    std::ofstream file(fileName);
-    if (!file)
-        throw std::logic_error("Cannot open file");
+    if (size < DataGenerator::MinLineSize)
+        throw std::logic_error("File size is too small");
 
-    // Task conditions requires that some strings are met more than 1 time in the file
-    // Store recent strings and insert them second time sometimes
-    boost::circular_buffer<std::string> recentStrings(RepeatBufferSize);
+    DataGenerator generator(settings);
 
-    while (file.tellp() < requestedSize)
     {
-        int num = rand() % MaxNum;
-
-        file << num << ".";
-
-        const int magicNumber = 42;
-        bool usePrevString = !recentStrings.empty() && (rand() % magicNumber == 0);
-        if (usePrevString)
-        {
-            // get random string from recentStrings
-            size_t index = static_cast<size_t>(rand() % recentStrings.size());
-            file << recentStrings[index];
-        }
-        else
-        {
-            // generate a new string
-            recentStrings.push_back(MakeNewString());
-            file << recentStrings.back();
-        }
-
-        file << std::endl;
+        std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(fileName.c_str(), "wb"), &fclose);
+        if (!file)
+            throw std::runtime_error("Cannot open file " + fileName);
     }
+    boost::filesystem::resize_file(fileName, size);
 
-    file.close();
-}
-
-size_t GetWordsCount()
-{
-    size_t n = 0;
-    while(words[n]) ++n;
-    return n;
-}
-
-// return new string (always started with space).
-std::string MakeNewString()
-{
-    static const size_t totalWords = GetWordsCount();
+    const size_t blockCount = std::max<size_t>(size / BlockSize, 1);
+    std::atomic<size_t> nextBlock(0);
 
-    std::string result;
-    result.reserve(50);
-    int numWords = rand() % MaxWords + 1;
-    for (int n = 0; n < numWords; ++n)
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(threadCount);
+    for (size_t n = 0; n < threadCount; ++n)
     {
-        size_t wordIndex = rand() % totalWords;
-        result += " ";
-        result += words[wordIndex];
-    }
-    return result;
-}
-
-void PrintStat()
-{
-    size_t N = 0;
-    size_t totalLen = 0;
-    std::vector<size_t> lengthDistr;
-
-    while (const char* word = words[N])
-    {
-        size_t len = strlen(word);
-        totalLen += len;
-
-        if (lengthDistr.size() < len + 1)
-            lengthDistr.resize(len + 1);
-
-        lengthDistr[len] += 1;
-        ++N;
+        threads.emplace_back([&, n]()
+        {
+            try
+            {
+                std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(fileName.c_str(), "r+b"), &fclose);
+                if (!file)
+                    throw std::runtime_error("Cannot open file " + fileName);
+
+                std::string block;
+                for (size_t index = nextBlock++; index < blockCount; index = nextBlock++)
+                {
+                    size_t offset = index * BlockSize;
+                    size_t blockSize = index + 1 == blockCount ? size - offset : BlockSize;
+                    generator.GenerateBlock(index, blockSize, &block);
+
+                    if (fseeko(file.get(), static_cast<off_t>(offset), SEEK_SET) != 0 ||
+                        fwrite(block.data(), 1u, block.size(), file.get()) != block.size())
+                        throw std::runtime_error("Cannot write to file " + fileName);
+                }
+
+                if (fflush(file.get()) != 0)
+                    throw std::runtime_error("Cannot write to file " + fileName);
+            }
+            catch (...)
+            {
+                errors[n] = std::current_exception();
+            }
+        });
     }
 
-    std::cout << "Words in dictionary: " << N << std::endl;
-    std::cout << "Average word length: " << totalLen * 1.0  / N << std::endl;
-
-    std::cout << "Word length disrtibution: " << std::endl;
+    for (std::thread& thread : threads)
+        thread.join();
 
-    for (size_t n = 0; n < lengthDistr.size(); ++n)
+    for (const std::exception_ptr& error : errors)
     {
-        std::cout << n << ":" << lengthDistr[n] << "(" << lengthDistr[n] * 100.0 / N << "%)" << std::endl;
+        if (error)
+            std::rethrow_exception(error);
     }
 }
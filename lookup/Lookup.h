@@ -0,0 +1,101 @@
+#pragma once
+
+#include "sorter/SparseIndex.h"
+#include "sorter/FileReader.h"
+#include "sorter/SortingEntry.h"
+#include "sorter/KeySpec.h"
+
+#include <stdexcept>
+#include <cstdio>
+#include <string>
+#include <memory>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+// Prints lines of sorted file with the first sort key in [from, to].
+// The sparse index <file>.idx written by sorter --index gives the part of file to read.
+struct LookupJob
+{
+    const std::string& fileName;
+    const SparseIndex& index;
+    std::string from; // lines with these keys, see MakeLine()
+    std::string to;
+    FILE* output; // e.g. stdout
+
+    // entries compare only the first key of the index sort order (see DispatchFirstKeySpec())
+    template <class TEntry>
+    int Run()
+    {
+        TEntry fromEntry(from.data(), from.size());
+        TEntry toEntry(to.data(), to.size());
+        if (toEntry < fromEntry)
+            throw std::logic_error("Invalid key range");
+
+        bool isCounted = index.settings.isCounted;
+        auto toEntryOf = [isCounted](FileReader::Buffer line)
+        {
+            if (isCounted)
+                ParseCount(&line);
+            return TEntry(line.data, line.size);
+        };
+
+        auto isBefore = [&](const std::string& line)
+        {
+            return toEntryOf(FileReader::Buffer{line.data(), line.size()}) < fromEntry;
+        };
+        auto isAfter = [&](const std::string& line)
+        {
+            return toEntry < toEntryOf(FileReader::Buffer{line.data(), line.size()});
+        };
+
+        FileReader reader(fileName.c_str());
+        if (!index.entries.empty() && index.entries.back().offset >= reader.GetFileSize())
+            throw std::runtime_error("Index is out of date: " + GetIndexFile(fileName));
+
+        auto range = index.FindRange(isBefore, isAfter, reader.GetFileSize());
+
+        // the range is read at once, a longer range is read by chunks
+        const size_t maxLineSize = 64*1024;
+        size_t bufSize = std::min<uint64_t>(range.second - range.first, 4*1024*1024) + maxLineSize;
+        auto buffer = std::make_shared<std::vector<char>>(bufSize);
+
+        reader.Seek(range.first);
+        const std::string& eol = reader.GetEol();
+        size_t found = 0;
+        while (reader.LoadNextChunk(buffer))
+        {
+            FileReader::Buffer line;
+            while (reader.TryGetLine(&line))
+            {
+                TEntry entry = toEntryOf(line);
+                if (entry < fromEntry)
+                    continue;
+                if (toEntry < entry)
+                    return found > 0 ? 0 : 2;
+
+                fwrite(line.data, 1u, line.size, output);
+                fwrite(eol.data(), 1u, eol.size(), output);
+                ++found;
+            }
+        }
+        return found > 0 ? 0 : 2;
+    }
+};
+
+// the line with key, it has the format of sorted lines: "<number>. <string>"
+inline std::string MakeLine(SortKey key, const std::string& value)
+{
+    if (key == SortKey::String)
+        return "0. " + value;
+
+    try
+    {
+        boost::lexical_cast<uint32_t>(value);
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+        throw std::logic_error("Invalid number '" + value + "'");
+    }
+    return value + ". ";
+}
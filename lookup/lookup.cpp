@@ -0,0 +1,37 @@
+#include "Lookup.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <string>
+
+int main(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        std::cerr << "Usage: lookup <sorted-file> <from-key> [<to-key>]" << std::endl;
+        std::cerr << "Prints lines with the first sort key in [from-key, to-key], exit code is 2 if there are none." << std::endl;
+        std::cerr << "The file must be sorted with --index option." << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        std::string fileName = argv[1];
+        SparseIndex index;
+        index.Load(GetIndexFile(fileName));
+
+        // the file is sorted by the first key too
+        KeySpec spec = ParseKeySpec(index.settings.keySpec);
+
+        LookupJob job = {fileName, index, MakeLine(spec.first, argv[2]), MakeLine(spec.first, argv[argc - 1]), stdout};
+        int result = DispatchFirstKeySpec(spec, job);
+        fflush(stdout);
+        return result;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+}
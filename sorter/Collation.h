@@ -0,0 +1,315 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+
+// Simple collation of UTF-8 strings without locale data.
+// A string is mapped to its collation key character by character (e.g. "Éclair" -> "eclair"),
+// keys are compared by memcmp, so sorting by keys is as fast as sorting by strings.
+// Characters of 1 and 2 byte UTF-8 sequences are mapped (Latin, Greek, Cyrillic),
+// other bytes are kept as is. A key is never longer than its string.
+class Collation
+{
+public:
+    enum Rule : uint32_t
+    {
+        IgnoreCase = 1, // "icase": case folding (ASCII, Latin-1, Latin Extended-A, Greek, Cyrillic), "ß" is "ss"
+        IgnoreAccents = 2, // "noaccents": Latin-1 letters with diacritics are their base letters
+        IgnorePunct = 4 // "nopunct": ASCII punctuation is skipped
+    };
+
+    explicit Collation(uint32_t rules = 0) : m_rules(rules)
+    {
+        for (uint32_t code = 0; code < m_map.size(); ++code)
+            m_map[code] = MakeMapping(code);
+    }
+
+    uint32_t GetRules() const { return m_rules; }
+
+    // The collation of rules, it is built once and never changes (see CollatedEntry).
+    template <uint32_t Rules>
+    static const Collation& Get()
+    {
+        static const Collation collation(Rules);
+        return collation;
+    }
+
+    // Writes the key of str to key (it has room for size bytes), returns the key size.
+    size_t MakeKey(const char* str, size_t size, char* key) const
+    {
+        const char* end = str + size;
+        char* out = key;
+        while (str < end)
+            out += Fold(str, end, out);
+        return out - key;
+    }
+
+    // The first 8 bytes of the key as big-endian number, zero padded.
+    uint64_t GetKeyPrefix(const char* str, size_t size) const
+    {
+        const char* end = str + size;
+        char key[8 + 2] = {0}; // the last character may write 2 bytes
+        size_t keySize = 0;
+        while (str < end && keySize < 8)
+            keySize += Fold(str, end, key + keySize);
+
+        uint64_t prefix = 0;
+        for (size_t n = 0; n < 8; ++n)
+            prefix = (prefix << 8) | static_cast<unsigned char>(key[n]);
+        return prefix;
+    }
+
+    // Compares keys of strings without building them, like memcmp of keys.
+    int Compare(const char* str, size_t size, const char* str1, size_t size1) const
+    {
+        Cursor cursor(str, size);
+        Cursor cursor1(str1, size1);
+        for (;;)
+        {
+            int ch = cursor.Next(*this);
+            int ch1 = cursor1.Next(*this);
+            if (ch != ch1)
+                return ch < ch1 ? -1 : 1;
+            if (ch < 0)
+                return 0;
+        }
+    }
+
+private:
+
+    struct Mapping
+    {
+        uint8_t size = 0;
+        char bytes[2] = {0, 0};
+    };
+
+    // key bytes of a string one by one
+    struct Cursor
+    {
+        const char* pos;
+        const char* end;
+        char key[2];
+        size_t keyPos = 0;
+        size_t keySize = 0;
+
+        Cursor(const char* str, size_t size) : pos(str), end(str + size) {}
+
+        // next byte of key, -1 at the end
+        int Next(const Collation& collation)
+        {
+            while (keyPos == keySize)
+            {
+                if (pos == end)
+                    return -1;
+                keySize = collation.Fold(pos, end, key);
+                keyPos = 0;
+            }
+            return static_cast<unsigned char>(key[keyPos++]);
+        }
+    };
+
+    // Maps the character at str to out (0-2 bytes, not more than the character takes),
+    // moves str to the next character, returns the number of bytes written.
+    size_t Fold(const char*& str, const char* end, char* out) const
+    {
+        unsigned char ch = static_cast<unsigned char>(*str);
+        if (ch < 0x80)
+        {
+            const Mapping& mapping = m_map[ch];
+            out[0] = mapping.bytes[0];
+            ++str;
+            return mapping.size;
+        }
+
+        if (ch >= 0xc2 && ch <= 0xdf && end - str >= 2 && (str[1] & 0xc0) == 0x80)
+        {
+            const Mapping& mapping = m_map[((ch & 0x1f) << 6) | (str[1] & 0x3f)];
+            out[0] = mapping.bytes[0];
+            out[1] = mapping.bytes[1];
+            str += 2;
+            return mapping.size;
+        }
+
+        // 3 and 4 byte sequences and invalid UTF-8
+        *out = *str++;
+        return 1;
+    }
+
+    Mapping MakeMapping(uint32_t code) const
+    {
+        Mapping mapping;
+        if ((m_rules & IgnoreCase) && code == 0xdf) // ß
+        {
+            mapping.size = 2;
+            mapping.bytes[0] = mapping.bytes[1] = 's';
+            return mapping;
+        }
+
+        if (m_rules & IgnoreCase)
+            code = FoldCase(code);
+        if (m_rules & IgnoreAccents)
+            code = StripAccent(code);
+        if ((m_rules & IgnorePunct) && code < 0x80 && ispunct(static_cast<int>(code)))
+            return mapping;
+
+        if (code < 0x80)
+        {
+            mapping.size = 1;
+            mapping.bytes[0] = static_cast<char>(code);
+        }
+        else
+        {
+            mapping.size = 2;
+            mapping.bytes[0] = static_cast<char>(0xc0 | (code >> 6));
+            mapping.bytes[1] = static_cast<char>(0x80 | (code & 0x3f));
+        }
+        return mapping;
+    }
+
+    static uint32_t FoldCase(uint32_t code)
+    {
+        if (code >= 'A' && code <= 'Z') return code + 0x20;
+        if (code >= 0xc0 && code <= 0xde && code != 0xd7) return code + 0x20; // Latin-1
+        if (code >= 0x100 && code <= 0x137) return code | 1; // Latin Extended-A pairs
+        if (code >= 0x139 && code <= 0x148) return code + (code & 1);
+        if (code >= 0x14a && code <= 0x177) return code | 1;
+        if (code == 0x178) return 0xff; // Ÿ
+        if (code >= 0x179 && code <= 0x17e) return code + (code & 1);
+        if (code >= 0x391 && code <= 0x3ab && code != 0x3a2) return code + 0x20; // Greek
+        if (code == 0x3c2) return 0x3c3; // final sigma
+        if (code >= 0x400 && code <= 0x40f) return code + 0x50; // Cyrillic
+        if (code >= 0x410 && code <= 0x42f) return code + 0x20;
+        return code;
+    }
+
+    // Latin-1 letters, 0 means no base letter
+    static uint32_t StripAccent(uint32_t code)
+    {
+        static const char baseLetters[] = "AAAAAA\0CEEEEIIIIDNOOOOO\0OUUUUY\0\0"
+                                          "aaaaaa\0ceeeeiiiidnooooo\0ouuuuy\0y";
+        if (code < 0xc0 || code > 0xff || baseLetters[code - 0xc0] == 0)
+            return code;
+        return static_cast<unsigned char>(baseLetters[code - 0xc0]);
+    }
+
+    uint32_t m_rules;
+    std::array<Mapping, 0x800> m_map; // code points of 1 and 2 byte UTF-8 sequences
+};
+
+// Parses comma separated rules, e.g. "icase,noaccents".
+// throws std::logic_error if rules are invalid
+inline uint32_t ParseCollation(const std::string& text)
+{
+    uint32_t rules = 0;
+    std::istringstream stream(text);
+    std::string rule;
+    while (std::getline(stream, rule, ','))
+    {
+        if (rule == "icase")
+            rules |= Collation::IgnoreCase;
+        else if (rule == "noaccents")
+            rules |= Collation::IgnoreAccents;
+        else if (rule == "nopunct")
+            rules |= Collation::IgnorePunct;
+        else
+            throw std::logic_error("Invalid collation rule '" + rule + "'");
+    }
+
+    if (rules == 0)
+        throw std::logic_error("Empty collation '" + text + "'");
+    return rules;
+}
+
+// the text of rules which is parsed by ParseCollation()
+inline std::string FormatCollation(uint32_t rules)
+{
+    std::string text;
+    if (rules & Collation::IgnoreCase) text += ",icase";
+    if (rules & Collation::IgnoreAccents) text += ",noaccents";
+    if (rules & Collation::IgnorePunct) text += ",nopunct";
+    return text.empty() ? text : text.substr(1);
+}
+
+// Arena of collation keys of entries, it is owned by the owner of entries (e.g. chunk),
+// so keys are built once per line and live as long as entries.
+// Entries built by a thread store their keys in the arena of the current Scope of the thread,
+// without the scope keys are not stored and compared by Collation::Compare().
+class CollationKeys
+{
+    static const size_t BlockSize = 1024 * 1024;
+
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_block = 0; // the current block
+    size_t m_used = 0; // bytes of the current block
+
+public:
+    class Scope
+    {
+        CollationKeys* m_previous;
+    public:
+        explicit Scope(CollationKeys* keys) : m_previous(Current()) { Current() = keys; }
+        ~Scope() { Current() = m_previous; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    static CollationKeys* GetCurrent() { return Current(); }
+
+    // Builds the key of str, returns pointer to the key size (uint32_t) followed by the key.
+    const char* Add(const Collation& collation, const char* str, size_t size)
+    {
+        const size_t maxSize = sizeof(uint32_t) + size;
+        while (m_block < m_blocks.size() && m_used + maxSize > m_blocks[m_block].size)
+        {
+            ++m_block;
+            m_used = 0;
+        }
+        if (m_block == m_blocks.size())
+        {
+            size_t blockSize = maxSize > BlockSize ? maxSize : BlockSize;
+            m_blocks.push_back(Block{std::unique_ptr<char[]>(new char[blockSize]), blockSize});
+        }
+
+        char* key = m_blocks[m_block].data.get() + m_used;
+        uint32_t keySize = static_cast<uint32_t>(collation.MakeKey(str, size, key + sizeof(uint32_t)));
+        memcpy(key, &keySize, sizeof(keySize));
+        m_used += sizeof(uint32_t) + keySize;
+        return key;
+    }
+
+    // removes keys, memory is kept for the next keys
+    void Clear()
+    {
+        m_block = 0;
+        m_used = 0;
+    }
+
+    void Swap(CollationKeys& other)
+    {
+        std::swap(m_blocks, other.m_blocks);
+        std::swap(m_block, other.m_block);
+        std::swap(m_used, other.m_used);
+    }
+
+private:
+
+    static CollationKeys*& Current()
+    {
+        static thread_local CollationKeys* keys = nullptr;
+        return keys;
+    }
+};
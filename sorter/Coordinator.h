@@ -0,0 +1,556 @@
+#pragma once
+
+#include "FileRegistry.h"
+#include "FileReader.h"
+#include "FileWriter.h"
+#include "InitialSorter.h"
+#include "Merger.h"
+#include "PartitionMerger.h"
+#include "SortingEntry.h"
+
+#include "common/Clock.h"
+
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/noncopyable.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Connection between coordinator and worker process (local socket).
+// Message is a line: command and optional argument separated by tab.
+class Channel : boost::noncopyable
+{
+    int m_fd;
+    std::string m_received; // the beginning of the next messages
+
+public:
+    explicit Channel(int fd) : m_fd(fd)
+    {
+    }
+
+    ~Channel()
+    {
+        Close();
+    }
+
+    void Close()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+        m_fd = -1;
+    }
+
+    void Send(const std::string& command, const std::string& argument = std::string())
+    {
+        std::string message = command + "\t" + argument + "\n";
+        const char* data = message.data();
+        size_t size = message.size();
+        while (size > 0)
+        {
+            // the other side may be dead, it is reported by error instead of SIGPIPE
+            ssize_t sent = send(m_fd, data, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0)
+                throw std::runtime_error("Cannot send message");
+
+            data += sent;
+            size -= sent;
+        }
+    }
+
+    // Returns false if the other side is closed.
+    bool Receive(std::string* command, std::string* argument)
+    {
+        size_t eol;
+        while ((eol = m_received.find('\n')) == std::string::npos)
+        {
+            char data[4096];
+            ssize_t size = read(m_fd, data, sizeof(data));
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0)
+                throw std::runtime_error("Cannot receive message");
+            if (size == 0)
+                return false;
+
+            m_received.append(data, size);
+        }
+
+        size_t tab = m_received.find('\t');
+        if (tab > eol)
+            throw std::runtime_error("Invalid message");
+
+        command->assign(m_received, 0, tab);
+        argument->assign(m_received, tab + 1, eol - tab - 1);
+        m_received.erase(0, eol + 1);
+        return true;
+    }
+};
+
+// Worker process of Coordinator: splits its slice of input by key ranges,
+// then sorts one range from the parts written by all workers.
+//
+// Commands (replies):
+//     splitter <line>             lines which split key ranges, in order
+//     slice <begin> <end> <file>  part of input file, lines starting in [begin, end)
+//     partition <prefix>          writes lines of slices to <prefix>.<range> (partitioned <bytes>)
+//     input <file>                a part of the range written by a worker
+//     sort <file>                 sorts inputs to the file, they are deleted (sorted <bytes>)
+//     exit
+// Any command can be replied by "error <message>", the worker exits then.
+template <class TEntry>
+class SortWorker
+{
+    struct Slice
+    {
+        std::string fileName;
+        size_t begin;
+        size_t end;
+    };
+
+    Channel& m_channel;
+    size_t m_chunkSize;
+    size_t m_readBufSize;
+    DuplicateMode m_duplicates;
+
+    std::vector<std::string> m_splitters;
+    std::vector<Slice> m_slices;
+    std::vector<std::string> m_inputs;
+
+public:
+    SortWorker(Channel& channel, size_t chunkSize, size_t readBufSize, DuplicateMode duplicates)
+        : m_channel(channel), m_chunkSize(chunkSize), m_readBufSize(readBufSize), m_duplicates(duplicates)
+    {
+    }
+
+    // Processes commands until exit, returns false if a command is failed.
+    bool Run()
+    {
+        std::string command;
+        std::string argument;
+        while (m_channel.Receive(&command, &argument))
+        {
+            try
+            {
+                if (command == "splitter")
+                    m_splitters.push_back(argument);
+                else if (command == "slice")
+                    m_slices.push_back(ParseSlice(argument));
+                else if (command == "partition")
+                    m_channel.Send("partitioned", std::to_string(Partition(argument)));
+                else if (command == "input")
+                    m_inputs.push_back(argument);
+                else if (command == "sort")
+                    m_channel.Send("sorted", std::to_string(Sort(argument)));
+                else if (command == "exit")
+                    return true;
+                else
+                    throw std::logic_error("Unknown command '" + command + "'");
+            }
+            catch (std::exception& e)
+            {
+                std::string message = e.what();
+                std::replace(message.begin(), message.end(), '\n', ' ');
+                m_channel.Send("error", message);
+                return false;
+            }
+        }
+
+        // coordinator is closed
+        return false;
+    }
+
+    static std::string GetPartitionFile(const std::string& prefix, size_t range)
+    {
+        return prefix + "." + std::to_string(range);
+    }
+
+private:
+
+    static Slice ParseSlice(const std::string& argument)
+    {
+        size_t tab0 = argument.find('\t');
+        size_t tab1 = argument.find('\t', tab0 + 1);
+        if (tab0 == std::string::npos || tab1 == std::string::npos)
+            throw std::logic_error("Invalid slice '" + argument + "'");
+
+        Slice slice;
+        slice.begin = boost::lexical_cast<size_t>(argument.substr(0, tab0));
+        slice.end = boost::lexical_cast<size_t>(argument.substr(tab0 + 1, tab1 - tab0 - 1));
+        slice.fileName = argument.substr(tab1 + 1);
+        return slice;
+    }
+
+    // Writes lines of slices to range files, returns their total size.
+    size_t Partition(const std::string& prefix)
+    {
+        Clock c;
+        c.Start();
+
+        std::vector<TEntry> bounds;
+        for (const std::string& splitter : m_splitters)
+            bounds.emplace_back(splitter.data(), splitter.size());
+
+        std::vector<std::unique_ptr<FileWriter>> files;
+        for (size_t n = 0; n <= m_splitters.size(); ++n)
+            files.emplace_back(new FileWriter(GetPartitionFile(prefix, n), 0, 1024*1024));
+
+        auto buffer = std::make_shared<std::vector<char>>(m_readBufSize);
+        size_t totalSize = 0;
+        for (const Slice& slice : m_slices)
+        {
+            FileReader reader(slice.fileName.c_str());
+            const std::string& eol = reader.GetEol();
+
+            // the line containing the byte before slice belongs to the previous slice
+            reader.Seek(slice.begin > 0 ? slice.begin - 1 : 0);
+            bool skipLine = slice.begin > 0;
+
+            bool isDone = false;
+            while (!isDone && reader.LoadNextChunk(buffer))
+            {
+                FileReader::Buffer line;
+                size_t lineOffset = reader.GetConsumedBytes();
+                while (reader.TryGetLine(&line))
+                {
+                    if (skipLine)
+                    {
+                        skipLine = false;
+                    }
+                    else if (lineOffset >= slice.end)
+                    {
+                        isDone = true;
+                        break;
+                    }
+                    else
+                    {
+                        // range n contains lines in [splitters[n - 1], splitters[n])
+                        TEntry entry(line.data, line.size);
+                        size_t range = std::upper_bound(bounds.begin(), bounds.end(), entry,
+                                                        [this](const TEntry& a, const TEntry& b)
+                        {
+                            return RunLess(a, b, m_duplicates);
+                        }) - bounds.begin();
+
+                        files[range]->write(line.data, line.size);
+                        files[range]->write(eol.data(), eol.size());
+                        totalSize += line.size + eol.size();
+                    }
+                    lineOffset = reader.GetConsumedBytes();
+                }
+            }
+        }
+
+        for (auto& file : files)
+            file->Close();
+
+        GetLog() << "Worker partition complete -> " << prefix << ", Size:" << totalSize
+                 << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+        return totalSize;
+    }
+
+    // Sorts inputs to the file, returns its size.
+    size_t Sort(const std::string& resultFile)
+    {
+        Clock c;
+        c.Start();
+
+        FileRegistry registry(m_inputs, resultFile);
+
+        InitialSorter<TEntry> sorter(m_chunkSize);
+        sorter.SetDuplicateMode(m_duplicates);
+        sorter.Process(registry);
+
+        Merger<TEntry> merger(8, m_readBufSize);
+        merger.SetDuplicateMode(m_duplicates);
+        merger.Process(registry);
+
+        std::vector<std::string> result = registry.PopFront(registry.Count());
+        if (result.empty())
+            FileWriter(resultFile).Close();
+        else if (result.at(0) != resultFile)
+            boost::filesystem::rename(result.at(0), resultFile);
+
+        for (const std::string& input : m_inputs)
+            boost::filesystem::remove(input);
+        m_inputs.clear();
+
+        GetLog() << "Worker sort complete -> " << resultFile << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+        return boost::filesystem::file_size(resultFile);
+    }
+};
+
+// Sorts input files by worker processes.
+// Ranges of keys are chosen by samples of input, every worker splits its slice of input by ranges,
+// then every worker sorts its range from the parts of all workers with InitialSorter and Merger.
+// Sorted ranges are concatenated to the result file.
+// Workers are forked processes connected by local sockets, parts are exchanged through files.
+template <class TEntry>
+class Coordinator : boost::noncopyable
+{
+    struct WorkerProcess
+    {
+        pid_t pid;
+        std::unique_ptr<Channel> channel;
+    };
+
+    size_t m_workerCount;
+    size_t m_chunkSize;
+    size_t m_readBufSize;
+    DuplicateMode m_duplicates = DuplicateMode::Keep;
+    std::vector<WorkerProcess> m_workers;
+
+public:
+    // chunkSize: memory of all workers
+    Coordinator(size_t workerCount, size_t chunkSize, size_t readBufSize)
+        : m_workerCount(std::max<size_t>(workerCount, 1)), m_chunkSize(chunkSize), m_readBufSize(readBufSize)
+    {
+    }
+
+    ~Coordinator()
+    {
+        StopWorkers();
+    }
+
+    void SetDuplicateMode(DuplicateMode mode) { m_duplicates = mode; }
+
+    // Sorts input files of registry to the result file.
+    // Tmp files are named by registry (see FileRegistry::MakeTmpFileName()), they are not added to it.
+    void Process(FileRegistry& registry, const std::string& resultFile)
+    {
+        Clock c;
+        c.Start();
+
+        const std::vector<std::string>& inputs = registry.GetInputFiles();
+        for (const std::string& input : inputs)
+        {
+            if (FileReader::IsStdStream(input))
+                throw std::logic_error("Workers cannot read stdin");
+        }
+
+        PartitionMerger<TEntry> sampler(m_readBufSize);
+        sampler.SetDuplicateMode(m_duplicates);
+        std::vector<std::string> splitters = sampler.ChooseSplitters(sampler.SampleFiles(registry, inputs), m_workerCount);
+        size_t rangeCount = splitters.size() + 1;
+
+        StartWorkers();
+
+        // parts and sorted ranges, they are removed if sorting is failed
+        std::vector<std::string> tmpFiles;
+        try
+        {
+            // every worker splits its slice of input by ranges
+            for (WorkerProcess& worker : m_workers)
+            {
+                for (const std::string& splitter : splitters)
+                    worker.channel->Send("splitter", splitter);
+            }
+            SendSlices(inputs);
+
+            // parts of ranges written by worker n are <partitionPrefixes[n]>.<range>
+            std::vector<std::string> partitionPrefixes;
+            for (size_t n = 0; n < m_workers.size(); ++n)
+            {
+                partitionPrefixes.push_back(registry.MakeTmpFileName("w", inputs));
+                for (size_t range = 0; range < rangeCount; ++range)
+                    tmpFiles.push_back(SortWorker<TEntry>::GetPartitionFile(partitionPrefixes.back(), range));
+                m_workers[n].channel->Send("partition", partitionPrefixes.back());
+            }
+            WaitReplies("partitioned", m_workers.size());
+
+            GetLog() << "Partition complete, Ranges:" << rangeCount << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+
+            // every worker sorts its range
+            std::vector<std::string> rangeFiles;
+            for (size_t range = 0; range < rangeCount; ++range)
+            {
+                Channel& channel = *m_workers[range].channel;
+                std::vector<std::string> parts;
+                for (size_t n = 0; n < m_workers.size(); ++n)
+                {
+                    parts.push_back(SortWorker<TEntry>::GetPartitionFile(partitionPrefixes[n], range));
+                    channel.Send("input", parts.back());
+                }
+
+                rangeFiles.push_back(registry.MakeTmpFileName("r", parts));
+                tmpFiles.push_back(rangeFiles.back());
+                channel.Send("sort", rangeFiles.back());
+            }
+            WaitReplies("sorted", rangeCount);
+
+            GetLog() << "Ranges sorted, Time:" << c.ElapsedTime() << "sec" << std::endl;
+
+            for (WorkerProcess& worker : m_workers)
+                worker.channel->Send("exit");
+            StopWorkers();
+
+            Concatenate(rangeFiles, resultFile, registry.GetIndexSettings());
+        }
+        catch (...)
+        {
+            // workers may write files until they are stopped
+            StopWorkers();
+            for (const std::string& file : tmpFiles)
+            {
+                boost::system::error_code ec;
+                boost::filesystem::remove(file, ec);
+            }
+            throw;
+        }
+
+        GetLog() << "Workers complete, Count:" << m_workerCount << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+    }
+
+private:
+
+    void StartWorkers()
+    {
+        // buffered output would be written by every process
+        GetLog().flush();
+        std::cout.flush();
+        fflush(stdout);
+
+        for (size_t n = 0; n < m_workerCount; ++n)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+                throw std::runtime_error("Cannot create socket");
+
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                close(fds[0]);
+                close(fds[1]);
+                throw std::runtime_error("Cannot start worker");
+            }
+
+            if (pid == 0)
+            {
+                // worker process, it never returns
+                close(fds[0]);
+                for (WorkerProcess& worker : m_workers)
+                    worker.channel->Close();
+
+                bool isOk = false;
+                try
+                {
+                    Channel channel(fds[1]);
+                    SortWorker<TEntry> worker(channel, m_chunkSize / m_workerCount, m_readBufSize, m_duplicates);
+                    isOk = worker.Run();
+                }
+                catch (...)
+                {
+                }
+                GetLog().flush();
+                _exit(isOk ? 0 : 1);
+            }
+
+            close(fds[1]);
+            m_workers.push_back(WorkerProcess{pid, std::unique_ptr<Channel>(new Channel(fds[0]))});
+        }
+    }
+
+    // workers exit when their channels are closed
+    void StopWorkers()
+    {
+        for (WorkerProcess& worker : m_workers)
+            worker.channel->Close();
+
+        for (WorkerProcess& worker : m_workers)
+        {
+            int status = 0;
+            while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR)
+            {
+            }
+        }
+        m_workers.clear();
+    }
+
+    // Splits inputs to slices of the same size, a slice per worker.
+    // Slices are split at any byte, workers find the beginning of lines.
+    void SendSlices(const std::vector<std::string>& inputs)
+    {
+        size_t totalSize = 0;
+        for (const std::string& input : inputs)
+            totalSize += boost::filesystem::file_size(input);
+
+        size_t sliceSize = totalSize / m_workers.size() + 1;
+        size_t worker = 0;
+        size_t used = 0; // bytes of the current slice
+        for (const std::string& input : inputs)
+        {
+            size_t size = boost::filesystem::file_size(input);
+            for (size_t begin = 0; begin < size; )
+            {
+                size_t end = std::min(size, begin + sliceSize - used);
+                m_workers[worker].channel->Send("slice", std::to_string(begin) + "\t" + std::to_string(end) + "\t" + input);
+
+                used += end - begin;
+                begin = end;
+                if (used == sliceSize)
+                {
+                    ++worker;
+                    used = 0;
+                }
+            }
+        }
+    }
+
+    // waits for the reply of the first count workers
+    void WaitReplies(const std::string& reply, size_t count)
+    {
+        for (size_t n = 0; n < count; ++n)
+        {
+            std::string command;
+            std::string argument;
+            if (!m_workers[n].channel->Receive(&command, &argument))
+                throw std::runtime_error("Worker " + std::to_string(n) + " exited");
+            if (command == "error")
+                throw std::runtime_error("Worker " + std::to_string(n) + ": " + argument);
+            if (command != reply)
+                throw std::runtime_error("Unexpected reply '" + command + "' of worker " + std::to_string(n));
+        }
+    }
+
+    // writes files one by one to the result file, they are deleted
+    void Concatenate(const std::vector<std::string>& files, const std::string& resultFile,
+                     const SparseIndexSettings& index)
+    {
+        size_t totalSize = 0;
+        for (const std::string& file : files)
+            totalSize += boost::filesystem::file_size(file);
+
+        FileWriter result(resultFile, totalSize);
+        result.EnableIndex(index);
+
+        std::vector<char> buffer(m_readBufSize);
+        for (const std::string& file : files)
+        {
+            std::unique_ptr<FILE, int(*)(FILE*)> input(fopen(file.c_str(), "rb"), &fclose);
+            if (!input)
+                throw std::runtime_error("Cannot open file " + file);
+
+            while (size_t size = fread(buffer.data(), 1u, buffer.size(), input.get()))
+                result.write(buffer.data(), size);
+
+            input.reset();
+            boost::filesystem::remove(file);
+        }
+        result.Close();
+    }
+};
+#endif
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "FileRegistry.h"
+#include "FileReader.h"
+#include "InitialSorter.h"
+#include "Merger.h"
+#include "SortingEntry.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdexcept>
+
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+
+// Sorts records produced in memory, without input and output files.
+// Records are collected into chunk buffer, full chunks are spilled to tmp runs,
+// which are merged when records are pulled.
+//
+// Usage:
+//     ExternalSorter<FastEntry> sorter("/tmp/my-service", GetSize("1G"));
+//     sorter.Push(line, size); ...
+//     sorter.Finish();
+//     FileReader::Buffer record;
+//     while (sorter.Next(&record)) { ... }
+template <class TEntry>
+class ExternalSorter : boost::noncopyable
+{
+    static_assert(TEntry::IsExternalBuffer, "ExternalSorter requires entries pointing to the buffer");
+
+    enum class State { Pushing, PullingChunk, PullingRuns };
+
+    FileRegistry m_registry;
+    InitialSorter<TEntry> m_sorter;
+    Merger<TEntry> m_merger;
+    ChunkData<TEntry> m_chunk;
+    std::string m_eol;
+    State m_state = State::Pushing;
+    size_t m_used = 0; // bytes of chunk buffer
+    size_t m_nextIndex = 0; // next chunk entry for pulling
+    bool m_isPulled = false;
+
+public:
+    // tmpPrefix: prefix of tmp run files, e.g. "/tmp/my-service"
+    ExternalSorter(const std::string& tmpPrefix, size_t chunkSize,
+                   size_t mergeCount = 8, size_t readBufSize = 32*1024*1024)
+        : m_registry(tmpPrefix), m_sorter(chunkSize), m_merger(mergeCount, readBufSize),
+          m_chunk(chunkSize), m_eol(GetPlatformEol())
+    {
+    }
+
+    ~ExternalSorter()
+    {
+        m_merger.Close();
+
+        // remove runs which were not merged
+        for (const std::string& file : m_registry.PopFront(m_registry.Count()))
+        {
+            boost::system::error_code ec;
+            boost::filesystem::remove(file, ec);
+        }
+    }
+
+    // Adds a record (line without EOL, in the same format as lines of the input file).
+    void Push(const char* line, size_t size)
+    {
+        assert(m_state == State::Pushing);
+
+        CollationKeys::Scope keyScope(&m_chunk.keys);
+        std::vector<char>& buffer = *m_chunk.buffer;
+        if (size > buffer.size())
+        {
+            // the record is kept out of buffer and spilled at once, so memory grows by one record only
+            m_chunk.entries.emplace_back(m_chunk.AddLongLine(line, size), size);
+            m_chunk.dataSize += size + m_eol.size();
+            Spill();
+            return;
+        }
+
+        if (m_used + size > buffer.size())
+            Spill();
+
+        char* data = &buffer[m_used];
+        memcpy(data, line, size);
+        m_used += size;
+
+        m_chunk.entries.emplace_back(data, size);
+        m_chunk.dataSize += size + m_eol.size();
+    }
+
+    // Adds records separated by EOL, the last EOL is optional.
+    void PushBatch(const char* data, size_t size)
+    {
+        const char* end = data + size;
+        while (data < end)
+        {
+            const char* eolPos = reinterpret_cast<const char*>(memchr(data, m_eol[0], end - data));
+            const char* lineEnd = eolPos ? eolPos : end;
+
+            Push(data, lineEnd - data);
+            data = eolPos ? std::min(end, eolPos + m_eol.size()) : end;
+        }
+    }
+
+    // Call it after the last Push(), before pulling records.
+    void Finish()
+    {
+        assert(m_state == State::Pushing);
+
+        if (m_registry.Count() == 0)
+        {
+            // all records fit into memory, no tmp files
+            Sort(m_chunk.entries);
+            m_state = State::PullingChunk;
+            return;
+        }
+
+        Spill();
+
+        // merge runs, but the final merge is done on the fly while pulling
+        m_merger.Process(m_registry, m_merger.GetMaxSourceCount());
+        m_merger.Open(m_registry.PopFront(m_registry.Count()), m_registry);
+        m_state = State::PullingRuns;
+    }
+
+    // Gets next record in sorted order, returns false if there are no more records.
+    // The record data is valid until the next call.
+    bool Next(FileReader::Buffer* record)
+    {
+        assert(m_state != State::Pushing);
+
+        const TEntry* entry = nullptr;
+        if (m_state == State::PullingChunk)
+        {
+            if (m_isPulled) ++m_nextIndex;
+            if (m_nextIndex < m_chunk.entries.size())
+                entry = &m_chunk.entries[m_nextIndex];
+        }
+        else
+        {
+            if (m_isPulled) m_merger.Pop();
+            entry = m_merger.Top();
+        }
+
+        m_isPulled = true;
+
+        if (entry == nullptr)
+            return false;
+
+        record->data = entry->GetLinePtr();
+        record->size = entry->GetLineSize();
+        return true;
+    }
+
+    // Calls callback(const char* data, size_t size) for every record in sorted order.
+    template <class TCallback>
+    void ForEach(TCallback callback)
+    {
+        FileReader::Buffer record;
+        while (Next(&record))
+        {
+            callback(record.data, record.size);
+        }
+    }
+
+private:
+
+    // sorts the chunk, saves it to the tmp run and makes chunk empty
+    void Spill()
+    {
+        if (!m_chunk.entries.empty())
+        {
+            m_sorter.ProcessChunk(m_chunk, m_registry.GetNext());
+        }
+
+        m_chunk.Clear();
+        m_used = 0;
+    }
+};
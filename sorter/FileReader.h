@@ -1,18 +1,22 @@
 #pragma once
 
-#include "common/Clock.h"
 #include "common/Utils.h"
 
 #include <cstdio>
 #include <memory>
 #include <vector>
 #include <stdexcept>
-#include <iostream>
-#include <fstream>
 #include <sstream>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 #include <boost/noncopyable.hpp>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 struct FileReader : boost::noncopyable
 {
     struct Buffer
@@ -21,16 +25,20 @@ struct FileReader : boost::noncopyable
         size_t size;
     };
 
+    // fileName "-" means stdin
     FileReader(const char* fileName, const char* eol = nullptr)
     {
-        m_file = fopen(fileName , "rb" );
+        m_file = IsStdStream(fileName) ? stdin : fopen(fileName , "rb" );
         if (m_file == nullptr)
             throw std::runtime_error(std::string("Cannot open file ") + fileName);
 
-        // obtain file size:
-        fseek (m_file , 0 , SEEK_END);
-        m_fileSize = ftell (m_file);
-        rewind (m_file);
+        // obtain file size, it is unknown for pipes:
+        if (fseek (m_file , 0 , SEEK_END) == 0)
+        {
+            m_fileSize = ftell (m_file);
+            m_isSizeKnown = true;
+            rewind (m_file);
+        }
 
         if (eol && *eol)
         {
@@ -46,30 +54,70 @@ struct FileReader : boost::noncopyable
 
     ~FileReader()
     {
-        fclose(m_file);
+        if (m_file != stdin)
+            fclose(m_file);
+#ifdef __linux__
+        if (m_reclaimFd >= 0)
+            close(m_reclaimFd);
+#endif
+    }
+
+    // Space of already consumed data is returned to filesystem (file gets holes),
+    // so file is destroyed while it is read. Use it for tmp files only.
+    // Returns false if it is not supported.
+    bool EnableSpaceReclaim(const char* fileName)
+    {
+#ifdef __linux__
+        m_reclaimFd = open(fileName, O_WRONLY);
+        return m_reclaimFd >= 0;
+#else
+        (void)fileName;
+        return false;
+#endif
     }
 
+    size_t GetReclaimedBytes() const { return m_reclaimedBytes; }
+
+    static bool IsStdStream(const std::string& fileName) { return fileName == "-"; }
+
     // reads chunk from file to buffer
-    bool LoadNextChunk(const std::shared_ptr<std::vector<char>>& newBuffer)
+    // reservedBytes: the beginning of buffer is used by caller, data are placed after it.
+    // If the rest of line doesn't fit buffer, the line is read to the own storage of reader
+    // (see IsLongLine()), lines returned before are invalidated anyway.
+    bool LoadNextChunk(const std::shared_ptr<std::vector<char>>& newBuffer, size_t reservedBytes = 0)
     {
+        ReclaimSpace(m_bytesRead - m_remained);
+        m_longLine.clear();
+        m_hasLongLine = false;
+
+        if (m_remained > 0 && newBuffer->size() <= reservedBytes + m_remained)
+            return LoadLongLine(newBuffer, reservedBytes);
+
         if (m_remained > 0)
         {
-            if (newBuffer->size() < m_remained)
-                throw std::logic_error("Invalid chunk buffer size");
-
-            memmove(&newBuffer->front(), m_nextLinePos, m_remained);
+            memmove(&newBuffer->at(reservedBytes), m_nextLinePos, m_remained);
         }
 
         m_buffer = newBuffer;
 
-        m_nextLinePos = &m_buffer->front();
-        size_t bytesToRead = m_buffer->size() - m_remained;
+        m_nextLinePos = m_buffer->data() + reservedBytes;
+        if (m_bytesRead >= m_endOffset)
+            return false;
+
+        size_t bytesToRead = std::min(m_buffer->size() - reservedBytes - m_remained, m_endOffset - m_bytesRead);
 
         if (bytesToRead > 0)
         {
-            size_t bytesRead = fread(&m_buffer->at(m_remained), 1u, bytesToRead, m_file);
+            size_t bytesRead = fread(&m_buffer->at(reservedBytes + m_remained), 1u, bytesToRead, m_file);
             assert(bytesRead <= bytesToRead);
             m_remained += bytesRead;
+            m_bytesRead += bytesRead;
+
+            // the full buffer without EOL is the beginning of long line
+            if (reservedBytes + m_remained == m_buffer->size() && !AtFileEnd() &&
+                memchr(m_nextLinePos, m_actualEol, m_remained) == nullptr)
+                return LoadLongLine(newBuffer, reservedBytes);
+
             return bytesRead > 0;
         }
 
@@ -78,19 +126,28 @@ struct FileReader : boost::noncopyable
 
     bool TryGetLine(Buffer* lineBuffer)
     {
+        if (m_hasLongLine)
+        {
+            lineBuffer->data = m_longLine.data();
+            lineBuffer->size = m_longLine.size();
+            m_hasLongLine = false;
+            return true;
+        }
+
         if (m_nextLinePos == nullptr) return false;
 
         const char* nextEolPos = reinterpret_cast<const char*>(memchr(m_nextLinePos, m_actualEol, m_remained));
 
         if (nextEolPos == nullptr)
         {
-            if (m_remained > 0 && feof(m_file))
+            if (m_remained > 0 && AtFileEnd())
             {
                 // we reach EOF instead of EOL.
                 // Return the last line, next TryGetLine() calls will fail.
                 lineBuffer->data = m_nextLinePos;
                 lineBuffer->size = m_remained;
 
+                m_nextLinePos += m_remained;
                 m_remained = 0;
 
                 return true;
@@ -115,74 +172,182 @@ struct FileReader : boost::noncopyable
         return true;
     }
 
-    size_t GetFileSize() const { return m_fileSize; }
-
-private:
-
-    static size_t PtrDiff(const char* p0, const char* p1)
+    // Starts reading from the offset, it must be the beginning of a line.
+    void Seek(size_t offset)
     {
-        auto diff = p1 - p0;
-        assert(diff >= 0);
-        return static_cast<size_t>(diff);
-    }
+        if (fseek(m_file, static_cast<long>(offset), SEEK_SET) != 0)
+            throw std::runtime_error("Cannot seek in file");
 
-    FILE* m_file;
-    size_t m_fileSize;
-    std::shared_ptr<std::vector<char>> m_buffer;
-    const char* m_nextLinePos = nullptr;
-    size_t m_remained = 0;
-    std::string m_eol;
-    char m_actualEol;
-};
+        m_bytesRead = offset;
+        m_remained = 0;
+        m_nextLinePos = nullptr;
+    }
 
-inline void TestRead(const char* filename)
-{
-    std::cout << "TestRead(" << filename << ")" << std::endl;
+    // Reading stops at the offset as if it is the end of file, e.g. to read a part of file.
+    // The offset should be the beginning of a line.
+    void SetEndOffset(size_t offset) { m_endOffset = offset; }
 
-    Clock c;
-    c.Start();
+    // Offset of the first line which is not returned by TryGetLine() yet.
+    size_t GetConsumedBytes() const { return m_bytesRead - m_remained - (m_hasLongLine ? m_longLineBytes : 0); }
 
-    size_t N = 0;
+    // true if the line is stored by reader, not in the buffer passed to LoadNextChunk(),
+    // it is valid until the next LoadNextChunk() call.
+    bool IsLongLine(const Buffer& line) const
+    {
+        return !m_longLine.empty() && line.data == m_longLine.data();
+    }
 
-    std::ifstream file(filename);
+    // Size of buffer part used by returned lines and loaded data, including reserved bytes.
+    // The rest of buffer can be filled by another reader.
+    size_t GetBufferedBytes() const
+    {
+        return m_buffer ? PtrDiff(m_buffer->data(), m_nextLinePos) + m_remained : 0;
+    }
 
-    if (!file)
+    // Offset of the next line (not returned yet) in buffer, bytes before it are not used by the reader.
+    size_t GetNextLineOffset() const
     {
-        std::cout << "Cannot open " << filename << std::endl;
-        return;
+        return m_buffer ? PtrDiff(m_buffer->data(), m_nextLinePos) : 0;
     }
 
-    std::string line;
-    while (std::getline(file, line))
+    // returns 0 if size is unknown (e.g. reading from pipe)
+    size_t GetFileSize() const { return m_fileSize; }
+    bool IsSizeKnown() const { return m_isSizeKnown; }
+
+    const std::string& GetEol() const { return m_eol; }
+
+    // true if all lines of the file are already returned by TryGetLine()
+    bool IsEof() const
     {
-        N += line.size();
+        return m_remained == 0 && !m_hasLongLine && AtFileEnd();
     }
 
-    std::cout << "TeatRead complete t=" <<  c.ElapsedTime() << "s; N=" << N << "" << std::endl;
-}
+private:
 
+    // The beginning of line (m_remained bytes) takes the whole buffer: it is moved to m_longLine,
+    // which grows until EOL is read. Data read after the line is placed to buffer as usual.
+    bool LoadLongLine(const std::shared_ptr<std::vector<char>>& newBuffer, size_t reservedBytes)
+    {
+        m_longLine.assign(m_nextLinePos, m_nextLinePos + m_remained);
+        m_remained = 0;
+        m_buffer = newBuffer;
+        m_nextLinePos = m_buffer->data() + reservedBytes;
 
+        // bytes after EOL must fit the buffer
+        const size_t readSize = m_buffer->size() - std::min(reservedBytes, m_buffer->size());
+        if (readSize == 0)
+            throw std::logic_error("Invalid chunk buffer size");
 
-inline void TestRead2(const char* filename)
-{
-    std::cout << "TestRead2(" << filename << ")" << std::endl;
+        size_t searchFrom = 0;
+        const char* eolPos = nullptr;
+        while ((eolPos = reinterpret_cast<const char*>(memchr(m_longLine.data() + searchFrom, m_actualEol,
+                                                               m_longLine.size() - searchFrom))) == nullptr)
+        {
+            searchFrom = m_longLine.size();
+            size_t bytesToRead = std::min(readSize, m_endOffset - m_bytesRead);
+            if (bytesToRead == 0 || AtFileEnd())
+                break; // the last line without EOL
+
+            m_longLine.resize(searchFrom + bytesToRead);
+            size_t bytesRead = fread(&m_longLine[searchFrom], 1u, bytesToRead, m_file);
+            m_longLine.resize(searchFrom + bytesRead);
+            m_bytesRead += bytesRead;
+            if (bytesRead == 0)
+                break;
+        }
 
-    Clock c;
-    c.Start();
+        size_t lineSize = eolPos ? PtrDiff(m_longLine.data(), eolPos) : m_longLine.size();
+        if (eolPos && lineSize + m_eol.size() > m_longLine.size())
+        {
+            // the rest of EOL, e.g. "\n" of "\r\n"
+            size_t size = m_longLine.size();
+            m_longLine.resize(lineSize + m_eol.size());
+            size_t bytesRead = fread(&m_longLine[size], 1u, m_longLine.size() - size, m_file);
+            m_longLine.resize(size + bytesRead);
+            m_bytesRead += bytesRead;
+        }
+        m_longLineBytes = std::min(lineSize + m_eol.size(), m_longLine.size());
 
-    auto buffer = std::make_shared<std::vector<char>>(1024*1024*1024);
-    FileReader reader(filename);
+        // data after the line
+        m_remained = m_longLine.size() - m_longLineBytes;
+        if (m_remained > readSize)
+            throw std::logic_error("Invalid chunk buffer size");
+        memcpy(m_buffer->data() + reservedBytes, m_longLine.data() + m_longLineBytes, m_remained);
 
-    size_t N = 0;
+        m_longLine.resize(lineSize);
+        m_hasLongLine = true;
+        return true;
+    }
 
-    while (reader.LoadNextChunk(buffer))
+    // punches hole from the last reclaimed position to consumedBytes
+    void ReclaimSpace(size_t consumedBytes)
     {
-        FileReader::Buffer b;
-        while (reader.TryGetLine(&b))
+#ifdef __linux__
+        const size_t blockSize = 4096;
+        size_t end = consumedBytes / blockSize * blockSize;
+        if (m_reclaimFd < 0 || end <= m_reclaimedBytes)
+            return;
+
+        if (fallocate(m_reclaimFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      m_reclaimedBytes, end - m_reclaimedBytes) != 0)
         {
-            N += b.size;
+            // not supported by filesystem, don't try any more
+            close(m_reclaimFd);
+            m_reclaimFd = -1;
+            return;
         }
+        m_reclaimedBytes = end;
+#else
+        (void)consumedBytes;
+#endif
+    }
+
+    bool AtFileEnd() const
+    {
+        return (m_isSizeKnown && m_bytesRead >= m_fileSize) || m_bytesRead >= m_endOffset || feof(m_file);
+    }
+
+    static size_t PtrDiff(const char* p0, const char* p1)
+    {
+        auto diff = p1 - p0;
+        assert(diff >= 0);
+        return static_cast<size_t>(diff);
+    }
+
+    FILE* m_file;
+    size_t m_fileSize = 0;
+    bool m_isSizeKnown = false;
+    std::shared_ptr<std::vector<char>> m_buffer;
+    const char* m_nextLinePos = nullptr;
+    size_t m_remained = 0;
+    size_t m_bytesRead = 0;
+    size_t m_endOffset = SIZE_MAX;
+    int m_reclaimFd = -1;
+    size_t m_reclaimedBytes = 0;
+    std::string m_eol;
+    char m_actualEol;
+    std::vector<char> m_longLine; // the line which doesn't fit buffer
+    size_t m_longLineBytes = 0; // size of long line with EOL
+    bool m_hasLongLine = false; // the long line is not returned by TryGetLine() yet
+};
+
+// Removes "<count>\t" prefix written by WriteCount() from the line, returns the count.
+inline uint64_t ParseCount(FileReader::Buffer* line)
+{
+    const char* end = line->data + line->size;
+    const char* tab = reinterpret_cast<const char*>(memchr(line->data, '\t', line->size));
+    if (tab == nullptr || tab == line->data)
+        throw std::runtime_error("Invalid counted line [" + std::string(line->data, end) + "]");
+
+    uint64_t count = 0;
+    for (const char* ptr = line->data; ptr < tab; ++ptr)
+    {
+        if (*ptr < '0' || *ptr > '9')
+            throw std::runtime_error("Invalid counted line [" + std::string(line->data, end) + "]");
+        count = count * 10 + (*ptr - '0');
     }
 
-    std::cout << "TeatRead2 complete t=" <<  c.ElapsedTime() << "s; N=" << N << "" << std::endl;
+    line->data = tab + 1;
+    line->size = end - line->data;
+    return count;
 }
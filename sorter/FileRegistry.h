@@ -2,37 +2,422 @@
 
 #include <vector>
 #include <string>
+#include <set>
+#include <map>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/stat.h>
 
-// stores names of initial and tmp files
+#include <boost/filesystem.hpp>
+
+#include "FileReader.h"
+#include "FileWriter.h"
+#include "common/Clock.h"
+
+// How tmp files are distributed among tmp directories
+enum class TmpDirPolicy
+{
+    RoundRobin,
+    FreeSpace // directory with max free space
+};
+
+// stores names of initial, result and tmp files
 class FileRegistry
 {
+    struct TmpDir
+    {
+        boost::filesystem::path path;
+        dev_t device;
+    };
+
     size_t m_counter = 0;
     std::string m_initialFile;
+    std::vector<std::string> m_inputFiles;
+    std::string m_resultFile;
+    std::string m_tmpPrefix;
     std::vector<std::string> m_files;
+    std::set<std::string> m_tmpFiles;
+    std::set<std::string> m_externalFiles;
+    std::string m_baseFile;
+    size_t m_reclaimedBytes = 0;
+    std::vector<TmpDir> m_tmpDirs;
+    TmpDirPolicy m_tmpDirPolicy = TmpDirPolicy::RoundRobin;
+    size_t m_nextTmpDir = 0;
+    SparseIndexSettings m_indexSettings;
+
+    // checkpoint data
+    bool m_isCheckpointEnabled = false;
+    std::map<std::string, FileInfo> m_completedFiles;
+    std::vector<std::string> m_mergingFiles; // popped, but merge is not completed
+    size_t m_inputOffset = 0;
+    size_t m_mergeCount = 0;
 public:
-    FileRegistry(const std::string& initialFile) : m_initialFile(initialFile) {}
+    FileRegistry(const std::string& initialFile, const std::string& resultFile = std::string())
+        : FileRegistry(std::vector<std::string>{initialFile}, resultFile)
+    {
+    }
+
+    // Tmp files are named after the first input file.
+    FileRegistry(const std::vector<std::string>& inputFiles, const std::string& resultFile = std::string())
+        : m_initialFile(inputFiles.at(0)), m_inputFiles(inputFiles), m_resultFile(resultFile)
+    {
+        // tmp files are stored near the initial file,
+        // but stdin ("-") has no location, so use system tmp directory.
+        if (m_initialFile == "-")
+        {
+            namespace fs = boost::filesystem;
+            m_tmpPrefix = (fs::temp_directory_path() / fs::unique_path("shanghai-%%%%-%%%%")).string();
+        }
+        else
+        {
+            m_tmpPrefix = m_initialFile;
+        }
+    }
+
+    // Tmp files are striped over tmp dirs, by default they are stored near the initial file.
+    void AddTmpDir(const std::string& dir)
+    {
+        m_tmpDirs.push_back(TmpDir{dir, GetDevice(dir)});
+    }
+
+    void SetTmpDirPolicy(TmpDirPolicy policy) { m_tmpDirPolicy = policy; }
 
     const std::string& GetInitialFile() const { return m_initialFile; }
+    const std::vector<std::string>& GetInputFiles() const { return m_inputFiles; }
+    const std::string& GetResultFile() const { return m_resultFile; }
+
+    // The final stage writes directly to the result file (no tmp file and renaming).
+    // Returns result file name if it is known, otherwise name of the next tmp file.
+    std::string GetResult()
+    {
+        if (m_resultFile.empty())
+            return GetNext();
+
+        m_files.push_back(m_resultFile);
+        return m_resultFile;
+    }
 
     size_t Count() const { return m_files.size(); }
 
-    std::string GetNext(const std::string& label = std::string())
+    // sources: files which are read while the new file is written,
+    // tmp dir on another device is preferred for the new file.
+    std::string GetNext(const std::string& label = std::string(),
+                        const std::vector<std::string>& sources = std::vector<std::string>())
     {
-        std::string fname = m_initialFile + "." + label + (label.empty() ? "" : ".") + std::to_string(++m_counter);
+        std::string fname = MakeTmpFileName(label, sources);
         m_files.push_back(fname);
+        m_tmpFiles.insert(fname);
         return fname;
     }
 
+    // Name of a new tmp file in tmp dir chosen like by GetNext(), but the file is not added
+    // to the registry (e.g. files exchanged by worker processes, they are deleted by their owner).
+    std::string MakeTmpFileName(const std::string& label = std::string(),
+                                const std::vector<std::string>& sources = std::vector<std::string>())
+    {
+        std::string fname = m_tmpPrefix + "." + label + (label.empty() ? "" : ".") + std::to_string(++m_counter);
+
+        if (!m_tmpDirs.empty())
+        {
+            boost::filesystem::path prefix(m_tmpPrefix);
+            fname = (m_tmpDirs[SelectTmpDir(sources)].path / prefix.filename()).string() + fname.substr(m_tmpPrefix.size());
+        }
+        return fname;
+    }
+
+    // true for files created by GetNext(), they can be destroyed during merge
+    bool IsTmpFile(const std::string& fileName) const { return m_tmpFiles.count(fileName) > 0; }
+
+    // Adds already sorted file of user (e.g. input of merge mode).
+    // It is never deleted, and it is not the result even if it is the only file.
+    void AddExternalFile(const std::string& fileName)
+    {
+        m_files.push_back(fileName);
+        m_externalFiles.insert(fileName);
+    }
+
+    // The result of previous sorting with the same options (e.g. counted lines), new input is merged to it.
+    // It is not in the registry until PushBaseFile() is called,
+    // so runs of new input are merged separately and the base file is read only once by the last merge.
+    void SetBaseFile(const std::string& fileName) { m_baseFile = fileName; }
+    const std::string& GetBaseFile() const { return m_baseFile; }
+
+    // Puts the base file before all files, so it is merged like the first run.
+    void PushBaseFile()
+    {
+        assert(!m_baseFile.empty());
+        m_files.insert(m_files.begin(), m_baseFile);
+        m_externalFiles.insert(m_baseFile);
+    }
+
+    // true for files with lines in the format of runs: tmp files and the base file
+    bool IsRun(const std::string& fileName) const { return IsTmpFile(fileName) || fileName == m_baseFile; }
+
+    bool HasExternalFiles() const
+    {
+        for (const std::string& fileName : m_files)
+        {
+            if (m_externalFiles.count(fileName) > 0)
+                return true;
+        }
+        return false;
+    }
+
+    // true if the result is stdout and the only file is not written to it yet (e.g. the run of input
+    // which fits one chunk, but the end of stdin was unknown): a file cannot be renamed to stdout
+    bool IsStreamResultPending() const
+    {
+        return FileReader::IsStdStream(m_resultFile) && m_files.size() == 1 && m_files[0] != m_resultFile;
+    }
+
+    // sparse index of the result file, it is written with the result
+    void SetIndexSettings(const SparseIndexSettings& settings) { m_indexSettings = settings; }
+    const SparseIndexSettings& GetIndexSettings() const { return m_indexSettings; }
+
+    // space of tmp files returned to filesystem while they are merged
+    void AddReclaimedBytes(size_t bytes) { m_reclaimedBytes += bytes; }
+    size_t GetReclaimedBytes() const { return m_reclaimedBytes; }
+
     std::vector<std::string> PopFront(size_t count)
     {
         std::vector<std::string> result;
         if (m_files.size() <= count)
         {
             m_files.swap(result);
-            return result;
         }
-        result.assign(m_files.begin(), m_files.begin() + count);
-        m_files.erase(m_files.begin(), m_files.begin() + count);
+        else
+        {
+            result.assign(m_files.begin(), m_files.begin() + count);
+            m_files.erase(m_files.begin(), m_files.begin() + count);
+        }
+
+        if (m_isCheckpointEnabled)
+            m_mergingFiles.insert(m_mergingFiles.end(), result.begin(), result.end());
+
         return result;
     }
+
+    // moves the first count files to the end
+    void RotateFront(size_t count)
+    {
+        assert(count <= m_files.size());
+        std::rotate(m_files.begin(), m_files.begin() + count, m_files.end());
+    }
+
+    // Checkpoint: completed files and progress are saved to the manifest file
+    // after every completed run and merge, so sorting can be resumed after crash.
+    void EnableCheckpoint()
+    {
+        if (m_initialFile == "-" || m_inputFiles.size() > 1)
+            throw std::logic_error("Checkpoint requires a single regular input file");
+        m_isCheckpointEnabled = true;
+    }
+
+    bool IsCheckpointEnabled() const { return m_isCheckpointEnabled; }
+
+    std::string GetManifestFile() const { return m_tmpPrefix + ".manifest"; }
+
+    // Offset of the input data which is not stored in completed runs yet.
+    size_t GetInputOffset() const { return m_inputOffset; }
+
+    size_t GetMergeCount() const { return m_mergeCount; }
+
+    // Registers completed run of the initial file.
+    // inputOffset: offset of the first line which is not stored in runs yet.
+    void CommitRun(const std::string& fileName, const FileInfo& info, size_t inputOffset)
+    {
+        m_inputOffset = inputOffset;
+        if (!m_isCheckpointEnabled)
+            return;
+
+        m_completedFiles[fileName] = info;
+        SaveManifest();
+    }
+
+    // Registers completed merge, sources are deleted.
+    void CommitMerge(const std::vector<std::string>& sources, const std::string& fileName, const FileInfo& info)
+    {
+        ++m_mergeCount;
+        if (!m_isCheckpointEnabled)
+            return;
+
+        for (const std::string& source : sources)
+        {
+            m_completedFiles.erase(source);
+            m_mergingFiles.erase(std::remove(m_mergingFiles.begin(), m_mergingFiles.end(), source), m_mergingFiles.end());
+        }
+        m_completedFiles[fileName] = info;
+        SaveManifest();
+    }
+
+    // Loads manifest saved by previous run and verifies its files.
+    // Returns false if there is no manifest.
+    bool Resume()
+    {
+        EnableCheckpoint();
+
+        std::ifstream manifest(GetManifestFile().c_str());
+        if (!manifest)
+            return false;
+
+        Clock c;
+        c.Start();
+
+        std::string header;
+        std::getline(manifest, header);
+        if (header != ManifestHeader())
+            throw std::runtime_error("Invalid manifest " + GetManifestFile());
+
+        std::string key;
+        while (manifest >> key)
+        {
+            if (key == "input")
+            {
+                size_t size = 0;
+                manifest >> size;
+                if (size != boost::filesystem::file_size(m_initialFile))
+                    throw std::runtime_error("Input file is changed since checkpoint");
+            }
+            else if (key == "counter")
+            {
+                manifest >> m_counter;
+            }
+            else if (key == "input-offset")
+            {
+                manifest >> m_inputOffset;
+            }
+            else if (key == "merges")
+            {
+                manifest >> m_mergeCount;
+            }
+            else if (key == "file")
+            {
+                FileInfo info;
+                std::string fileName;
+                manifest >> info.size >> info.checksum;
+                manifest.ignore(1); // space before name
+                std::getline(manifest, fileName);
+
+                FileInfo actualInfo = GetFileInfo(fileName);
+                if (actualInfo.size != info.size || actualInfo.checksum != info.checksum)
+                    throw std::runtime_error("File " + fileName + " is corrupted, cannot resume");
+
+                m_files.push_back(fileName);
+                if (fileName != m_resultFile)
+                    m_tmpFiles.insert(fileName);
+                m_completedFiles[fileName] = info;
+            }
+            else
+            {
+                throw std::runtime_error("Invalid manifest " + GetManifestFile());
+            }
+
+            if (!manifest)
+                throw std::runtime_error("Invalid manifest " + GetManifestFile());
+        }
+
+        GetLog() << "Resumed from checkpoint, Files:" << m_files.size()
+                 << ", InputOffset:" << m_inputOffset
+                 << ", Merges:" << m_mergeCount
+                 << ", VerifyTime:" << c.ElapsedTime() << "sec" << std::endl;
+        return true;
+    }
+
+    // call it when sorting is completed
+    void RemoveCheckpoint()
+    {
+        if (!m_isCheckpointEnabled)
+            return;
+
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetManifestFile(), ec);
+    }
+
+private:
+
+    static const char* ManifestHeader() { return "shanghai-manifest 1"; }
+
+    // manifest is replaced atomically, so it is valid even if we crash while it is written
+    void SaveManifest()
+    {
+        std::string tmpName = GetManifestFile() + ".tmp";
+        {
+            std::ofstream manifest(tmpName.c_str());
+            manifest << ManifestHeader() << "\n";
+            manifest << "input " << boost::filesystem::file_size(m_initialFile) << "\n";
+            manifest << "counter " << m_counter << "\n";
+            manifest << "input-offset " << m_inputOffset << "\n";
+            manifest << "merges " << m_mergeCount << "\n";
+
+            // files are stored in merge order
+            for (const std::vector<std::string>* files : {&m_mergingFiles, &m_files})
+            {
+                for (const std::string& fileName : *files)
+                {
+                    auto it = m_completedFiles.find(fileName);
+                    if (it == m_completedFiles.end())
+                        continue; // is not written yet
+
+                    manifest << "file " << it->second.size << " " << it->second.checksum << " " << fileName << "\n";
+                }
+            }
+
+            manifest.close();
+            if (!manifest)
+                throw std::runtime_error("Cannot write manifest " + tmpName);
+        }
+        boost::filesystem::rename(tmpName, GetManifestFile());
+    }
+
+    static dev_t GetDevice(const std::string& path)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            throw std::runtime_error("Cannot access " + path);
+        return st.st_dev;
+    }
+
+    // Selects dir with min number of sources on the same device,
+    // the rest is up to policy.
+    size_t SelectTmpDir(const std::vector<std::string>& sources)
+    {
+        std::vector<dev_t> sourceDevices;
+        for (const std::string& source : sources)
+        {
+            if (!FileReader::IsStdStream(source))
+                sourceDevices.push_back(GetDevice(source));
+        }
+
+        size_t bestIndex = m_tmpDirs.size();
+        size_t bestConflicts = 0;
+        uintmax_t bestSpace = 0;
+
+        for (size_t k = 0; k < m_tmpDirs.size(); ++k)
+        {
+            size_t index = (m_nextTmpDir + k) % m_tmpDirs.size(); // round robin order
+            size_t conflicts = std::count(sourceDevices.begin(), sourceDevices.end(), m_tmpDirs[index].device);
+
+            uintmax_t space = 0;
+            if (m_tmpDirPolicy == TmpDirPolicy::FreeSpace)
+            {
+                boost::system::error_code ec;
+                space = boost::filesystem::space(m_tmpDirs[index].path, ec).available;
+            }
+
+            if (bestIndex == m_tmpDirs.size() || conflicts < bestConflicts
+                || (conflicts == bestConflicts && space > bestSpace))
+            {
+                bestIndex = index;
+                bestConflicts = conflicts;
+                bestSpace = space;
+            }
+        }
+
+        m_nextTmpDir = bestIndex + 1;
+        return bestIndex;
+    }
 };
@@ -1,29 +1,246 @@
 #pragma once
 
+#include <cstdio>
+#include <string>
+#include <cstring>
 #include <vector>
+#include <memory>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include <boost/noncopyable.hpp>
+#include <boost/crc.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "common/Clock.h"
+#include "SparseIndex.h"
+#include "Metrics.h"
 
-template <class TEntry>
-void SaveFile(const char* filename, const std::vector<TEntry>& entries)
+// Size and checksum of written file
+struct FileInfo
+{
+    size_t size = 0;
+    uint32_t checksum = 0;
+};
+
+// Buffered output file.
+// If expected size is known, disk space is reserved in advance,
+// so filesystem can allocate it contiguously.
+class FileWriter : boost::noncopyable
 {
-    Clock c;
-    c.Start();
+public:
+    // fileName "-" means stdout, data is streamed out as soon as the buffer is full.
+    FileWriter(const std::string& fileName, size_t expectedSize = 0, size_t bufferSize = 4*1024*1024)
+        : m_fileName(fileName), m_buffer(bufferSize)
+    {
+        m_isStdout = (fileName == "-");
+        m_file = m_isStdout ? stdout : fopen(fileName.c_str(), "wb");
+        if (m_file == nullptr)
+            throw std::runtime_error("Cannot open output file " + fileName);
+
+        if (!m_isStdout)
+        {
+            setvbuf(m_file, nullptr, _IONBF, 0); // we use our own buffer
+
+            if (expectedSize > 0)
+                Preallocate(expectedSize);
+        }
+    }
+
+    ~FileWriter()
+    {
+        if (m_file != nullptr)
+            CloseFile();
+    }
+
+    // checksum of written data is computed if enabled
+    void EnableChecksum() { m_isChecksumEnabled = true; }
+
+    // Sparse index of written data is saved to GetIndexFile() on Close().
+    void EnableIndex(const SparseIndexSettings& settings)
+    {
+        if (settings.blockSize > 0)
+            m_index.reset(new SparseIndexBuilder(settings));
+    }
+
+    // the same signature as std::ostream::write(), so entries can use it in ToStream().
+    void write(const char* data, size_t size)
+    {
+        m_bytesWritten += size;
+
+        if (m_used + size > m_buffer.size())
+        {
+            Flush();
+            if (size >= m_buffer.size())
+            {
+                WriteToFile(data, size);
+                return;
+            }
+        }
+
+        memcpy(&m_buffer[m_used], data, size);
+        m_used += size;
+    }
+
+    void Flush()
+    {
+        WriteToFile(m_buffer.data(), m_used);
+        m_used = 0;
+
+        if (m_isStdout && fflush(m_file) != 0)
+            throw std::runtime_error("Cannot write to stdout");
+    }
+
+    size_t GetBytesWritten() const { return m_bytesWritten; }
+
+    FileInfo GetInfo() const
+    {
+        FileInfo info;
+        info.size = m_bytesWritten;
+        info.checksum = m_crc.checksum();
+        return info;
+    }
+
+    void Close()
+    {
+        Flush();
+        ReleasePreallocated();
+        if (CloseFile() != 0)
+            throw std::runtime_error("Cannot close file " + m_fileName);
+
+        if (m_index)
+            m_index->GetIndex().Save(GetIndexFile(m_fileName));
+    }
 
-    std::ofstream file(filename, std::ofstream::binary);
+private:
 
+    void WriteToFile(const char* data, size_t size)
+    {
+        if (size > 0 && fwrite(data, 1u, size, m_file) != size)
+            throw std::runtime_error("Cannot write to file " + m_fileName);
+
+        if (m_isChecksumEnabled)
+            m_crc.process_bytes(data, size);
+
+        if (m_index)
+            m_index->Add(data, size);
+    }
+
+    int CloseFile()
+    {
+        FILE* file = m_file;
+        m_file = nullptr;
+        return m_isStdout ? fflush(file) : fclose(file); // stdout stays open
+    }
+
+    // less data than expected is written (e.g. duplicates are removed), free the rest of space
+    void ReleasePreallocated()
+    {
+#ifdef __linux__
+        if (m_preallocated > m_bytesWritten)
+        {
+            fflush(m_file);
+            if (ftruncate(fileno(m_file), static_cast<off_t>(m_bytesWritten)) != 0)
+                throw std::runtime_error("Cannot truncate file " + m_fileName);
+        }
+#endif
+    }
+
+    void Preallocate(size_t size)
+    {
+#ifdef __linux__
+        // KEEP_SIZE: reserve blocks only, file size grows as we write.
+        // It is just a hint, so errors (e.g. filesystem doesn't support it) are ignored.
+        if (fallocate(fileno(m_file), FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0)
+            m_preallocated = size;
+#else
+        (void)size;
+#endif
+    }
+
+    std::string m_fileName;
+    std::vector<char> m_buffer;
+    size_t m_used = 0;
+    FILE* m_file;
+    bool m_isStdout;
+    size_t m_bytesWritten = 0;
+    size_t m_preallocated = 0;
+    bool m_isChecksumEnabled = false;
+    boost::crc_32_type m_crc;
+    std::unique_ptr<SparseIndexBuilder> m_index;
+};
+
+// checksum of the whole file, the same as FileWriter computes
+inline FileInfo GetFileInfo(const std::string& fileName)
+{
+    std::ifstream file(fileName.c_str(), std::ifstream::binary);
     if (!file)
-        throw std::runtime_error("Cannot open output file.");
+        throw std::runtime_error("Cannot open file " + fileName);
 
-    for (const TEntry& entry : entries)
+    FileInfo info;
+    boost::crc_32_type crc;
+    std::vector<char> buffer(4*1024*1024);
+    while (file.read(&buffer.front(), buffer.size()) || file.gcount() > 0)
     {
-        entry.ToStream(file);
+        crc.process_bytes(&buffer.front(), file.gcount());
+        info.size += file.gcount();
+    }
+    info.checksum = crc.checksum();
+    return info;
+}
+
+// Lines of counted entries starts with "<count>\t"
+template <class TStream>
+void WriteCount(TStream& stream, uint64_t count)
+{
+    char buffer[24];
+    char* end = buffer + sizeof(buffer);
+    char* ptr = end;
+
+    *--ptr = '\t';
+    do
+    {
+        *--ptr = static_cast<char>('0' + count % 10);
+        count /= 10;
+    }
+    while (count > 0);
+
+    stream.write(ptr, end - ptr);
+}
+
+// counts: if not null, number of equal lines for every entry, it is written before the line.
+// index: if not null, sparse index of the file is saved too.
+template <class TEntry>
+FileInfo SaveFile(const char* filename, const std::vector<TEntry>& entries, size_t expectedSize = 0,
+                  bool computeChecksum = false, const std::vector<uint64_t>* counts = nullptr,
+                  const SparseIndexSettings* index = nullptr)
+{
+    PhaseTimer timer;
+    timer.Start();
+
+    FileWriter file(filename, expectedSize);
+    if (computeChecksum)
+        file.EnableChecksum();
+    if (index)
+        file.EnableIndex(*index);
+
+    for (size_t n = 0; n < entries.size(); ++n)
+    {
+        if (counts)
+            WriteCount(file, (*counts)[n]);
+
+        entries[n].ToStream(file);
     }
 
-    file.close();
+    file.Close();
 
-    std::cout << "SaveFile(" << filename << ") complete, time:" << c.ElapsedTime() << "sec" << std::endl;
+    timer.Stop();
+    GetLog() << "SaveFile(" << filename << ") complete, time:" << timer.GetTime() << "sec"
+             << PerfCounters::Format(timer.GetCounters()) << std::endl;
+    timer.Commit("write", file.GetInfo().size, entries.size());
+    return file.GetInfo();
 }
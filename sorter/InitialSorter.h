@@ -3,103 +3,589 @@
 #include "FileRegistry.h"
 #include "FileReader.h"
 #include "FileWriter.h"
+#include "InputQueue.h"
+#include "Numa.h"
 #include "SortingEntry.h"
+#include "TaskScheduler.h"
 
 #include "common/Clock.h"
 
+#include <map>
+#include <functional>
 #include <vector>
 #include <string>
 #include <memory>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <exception>
 
+// limit: if not 0, only the first limit entries are needed, the rest is removed.
+// duplicates: if duplicates are removed, equal lines are sorted next to each other
+// and limit is not applied, because it is applied to entries left after RemoveDuplicates().
 template <class TEntry>
-void Sort(std::vector<TEntry>& entries)
+void Sort(std::vector<TEntry>& entries, size_t limit = 0, DuplicateMode duplicates = DuplicateMode::Keep)
 {
-    Clock c;
-    c.Start();
+    PhaseTimer timer;
+    timer.Start();
 
-    std::sort(entries.begin(), entries.end());
+    if (duplicates != DuplicateMode::Keep)
+    {
+        std::sort(entries.begin(), entries.end(), LessByLine<TEntry>);
+        limit = 0;
+    }
+    else if (TEntry::IsStable)
+    {
+        std::stable_sort(entries.begin(), entries.end());
+    }
+    else if (limit > 0 && limit < entries.size())
+    {
+        std::partial_sort(entries.begin(), entries.begin() + limit, entries.end());
+    }
+    else
+    {
+        std::sort(entries.begin(), entries.end());
+    }
 
-    std::cout << "Sort complete, time:" << c.ElapsedTime() << "sec" << std::endl;
+    size_t count = entries.size();
+    if (limit > 0 && limit < entries.size())
+        entries.erase(entries.begin() + limit, entries.end());
+
+    timer.Stop();
+    GetLog() << "Sort complete, time:" << timer.GetTime() << "sec"
+             << PerfCounters::Format(timer.GetCounters()) << std::endl;
+    timer.Commit("sort", 0, count);
 }
 
-// Reads source file and splits it to sorted chunks.
+// Leaves the first entry of every group of equal lines in sorted entries.
+// counts: if not null, gets number of lines in every group.
+// limit: if not 0, only the first limit groups are left.
 template <class TEntry>
-class InitialSorter
+void RemoveDuplicates(std::vector<TEntry>& entries, std::vector<uint64_t>* counts, size_t limit = 0)
 {
-    template <class TEntry_>
-    struct ChunkData
-    {
-        std::vector<TEntry_> entries;
-        std::shared_ptr<std::vector<char>> buffer;
-        size_t size;
+    if (counts)
+        counts->clear();
 
-        ChunkData(size_t chunkSize) : size(chunkSize)
+    size_t count = 0; // entries left
+    for (size_t n = 0; n < entries.size(); ++n)
+    {
+        if (count > 0 && IsSameLine(entries[count - 1], entries[n].GetLinePtr(), entries[n].GetLineSize()))
         {
-            if (TEntry::IsExternalBuffer)
-            {
-                buffer = std::make_shared<std::vector<char>>(chunkSize);
-
-            }
-            Reserve(chunkSize);
+            if (counts)
+                ++counts->back();
+            continue;
         }
 
-        void Reserve(size_t chunkSize)
+        if (count == limit && limit > 0)
+            break;
+
+        entries[count++] = entries[n];
+        if (counts)
+            counts->push_back(1);
+    }
+
+    entries.resize(count);
+}
+
+// Entries of one chunk and the buffer they point to.
+template <class TEntry>
+struct ChunkData
+{
+    std::vector<TEntry> entries;
+    std::vector<uint64_t> counts; // number of equal lines of every entry, in DuplicateMode::Count
+    std::shared_ptr<std::vector<char>> buffer;
+    size_t size;
+    size_t dataSize = 0; // bytes of lines stored in entries
+    std::vector<std::unique_ptr<char[]>> longLines; // lines which don't fit buffer
+    CollationKeys keys; // keys of entries which are sorted by collation
+
+    ChunkData(size_t chunkSize) : size(chunkSize)
+    {
+        if (TEntry::IsExternalBuffer)
         {
-            const size_t aproxBytesPerLine = 32;
-            entries.reserve(chunkSize / aproxBytesPerLine);
+            buffer = std::make_shared<std::vector<char>>(chunkSize);
+
         }
-    };
+        Reserve(chunkSize);
+    }
+
+    void Reserve(size_t chunkSize)
+    {
+        const size_t aproxBytesPerLine = 32;
+        entries.reserve(chunkSize / aproxBytesPerLine);
+    }
+
+    // Copies line which is not stored in buffer (e.g. it is bigger than buffer),
+    // the copy lives until Clear().
+    const char* AddLongLine(const char* line, size_t lineSize)
+    {
+        longLines.emplace_back(new char[lineSize]);
+        memcpy(longLines.back().get(), line, lineSize);
+        return longLines.back().get();
+    }
+
+    // removes entries and their lines
+    void Clear()
+    {
+        entries.clear();
+        dataSize = 0;
+        longLines.clear();
+        keys.Clear();
+    }
+};
+
+// Line of sorted run, it represents weight bytes of run data.
+struct RunSample
+{
+    std::string line;
+    size_t weight;
+};
 
+// Reads source files and splits them to sorted chunks.
+template <class TEntry>
+class InitialSorter
+{
     size_t m_chunkSize;
+    size_t m_limit = 0;
+    DuplicateMode m_duplicates = DuplicateMode::Keep;
+    size_t m_readerCount = 1;
+    std::mutex m_registryMutex;
+    size_t m_samplesPerRun = 0;
+    std::vector<RunSample> m_samples;
+    NumaTopology m_numa; // no nodes if NUMA mode is disabled
+
+    // stages as tasks, see SetScheduler()
+    TaskScheduler* m_scheduler = nullptr;
+    TaskGroup m_tasks;
+    std::mutex m_chunksMutex;
+    std::vector<std::shared_ptr<ChunkData<TEntry>>> m_freeChunks;
+    size_t m_runCount = 0; // runs started by readers
+    size_t m_committedCount = 0;
+    std::map<size_t, std::function<void()>> m_commits; // completed runs waiting for previous ones
 
 public:
     InitialSorter(size_t chunkSize) : m_chunkSize(chunkSize)
     {
     }
 
+    // Only the first limit entries of the result are needed (0 means all entries).
+    // Chunk keeps only the best entries, and while they take less than
+    // a half of the chunk, they are carried to the next chunk instead of tmp file.
+    void SetLimit(size_t limit) { m_limit = limit; }
+
+    // Equal lines are collapsed in every chunk, so runs contain unique lines.
+    // In DuplicateMode::Count every line of run is prefixed with "<count>\t".
+    void SetDuplicateMode(DuplicateMode mode) { m_duplicates = mode; }
+
+    // Input files are read by the given number of threads (1 by default),
+    // every thread fills its own chunk of chunkSize / readerCount bytes.
+    // Stable entries need the input order of lines, so they are read by one thread.
+    void SetReaderCount(size_t count) { m_readerCount = std::max<size_t>(count, 1); }
+
+    // Reader threads are spread over nodes and bound to them, so every node sorts its own sub-chunks
+    // allocated in its local memory. There are at least as many readers as nodes,
+    // input files are split to slices if there are fewer files than readers.
+    void EnableNuma(const NumaTopology& topology) { m_numa = topology; }
+
+    // Reading and parsing, and sorting and writing of chunks are tasks of the scheduler:
+    // readers fill chunks from a pool of one chunk more than readers and pass them to sorting tasks,
+    // so reading of the next chunk overlaps sorting and writing of the previous one.
+    // The pool bounds memory by chunkSize, chunks are smaller then (more runs). A single reader
+    // has one chunk of chunkSize, so input which fits it is still the result without merge.
+    // NUMA mode doesn't use the scheduler: node-bound threads sort and write their own chunks,
+    // so chunks are not moved to threads or reused by threads of other nodes.
+    void SetScheduler(TaskScheduler* scheduler) { m_scheduler = scheduler; }
+
+    // Evenly spaced lines of every run are collected, e.g. to split the result by key ranges.
+    void EnableSampling(size_t samplesPerRun) { m_samplesPerRun = samplesPerRun; }
+
+    std::vector<RunSample> TakeSamples()
+    {
+        std::vector<RunSample> samples;
+        samples.swap(m_samples);
+        return samples;
+    }
+
     void Process(FileRegistry& registry)
     {
-        ChunkData<TEntry> chunk(m_chunkSize);
-        ReadFile(chunk, registry);
+        size_t nodeCount = m_numa.nodes.size();
+        size_t threadCount = TEntry::IsStable ? 1 : std::min(m_readerCount, registry.GetInputFiles().size());
+        if (!TEntry::IsStable && nodeCount > 0)
+            threadCount = (std::max(m_readerCount, nodeCount) + nodeCount - 1) / nodeCount * nodeCount;
+
+        InputQueue inputs(registry.GetInputFiles(), nodeCount > 0 ? threadCount : 0);
+        size_t resumeOffset = registry.GetInputOffset();
+        GetMetrics().StartStage("sort", inputs.GetTotalSize() - std::min(resumeOffset, inputs.GetTotalSize()));
+
+        // the only run is not the result if it is merged with the base file
+        bool isSingleReader = threadCount <= 1 && registry.GetBaseFile().empty();
+
+        if (UseTasks())
+        {
+            ProcessTasks(registry, inputs, std::max<size_t>(threadCount, 1), resumeOffset, isSingleReader);
+            return;
+        }
+
+        if (threadCount <= 1)
+        {
+            auto chunk = std::make_shared<ChunkData<TEntry>>(m_chunkSize);
+            ReadFiles(chunk, registry, inputs, resumeOffset, isSingleReader);
+            return;
+        }
+
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(threadCount);
+        for (size_t n = 0; n < threadCount; ++n)
+        {
+            threads.emplace_back([this, &registry, &inputs, &errors, threadCount, nodeCount, n]()
+            {
+                try
+                {
+                    // the chunk is allocated and first touched after binding, so it is local
+                    if (nodeCount > 0)
+                        BindThreadToNode(m_numa.nodes[n % nodeCount]);
+
+                    auto chunk = std::make_shared<ChunkData<TEntry>>(m_chunkSize / threadCount);
+                    ReadFiles(chunk, registry, inputs, 0, false);
+                }
+                catch (...)
+                {
+                    errors[n] = std::current_exception();
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (const std::exception_ptr& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+
+    // sorts chunk and saves it to the file
+    // index: if not null, sparse index of the file is saved too.
+    FileInfo ProcessChunk(ChunkData<TEntry>& data, const std::string& outputFile, bool computeChecksum = false,
+                          const SparseIndexSettings* index = nullptr)
+    {
+        SortChunk(data);
+        bool isCounted = m_duplicates == DuplicateMode::Count;
+        return SaveFile(outputFile.c_str(), data.entries, data.dataSize, computeChecksum,
+                        isCounted ? &data.counts : nullptr, index);
     }
 
 private:
 
-    // the main version of ReadFile
-    void ReadFile(ChunkData<TEntry>& data, FileRegistry& registry)
+    bool UseTasks() const { return m_scheduler != nullptr && m_numa.nodes.empty(); }
+
+    // readers and sorting of their chunks as tasks
+    void ProcessTasks(FileRegistry& registry, InputQueue& inputs, size_t readerCount, size_t resumeOffset,
+                      bool isSingleReader)
     {
-        FileReader reader(registry.GetInitialFile().c_str());
+        m_runCount = 0;
+        m_committedCount = 0;
+        m_commits.clear();
+        m_freeChunks.clear(); // chunks of a failed sort
+        size_t chunkCount = readerCount > 1 ? readerCount + 1 : 1;
+        for (size_t n = 0; n < chunkCount; ++n)
+            m_freeChunks.push_back(std::make_shared<ChunkData<TEntry>>(m_chunkSize / chunkCount));
+
+        for (size_t n = 0; n < readerCount; ++n)
+        {
+            m_scheduler->Submit(m_tasks, [this, &registry, &inputs, n, resumeOffset, isSingleReader]()
+            {
+                std::shared_ptr<ChunkData<TEntry>> chunk = AcquireChunk();
+                ReadFiles(chunk, registry, inputs, n == 0 ? resumeOffset : 0, isSingleReader);
+                ReleaseChunk(chunk);
+            });
+        }
 
+        m_scheduler->Wait(m_tasks);
+        m_freeChunks.clear();
+    }
+
+    // Reads input files one by one, a chunk is filled by the end of one file and the beginning of the next one.
+    // resumeOffset: data of the first file which is already sorted before restart
+    // isSingleReader: if the whole input fits to one chunk, it is written to the result file.
+    void ReadFiles(std::shared_ptr<ChunkData<TEntry>>& chunk, FileRegistry& registry, InputQueue& inputs,
+                   size_t resumeOffset, bool isSingleReader)
+    {
         Clock c;
         c.Start();
-        size_t totalEntries = 0;
-        int n = 0;
-        while (reader.LoadNextChunk(data.buffer))
+        bool isFirstChunk = isSingleReader && resumeOffset == 0;
+        size_t usedBytes = 0; // the beginning of buffer is used by entries: carried best entries or lines of previous files
+        size_t consumedBytes = 0;
+        PhaseTimer readTimer;
+        PhaseTimer parseTimer;
+        uint64_t readBytes = 0; // lines read to the chunk, for metrics
+        uint64_t readLines = 0;
+
+        InputSlice slice;
+        while (inputs.Pop(&slice))
         {
-            data.entries.clear();
+            FileReader reader(slice.fileName.c_str());
+            const size_t eolSize = reader.GetEol().size();
+
+            if (resumeOffset > 0)
+            {
+                reader.Seek(resumeOffset);
+                resumeOffset = 0;
+            }
+            else if (slice.begin > 0)
+            {
+                reader.Seek(slice.begin);
+            }
+            reader.SetEndOffset(slice.end);
 
-            FileReader::Buffer line;
-            while (reader.TryGetLine(&line))
+            for (;;)
             {
-                ++totalEntries;
-                data.entries.emplace_back(line.data, line.size);
+                readTimer.Start();
+                bool isLoaded = reader.LoadNextChunk(chunk->buffer, usedBytes);
+                readTimer.Stop();
+                if (!isLoaded)
+                    break;
+
+                parseTimer.Start();
+                CollationKeys::Scope keyScope(&chunk->keys);
+                FileReader::Buffer line;
+                uint64_t loadedBytes = 0;
+                while (reader.TryGetLine(&line))
+                {
+                    if (reader.IsLongLine(line))
+                        line.data = chunk->AddLongLine(line.data, line.size);
+
+                    chunk->entries.emplace_back(line.data, line.size);
+                    chunk->dataSize += line.size + eolSize;
+                    loadedBytes += line.size + eolSize;
+                    ++readLines;
+                }
+                parseTimer.Stop();
+                readBytes += loadedBytes;
+                GetMetrics().AddStageBytes(loadedBytes);
+                usedBytes = reader.GetBufferedBytes();
+                consumedBytes = reader.GetConsumedBytes();
+
+                // the rest of chunk is filled by the next file
+                if (reader.IsEof() && usedBytes < chunk->buffer->size() && !inputs.IsEmpty())
+                    break;
+
+                double readTime = c.ElapsedTime();
+                PerfCounters::Values counters = readTimer.GetCounters();
+                PerfCounters::Add(&counters, parseTimer.GetCounters());
+                readTimer.Commit("read", readBytes, 0);
+                parseTimer.Commit("parse", readBytes, readLines);
+                readBytes = 0;
+                readLines = 0;
+
+                GetLog() << "Chunk read complete, EntryCount:" << chunk->entries.size()
+                         << ", ReadTime:" << readTime << "sec"
+                         << PerfCounters::Format(counters)
+                         << std::endl;
+
+                // Whole input fits to one chunk: it is the final result, no tmp files needed.
+                // The chunk can be full by the end of a file while other files are pending.
+                bool isLastChunk = isFirstChunk && reader.IsEof() && inputs.IsEmpty();
+
+                // counts of carried entries would be lost
+                size_t carriedBytes = 0;
+                if (m_limit > 0 && !isLastChunk && !reader.IsEof() && m_duplicates != DuplicateMode::Count)
+                {
+                    SortChunk(*chunk);
+                    carriedBytes = CarryEntries(*chunk, eolSize, reader.GetNextLineOffset());
+                }
+
+                if (carriedBytes == 0)
+                {
+                    SaveRun(chunk, registry, isLastChunk, consumedBytes);
+                    isFirstChunk = false;
+                }
+                usedBytes = carriedBytes;
+                c.Start();
             }
-            double readTime = c.ElapsedTime();
 
-            std::cout << "Chunk read complete, EntryCount:" << data.entries.size()
-                      << ", ReadTime:" << readTime << "sec"
-                      << std::endl;
+            inputs.Release(slice.fileName);
+        }
 
-            ProcessChunk(data, registry);
-            c.Start();
+        if (readLines > 0)
+        {
+            readTimer.Commit("read", readBytes, 0);
+            parseTimer.Commit("parse", readBytes, readLines);
+        }
+
+        if (!chunk->entries.empty())
+        {
+            // carried entries of the last chunk, or the rest of the last file
+            SaveRun(chunk, registry, isFirstChunk, consumedBytes);
         }
     }
 
-    void ProcessChunk(ChunkData<TEntry>& data, FileRegistry& registry)
+    // Saves chunk to the next run and makes it empty.
+    // With scheduler the chunk is sorted and written by a task, the reader continues with a free chunk.
+    // inputOffset: offset of the first line which is not stored in runs yet.
+    void SaveRun(std::shared_ptr<ChunkData<TEntry>>& chunk, FileRegistry& registry, bool isResult, size_t inputOffset)
     {
-        Sort(data.entries);
-        SaveFile(registry.GetNext().c_str(), data.entries);
+        std::string outputFile;
+        size_t runIndex;
+        {
+            std::lock_guard<std::mutex> lock(m_registryMutex);
+            outputFile = isResult ? registry.GetResult() : registry.GetNext();
+            runIndex = m_runCount++;
+        }
+
+        if (!UseTasks())
+        {
+            WriteRun(*chunk, registry, outputFile, isResult, inputOffset, runIndex);
+            return;
+        }
+
+        std::shared_ptr<ChunkData<TEntry>> data;
+        data.swap(chunk);
+        m_scheduler->Submit(m_tasks, [this, data, &registry, outputFile, isResult, inputOffset, runIndex]()
+        {
+            // the chunk is released on error too, readers waiting for it see the error then
+            try
+            {
+                WriteRun(*data, registry, outputFile, isResult, inputOffset, runIndex);
+            }
+            catch (...)
+            {
+                data->Clear();
+                ReleaseChunk(data);
+                throw;
+            }
+            ReleaseChunk(data);
+        });
+        chunk = AcquireChunk();
+    }
+
+    // sorts and writes chunk, commits the run and makes chunk empty
+    void WriteRun(ChunkData<TEntry>& data, FileRegistry& registry, const std::string& outputFile, bool isResult,
+                  size_t inputOffset, size_t runIndex)
+    {
+        Clock c;
+        c.Start();
+        FileInfo info = ProcessChunk(data, outputFile, registry.IsCheckpointEnabled(),
+                                     isResult ? &registry.GetIndexSettings() : nullptr);
+
+        RunStats run;
+        run.fileName = outputFile;
+        run.bytes = info.size;
+        run.records = data.entries.size();
+        run.time = c.ElapsedTime();
+        GetMetrics().AddRun(run);
+
+        std::vector<RunSample> samples = GetSamples(data);
+        data.Clear();
+
+        // runs are committed in their order, so the committed input offset is stored in runs
+        std::lock_guard<std::mutex> lock(m_registryMutex);
+        m_commits[runIndex] = [&registry, outputFile, info, inputOffset]()
+        {
+            registry.CommitRun(outputFile, info, inputOffset);
+        };
+        m_samples.insert(m_samples.end(), samples.begin(), samples.end());
+
+        while (!m_commits.empty() && m_commits.begin()->first == m_committedCount)
+        {
+            m_commits.begin()->second();
+            m_commits.erase(m_commits.begin());
+            ++m_committedCount;
+        }
+    }
+
+    // Free chunk of readers, the caller runs tasks while all chunks are in use.
+    // Throws if a task has failed: its error is rethrown by TaskScheduler::Wait().
+    std::shared_ptr<ChunkData<TEntry>> AcquireChunk()
+    {
+        std::shared_ptr<ChunkData<TEntry>> chunk;
+        m_scheduler->WaitUntil([this, &chunk]()
+        {
+            if (m_tasks.HasError())
+                return true;
+            std::lock_guard<std::mutex> lock(m_chunksMutex);
+            if (m_freeChunks.empty())
+                return false;
+            chunk = m_freeChunks.back();
+            m_freeChunks.pop_back();
+            return true;
+        });
+
+        if (!chunk)
+            throw std::runtime_error("Sorting is stopped by an error of other task");
+        return chunk;
+    }
+
+    void ReleaseChunk(const std::shared_ptr<ChunkData<TEntry>>& chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_chunksMutex);
+            m_freeChunks.push_back(chunk);
+        }
+        m_scheduler->Notify();
+    }
+
+    std::vector<RunSample> GetSamples(const ChunkData<TEntry>& data) const
+    {
+        std::vector<RunSample> samples;
+        size_t count = std::min(m_samplesPerRun, data.entries.size());
+        for (size_t n = 0; n < count; ++n)
+        {
+            const TEntry& entry = data.entries[n * data.entries.size() / count];
+            samples.push_back(RunSample{std::string(entry.GetLinePtr(), entry.GetLineSize()), data.dataSize / count});
+        }
+        return samples;
+    }
+
+    // sorts entries, removes duplicates and entries after the limit
+    void SortChunk(ChunkData<TEntry>& data)
+    {
+        Sort(data.entries, m_limit, m_duplicates);
+
+        if (m_duplicates != DuplicateMode::Keep)
+        {
+            bool isCounted = m_duplicates == DuplicateMode::Count;
+            RemoveDuplicates(data.entries, isCounted ? &data.counts : nullptr, m_limit);
+        }
+    }
+
+    // Moves lines of sorted entries to the beginning of buffer.
+    // freeBytes: bytes at the beginning of buffer which can be overwritten, the next line of reader follows them.
+    // Returns size of moved lines, 0 if they are too big to keep them in buffer.
+    size_t CarryEntries(ChunkData<TEntry>& data, size_t eolSize, size_t freeBytes)
+    {
+        size_t size = 0;
+        for (const TEntry& entry : data.entries)
+            size += entry.GetLineSize();
+
+        if (size == 0 || size > data.buffer->size() / 2 || size > freeBytes)
+            return 0;
+
+        std::vector<char> lines;
+        lines.reserve(size);
+        for (const TEntry& entry : data.entries)
+            lines.insert(lines.end(), entry.GetLinePtr(), entry.GetLinePtr() + entry.GetLineSize());
+
+        memcpy(data.buffer->data(), lines.data(), size);
+
+        // keys of carried entries only
+        CollationKeys keys;
+        CollationKeys::Scope keyScope(&keys);
+
+        const char* linePtr = data.buffer->data();
+        for (TEntry& entry : data.entries)
+        {
+            size_t lineSize = entry.GetLineSize();
+            entry = TEntry(linePtr, lineSize);
+            linePtr += lineSize;
+        }
+        data.longLines.clear();
+        data.keys.Swap(keys);
+
+        data.dataSize = size + data.entries.size() * eolSize;
+        return size;
     }
 };
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "FileReader.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Part of input file: lines in [begin, end).
+struct InputSlice
+{
+    std::string fileName;
+    size_t begin = 0;
+    size_t end = SIZE_MAX;
+};
+
+// Input files shared by reader threads.
+// The next file is taken from the device with the fewest active readers,
+// so files stored on different devices are read in parallel.
+class InputQueue
+{
+    struct Input
+    {
+        InputSlice slice;
+        dev_t device;
+    };
+
+    std::mutex m_mutex;
+    std::vector<Input> m_pending; // in the input order
+    std::multimap<std::string, dev_t> m_active;
+    std::map<dev_t, size_t> m_readerCount;
+    size_t m_totalSize = 0; // of regular files
+
+public:
+    // sliceCount: if there are fewer files, regular files are split to slices of about the same size
+    // at the beginning of lines, so every reader has its own part of input.
+    InputQueue(const std::vector<std::string>& files, size_t sliceCount = 0)
+    {
+        size_t totalSize = 0;
+        bool canSplit = files.size() < sliceCount;
+        for (const std::string& file : files)
+        {
+            if (FileReader::IsStdStream(file))
+                canSplit = false;
+            else
+                totalSize += GetFileSize(file);
+        }
+        m_totalSize = totalSize;
+
+        for (const std::string& file : files)
+        {
+            dev_t device = GetDevice(file);
+            if (!canSplit)
+            {
+                InputSlice slice;
+                slice.fileName = file;
+                m_pending.push_back(Input{slice, device});
+                continue;
+            }
+
+            size_t size = GetFileSize(file);
+            size_t count = std::max<size_t>(1, (size * sliceCount + totalSize / 2) / std::max<size_t>(totalSize, 1));
+            size_t begin = 0;
+            for (size_t n = 1; n <= count && begin < size; ++n)
+            {
+                size_t end = n == count ? size : FindLineStart(file, size * n / count);
+                if (end <= begin)
+                    continue;
+
+                InputSlice slice;
+                slice.fileName = file;
+                slice.begin = begin;
+                slice.end = end;
+                m_pending.push_back(Input{slice, device});
+                begin = end;
+            }
+        }
+    }
+
+    // Returns false if there is no more input.
+    // Call Release() when the slice is read.
+    bool Pop(InputSlice* slice)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_pending.empty())
+            return false;
+
+        size_t best = 0;
+        for (size_t n = 1; n < m_pending.size(); ++n)
+        {
+            if (m_readerCount[m_pending[n].device] < m_readerCount[m_pending[best].device])
+                best = n;
+        }
+
+        Input input = m_pending[best];
+        m_pending.erase(m_pending.begin() + best);
+
+        ++m_readerCount[input.device];
+        m_active.insert(std::make_pair(input.slice.fileName, input.device));
+        *slice = input.slice;
+        return true;
+    }
+
+    void Release(const std::string& fileName)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_active.find(fileName);
+        if (it == m_active.end())
+            return;
+
+        --m_readerCount[it->second];
+        m_active.erase(it);
+    }
+
+    // total size of input files, stdin is not counted
+    size_t GetTotalSize() const { return m_totalSize; }
+
+    bool IsEmpty()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending.empty();
+    }
+
+private:
+
+    static size_t GetFileSize(const std::string& fileName)
+    {
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0)
+            throw std::runtime_error("Cannot open file " + fileName);
+        return st.st_size;
+    }
+
+    // offset of the first line starting at offset or after it
+    static size_t FindLineStart(const std::string& fileName, size_t offset)
+    {
+        if (offset == 0)
+            return 0;
+
+        // the line containing the byte before offset is skipped
+        FileReader reader(fileName.c_str());
+        reader.Seek(offset - 1);
+
+        auto buffer = std::make_shared<std::vector<char>>(64*1024);
+        FileReader::Buffer line;
+        while (reader.LoadNextChunk(buffer))
+        {
+            if (reader.TryGetLine(&line))
+                return reader.GetConsumedBytes();
+        }
+        return reader.GetFileSize();
+    }
+
+    static dev_t GetDevice(const std::string& fileName)
+    {
+        if (FileReader::IsStdStream(fileName))
+            return 0;
+
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0)
+            throw std::runtime_error("Cannot open file " + fileName);
+        return st.st_dev;
+    }
+};
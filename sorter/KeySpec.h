@@ -0,0 +1,210 @@
+#pragma once
+
+#include "SortingEntry.h"
+
+#include <string>
+#include <sstream>
+#include <stdexcept>
+
+// Runtime sort order, parsed from command line, e.g. "number:desc,string",
+// strings can be compared by collation rules, e.g. "string,number;icase" (see Collation.h).
+// It is mapped to the entry type specialized for this order by DispatchKeySpec().
+struct KeySpec
+{
+    SortKey first = SortKey::String;
+    bool firstDesc = false;
+    SortKey second = SortKey::Number;
+    bool secondDesc = false;
+    uint32_t collation = 0; // Collation::Rule flags, 0 means bytes of strings are compared
+    size_t prefixWords = 2; // entry of the default order: PrefixEntry<prefixWords>, 0 means SmallEntry
+
+    // string, then number
+    bool IsDefaultOrder() const
+    {
+        return first == SortKey::String && !firstDesc && second == SortKey::Number && !secondDesc;
+    }
+
+    // the order of SmallEntry and PrefixEntry (all of them sort the same way)
+    bool IsDefault() const { return IsDefaultOrder() && collation == 0; }
+};
+
+// throws std::logic_error if spec is invalid
+inline KeySpec ParseKeySpec(const std::string& text)
+{
+    KeySpec spec;
+    spec.second = SortKey::None;
+
+    size_t semicolon = text.find(';');
+    if (semicolon != std::string::npos)
+    {
+        spec = ParseKeySpec(text.substr(0, semicolon));
+        spec.collation = ParseCollation(text.substr(semicolon + 1));
+        if (!spec.IsDefaultOrder())
+            throw std::logic_error("Collation is supported only for the default key order");
+        return spec;
+    }
+
+    std::istringstream stream(text);
+    std::string field;
+    int count = 0;
+    while (std::getline(stream, field, ','))
+    {
+        bool desc = false;
+        size_t colon = field.find(':');
+        if (colon != std::string::npos)
+        {
+            std::string direction = field.substr(colon + 1);
+            if (direction == "desc")
+                desc = true;
+            else if (direction != "asc")
+                throw std::logic_error("Invalid key direction '" + direction + "'");
+            field.resize(colon);
+        }
+
+        SortKey key;
+        if (field == "string")
+            key = SortKey::String;
+        else if (field == "number")
+            key = SortKey::Number;
+        else
+            throw std::logic_error("Invalid key '" + field + "'");
+
+        if (count == 0)
+        {
+            spec.first = key;
+            spec.firstDesc = desc;
+        }
+        else if (count == 1 && key != spec.first)
+        {
+            spec.second = key;
+            spec.secondDesc = desc;
+        }
+        else
+        {
+            throw std::logic_error("Invalid key spec '" + text + "'");
+        }
+        ++count;
+    }
+
+    if (count == 0)
+        throw std::logic_error("Empty key spec");
+
+    return spec;
+}
+
+// the text of spec which is parsed by ParseKeySpec(), e.g. "number:desc,string"
+inline std::string FormatKeySpec(const KeySpec& spec)
+{
+    auto format = [](SortKey key, bool desc)
+    {
+        return std::string(key == SortKey::String ? "string" : "number") + (desc ? ":desc" : "");
+    };
+
+    std::string text = format(spec.first, spec.firstDesc);
+    if (spec.second != SortKey::None)
+        text += "," + format(spec.second, spec.secondDesc);
+    if (spec.collation != 0)
+        text += ";" + FormatCollation(spec.collation);
+    return text;
+}
+
+namespace detail
+{
+    constexpr SortKey OtherKey(SortKey key)
+    {
+        return key == SortKey::String ? SortKey::Number : SortKey::String;
+    }
+
+    template <SortKey First, bool FirstDesc, class TFunc>
+    int DispatchSecondKey(const KeySpec& spec, TFunc& func)
+    {
+        constexpr SortKey Second = OtherKey(First);
+
+        if (spec.second == SortKey::None)
+            return func.template Run<KeyEntry<KeyOrder<First, FirstDesc, SortKey::None, false>>>();
+
+        if (spec.secondDesc)
+            return func.template Run<KeyEntry<KeyOrder<First, FirstDesc, Second, true>>>();
+
+        return func.template Run<KeyEntry<KeyOrder<First, FirstDesc, Second, false>>>();
+    }
+
+    template <class TFunc>
+    int DispatchPrefixWords(size_t prefixWords, TFunc& func)
+    {
+        switch (prefixWords)
+        {
+        case 0: return func.template Run<SmallEntry>();
+        case 1: return func.template Run<PrefixEntry<1>>();
+        case 2: return func.template Run<PrefixEntry<2>>();
+        case 3: return func.template Run<PrefixEntry<3>>();
+        case 4: return func.template Run<PrefixEntry<4>>();
+        default: throw std::logic_error("Invalid prefix size " + std::to_string(prefixWords * 8));
+        }
+    }
+
+    template <SortKey Second, class TFunc>
+    int DispatchCollation(uint32_t rules, TFunc& func)
+    {
+        const uint32_t Case = Collation::IgnoreCase;
+        const uint32_t Accents = Collation::IgnoreAccents;
+        const uint32_t Punct = Collation::IgnorePunct;
+        switch (rules)
+        {
+        case Case: return func.template Run<CollatedEntry<Case, Second>>();
+        case Accents: return func.template Run<CollatedEntry<Accents, Second>>();
+        case Case | Accents: return func.template Run<CollatedEntry<Case | Accents, Second>>();
+        case Punct: return func.template Run<CollatedEntry<Punct, Second>>();
+        case Case | Punct: return func.template Run<CollatedEntry<Case | Punct, Second>>();
+        case Accents | Punct: return func.template Run<CollatedEntry<Accents | Punct, Second>>();
+        case Case | Accents | Punct: return func.template Run<CollatedEntry<Case | Accents | Punct, Second>>();
+        default: throw std::logic_error("Invalid collation " + std::to_string(rules));
+        }
+    }
+
+    template <SortKey First, class TFunc>
+    int DispatchFirstKey(const KeySpec& spec, TFunc& func)
+    {
+        if (spec.firstDesc)
+            return DispatchSecondKey<First, true>(spec, func);
+
+        return DispatchSecondKey<First, false>(spec, func);
+    }
+}
+
+// Calls func.Run<TEntry>() with entry type specialized for the spec,
+// so comparing doesn't depend on runtime options (collation rules are a parameter of CollatedEntry).
+template <class TFunc>
+int DispatchKeySpec(const KeySpec& spec, TFunc& func)
+{
+    if (spec.IsDefault())
+        return detail::DispatchPrefixWords(spec.prefixWords, func);
+
+    if (spec.collation != 0)
+    {
+        if (!spec.IsDefaultOrder())
+            throw std::logic_error("Collation is supported only for the default key order");
+        return detail::DispatchCollation<SortKey::Number>(spec.collation, func);
+    }
+
+    if (spec.first == SortKey::Number)
+        return detail::DispatchFirstKey<SortKey::Number>(spec, func);
+
+    return detail::DispatchFirstKey<SortKey::String>(spec, func);
+}
+
+// Calls func.Run<TEntry>() with entry type which compares only the first key of the spec,
+// e.g. to find lines of a key range in the sorted file.
+template <class TFunc>
+int DispatchFirstKeySpec(KeySpec spec, TFunc& func)
+{
+    if (spec.collation != 0)
+    {
+        if (!spec.IsDefaultOrder())
+            throw std::logic_error("Collation is supported only for the default key order");
+        return detail::DispatchCollation<SortKey::None>(spec.collation, func);
+    }
+
+    spec.second = SortKey::None;
+    return DispatchKeySpec(spec, func);
+}
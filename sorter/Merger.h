@@ -4,6 +4,7 @@
 #include "FileReader.h"
 #include "FileWriter.h"
 #include "SortingEntry.h"
+#include "TaskScheduler.h"
 
 #include "common/Clock.h"
 
@@ -12,10 +13,12 @@
 #include <string>
 #include <memory>
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
 
 #include <boost/filesystem.hpp>
 
-
 // reads
 template<class TEntry>
 class Merger
@@ -25,32 +28,90 @@ class Merger
         std::shared_ptr<FileReader> reader;
         std::shared_ptr<std::vector<char>> buffer;
         TEntry currentEntry;
+        uint64_t code = OffsetValueCode::Max; // of currentEntry relative to the previous entry of source
+        uint64_t currentCount = 1; // number of equal lines of currentEntry
+        bool isCounted = false; // lines are prefixed with "<count>\t"
+        size_t reportedBytes = 0; // consumed bytes added to progress of metrics
+        CollationKeys keys; // key of currentEntry
+        std::string previousKey; // order key of currentEntry while the next chunk is loaded
 
         // Gets next entry from source
         void Next(double& pureReadTime)
         {
+            const char* previous = currentEntry.IsValid() ? GetOrderKeyPtr(currentEntry) : nullptr;
+            size_t previousSize = currentEntry.IsValid() ? GetOrderKeySize(currentEntry) : 0;
+
             FileReader::Buffer line;
             if (!reader->TryGetLine(&line))
             {
+                size_t consumedBytes = reader->GetConsumedBytes();
+                GetMetrics().AddStageBytes(consumedBytes - reportedBytes);
+                reportedBytes = consumedBytes;
+
+                // the chunk invalidates lines of the current one
+                if (TEntry::UseOffsetValueCode && previous != nullptr)
+                {
+                    previousKey.assign(previous, previousSize);
+                    previous = previousKey.data();
+                }
+
                 Clock c;
                 c.Start();
                 if (!reader->LoadNextChunk(buffer) || !reader->TryGetLine(&line))
                 {
                     currentEntry = TEntry(); // invalidate entry
+                    code = OffsetValueCode::Max;
                     return;
                 }
                 pureReadTime += c.ElapsedTime();
             }
 
+            if (isCounted)
+                currentCount = ParseCount(&line);
+
+            keys.Clear();
+            CollationKeys::Scope keyScope(&keys);
             currentEntry = TEntry(line.data, line.size);
+            code = TEntry::UseOffsetValueCode
+                   ? OffsetValueCode::Make(GetOrderKeyPtr(currentEntry), GetOrderKeySize(currentEntry), previous, previousSize)
+                   : 0;
         }
     };
 
+    // files of a merge and its result
+    struct MergeGroup
+    {
+        size_t index = 0;
+        std::vector<std::string> files;
+        std::string outputFile;
+        bool isLastMerge = false;
+    };
+
     std::vector<Source> m_sources;
-    double m_pureReadTime;
+    size_t m_readBufSize;
+    TaskScheduler* m_scheduler = nullptr;
+    size_t m_parallelMerges = 1;
+    std::vector<std::string> m_files; // opened files
+    std::vector<bool> m_isTmpFile; // tmp files are deleted after merge
+    bool m_hasExternalSources = false; // some of opened files are not runs, their order is checked
+    FileRegistry* m_registry = nullptr;
+    bool m_reclaimSpace = true;
+    bool m_deleteSources = true;
+    std::string m_upperLine;
+    TEntry m_upperBound; // invalid if there is no bound
+    size_t m_limit = 0;
+    DuplicateMode m_duplicates = DuplicateMode::Keep;
+    size_t m_topIndex = 0; // index of source with min currentEntry (m_files.size() means no entries)
+    // Tree of losers: m_tree[node] is the source which lost the match at node (nodes 1..N-1,
+    // leaves N..2N-1 are sources). Losers of the path of the top source lost to it, so their codes
+    // are relative to it, as the code of the next entry of the top source is.
+    std::vector<size_t> m_tree;
+    double m_pureReadTime = 0;
+    uint64_t m_mergedCount = 0; // lines written by the last DoMergeIteration()
+    PerfCounters::Values m_mergeCounters = PerfCounters::Unavailable(); // of the last DoMergeIteration()
 
 public:
-    Merger(size_t count, size_t readBufSize) : m_sources(count)
+    Merger(size_t count, size_t readBufSize) : m_sources(count), m_readBufSize(readBufSize)
     {
         for (size_t n = 0; n < count; ++n)
         {
@@ -58,79 +119,448 @@ public:
         }
     }
 
-    void Process(FileRegistry& registry)
+    ~Merger()
     {
-        int mergeIter = 0;
-        for (; registry.Count() > 1; ++mergeIter)
+        Close();
+    }
+
+    size_t GetMaxSourceCount() const { return m_sources.size(); }
+
+    // If enabled, space of tmp files is reclaimed while they are merged,
+    // so merge needs about the same disk space as its sources have.
+    void SetReclaimSpace(bool reclaim) { m_reclaimSpace = reclaim; }
+
+    // Only the first limit entries of the result are needed (0 means all entries),
+    // every merge writes no more than limit entries.
+    void SetLimit(size_t limit) { m_limit = limit; }
+
+    // If disabled, tmp files are not deleted by Close(), so they can be read by several mergers.
+    void SetDeleteSources(bool deleteSources) { m_deleteSources = deleteSources; }
+
+    // Merge stops at the first entry which is not less than the line.
+    void SetUpperBound(const std::string& line)
+    {
+        m_upperLine = line;
+        m_upperBound = TEntry(m_upperLine.data(), m_upperLine.size());
+    }
+
+    // Sources are runs written with the same mode by InitialSorter,
+    // equal lines of different sources are collapsed while merging.
+    void SetDuplicateMode(DuplicateMode mode) { m_duplicates = mode; }
+
+    // Merges files until registry contains no more than finalCount files.
+    // If finalCount is 1, the last merge writes directly to the result file.
+    // External files are merged at least once, even if it is the only file,
+    // the only tmp file is merged (copied) to the result if the result is stdout.
+    //
+    // Files are merged by passes: every pass merges groups of adjacent files
+    // and puts results to the end in the same order, so every file contains
+    // adjacent part of input and equal entries keep their input order.
+    void Process(FileRegistry& registry, size_t finalCount = 1)
+    {
+        assert(finalCount >= 1 && finalCount <= m_sources.size());
+
+        std::vector<MergeGroup> groups; // merges of the pass which are not done yet
+        size_t passRemained = registry.Count(); // files of current pass which are not merged yet
+        while (registry.Count() > finalCount || registry.HasExternalFiles() ||
+               (finalCount == 1 && registry.IsStreamResultPending()))
         {
-            std::vector<std::string> files = registry.PopFront(m_sources.size());
-            assert(files.size() > 1);
+            // do not merge more files than needed to reach finalCount
+            size_t count = std::min(m_sources.size(), registry.Count() - std::min(finalCount, registry.Count()) + 1);
 
-            for (size_t n = 0; n < files.size(); ++n)
+            if (passRemained < count)
             {
-                m_sources[n].reader = std::make_shared<FileReader>(files[n].c_str());
-                m_sources[n].Next(m_pureReadTime);
+                // the rest of pass goes to the next pass as is
+                MergeGroups(registry, groups);
+                registry.RotateFront(passRemained);
+                passRemained = registry.Count();
+                continue;
             }
 
-            Clock c;
-            c.Start();
+            passRemained -= count;
+            MergeGroup group;
+            group.index = registry.GetMergeCount() + groups.size();
+            group.files = registry.PopFront(count);
+            assert(!group.files.empty());
 
-            std::string outputFile = registry.GetNext("m");
-            DoMergeIteration(outputFile, files.size());
+            // the last merge writes directly to the result file
+            group.isLastMerge = registry.Count() == 0;
+            group.outputFile = group.isLastMerge ? registry.GetResult() : registry.GetNext("m", group.files);
+            groups.push_back(std::move(group));
 
-            std::cout << "Merge #" << mergeIter << " complete for [";
-            for (auto f : files) std::cout << f << "; ";
-            std::cout << "] -> " << outputFile;
-            std::cout << ", Time:" << c.ElapsedTime() << "s, PureReadTime:" << m_pureReadTime << "s" <<std::endl;
+            if (groups.size() >= m_parallelMerges || groups.back().isLastMerge)
+                MergeGroups(registry, groups);
+        }
+        MergeGroups(registry, groups);
+    }
 
-            for (size_t n = 0; n < files.size(); ++n)
+    // Merges of a pass are independent, so they are run by tasks of the scheduler,
+    // up to maxParallelMerges at once (every merge has its own read buffers).
+    void SetScheduler(TaskScheduler* scheduler, size_t maxParallelMerges)
+    {
+        m_scheduler = scheduler;
+        m_parallelMerges = scheduler ? std::max<size_t>(maxParallelMerges, 1) : 1;
+    }
+
+    // Pull interface: merges files on the fly.
+    // offsets: if not empty, reading of every file starts from the offset (beginning of a line).
+    // Returns total size of files.
+    size_t Open(const std::vector<std::string>& files, FileRegistry& registry,
+                const std::vector<size_t>& offsets = std::vector<size_t>())
+    {
+        assert(m_files.empty());
+        assert(files.size() <= m_sources.size());
+
+        m_files = files;
+        m_registry = &registry;
+        m_isTmpFile.resize(files.size());
+
+        size_t totalSize = 0;
+        m_hasExternalSources = false;
+        for (size_t n = 0; n < files.size(); ++n)
+        {
+            m_sources[n].currentEntry = TEntry(); // the first entry is coded relative to empty key
+            m_isTmpFile[n] = registry.IsTmpFile(files[n]);
+            m_hasExternalSources = m_hasExternalSources || !registry.IsRun(files[n]);
+            m_sources[n].reader = std::make_shared<FileReader>(files[n].c_str());
+            if (!offsets.empty() && offsets[n] > 0)
             {
-                m_sources[n].reader.reset(); // close file
-                boost::filesystem::remove(files[n]);
+                m_sources[n].reader->Seek(offsets[n]);
             }
+            if (m_reclaimSpace && m_isTmpFile[n])
+            {
+                m_sources[n].reader->EnableSpaceReclaim(files[n].c_str());
+            }
+            // runs are written by InitialSorter and Merger, external files contain plain lines
+            m_sources[n].isCounted = IsCounted() && registry.IsRun(files[n]);
+            m_sources[n].currentCount = 1;
+            m_sources[n].reportedBytes = m_sources[n].reader->GetConsumedBytes();
+            m_sources[n].Next(m_pureReadTime);
+            totalSize += m_sources[n].reader->GetFileSize();
+        }
+
+        BuildTree();
+        return totalSize;
+    }
+
+    // Returns min entry of opened files, nullptr if all entries are fetched.
+    const TEntry* Top() const
+    {
+        return m_topIndex < m_files.size() ? &m_sources[m_topIndex].currentEntry : nullptr;
+    }
+
+    // Fetches next entry, invalidates pointer returned by Top()
+    void Pop()
+    {
+        assert(m_topIndex < m_files.size());
+        m_sources[m_topIndex].Next(m_pureReadTime);
+
+        // the next entry replays matches of the path to the root
+        size_t N = m_files.size();
+        size_t winner = m_topIndex;
+        for (size_t node = (N + winner) / 2; node > 0; node /= 2)
+        {
+            if (!Play(winner, m_tree[node]))
+                std::swap(winner, m_tree[node]);
+        }
+        SetTop(winner);
+    }
+
+    // closes and deletes opened files
+    void Close()
+    {
+        for (size_t n = 0; n < m_files.size(); ++n)
+        {
+            if (m_reclaimSpace)
+                m_registry->AddReclaimedBytes(m_sources[n].reader->GetReclaimedBytes());
+            m_sources[n].reader.reset(); // close file
+
+            if (m_isTmpFile[n] && m_deleteSources)
+            {
+                boost::system::error_code ec;
+                boost::filesystem::remove(m_files[n], ec);
+            }
+        }
+        m_files.clear();
+    }
 
-            std::cout << "After deleting Time:" << c.ElapsedTime() << std::endl;
+    // Writes merged entries of opened files to the output file.
+    // index: if not null, sparse index of the output file is saved too.
+    FileInfo DoMergeIteration(const std::string& outputFileName, size_t expectedSize, bool computeChecksum,
+                              const SparseIndexSettings* index = nullptr)
+    {
+        PhaseTimer timer;
+        timer.Start();
+
+        FileWriter file(outputFileName, expectedSize);
+        if (computeChecksum)
+            file.EnableChecksum();
+        if (index)
+            file.EnableIndex(*index);
+
+        if (m_duplicates != DuplicateMode::Keep)
+        {
+            m_mergedCount = DoUniqueMergeIteration(file);
         }
+        else
+        {
+            // write min entry to file and fetch next, until all sources has invalid items
+            size_t count = 0;
+            for (const TEntry* entry = Top(); entry != nullptr && IsBelowBound(*entry); entry = Top())
+            {
+                entry->ToStream(file);
+                Pop();
+
+                if (++count == m_limit)
+                    break;
+            }
+            m_mergedCount = count;
+        }
+
+        file.Close();
+        timer.Stop();
+        m_mergeCounters = timer.GetCounters();
+        timer.Commit("merge", file.GetInfo().size, m_mergedCount);
+        return file.GetInfo();
     }
 
 private:
 
-    void DoMergeIteration(const std::string& outputFileName, size_t activeSourceCount)
+    // merger with the same settings, for a parallel merge
+    std::unique_ptr<Merger> Clone() const
     {
-        std::ofstream file(outputFileName.c_str());
+        std::unique_ptr<Merger> merger(new Merger(m_sources.size(), m_readBufSize));
+        merger->m_reclaimSpace = m_reclaimSpace;
+        merger->m_deleteSources = m_deleteSources;
+        merger->m_limit = m_limit;
+        merger->m_duplicates = m_duplicates;
+        if (m_upperBound.IsValid())
+            merger->SetUpperBound(m_upperLine);
+        return merger;
+    }
 
-        size_t N = activeSourceCount;
-        assert(N <= m_sources.size());
+    // Does merges of groups (in parallel if there are several ones) and commits them in their order.
+    void MergeGroups(FileRegistry& registry, std::vector<MergeGroup>& groups)
+    {
+        if (groups.empty())
+            return;
 
-        for (;;)
+        std::vector<std::unique_ptr<Merger>> clones;
+        std::vector<Merger*> mergers;
+        for (size_t n = 0; n < groups.size(); ++n)
         {
-            size_t index = N; // index of source with min currentEntry (N means invalid)
+            if (n > 0)
+                clones.push_back(Clone());
+            mergers.push_back(n == 0 ? this : clones.back().get());
+        }
 
-            for (size_t n = 0; n < N; ++n)
-            {
-                if (!m_sources[n].currentEntry.IsValid())
-                {
-                    continue;
-                }
+        uint64_t totalSize = 0;
+        std::vector<size_t> sizes;
+        for (size_t n = 0; n < groups.size(); ++n)
+        {
+            sizes.push_back(mergers[n]->Open(groups[n].files, registry));
+            totalSize += sizes.back();
+        }
 
-                if (index == N || m_sources[n].currentEntry < m_sources[index].currentEntry)
-                {
-                    index = n;
-                }
+        std::string stage = "merge #" + std::to_string(groups.front().index);
+        if (groups.size() > 1)
+            stage += "-#" + std::to_string(groups.back().index);
+        GetMetrics().StartStage(stage, totalSize);
+
+        std::vector<FileInfo> infos(groups.size());
+        std::vector<double> times(groups.size());
+        auto merge = [&](size_t n)
+        {
+            Clock c;
+            c.Start();
+            const MergeGroup& group = groups[n];
+            infos[n] = mergers[n]->DoMergeIteration(group.outputFile, sizes[n], registry.IsCheckpointEnabled(),
+                                                    group.isLastMerge ? &registry.GetIndexSettings() : nullptr);
+            times[n] = c.ElapsedTime();
+        };
+
+        if (groups.size() == 1)
+        {
+            merge(0);
+        }
+        else
+        {
+            TaskGroup tasks;
+            for (size_t n = 0; n < groups.size(); ++n)
+                m_scheduler->Submit(tasks, [&merge, n]() { merge(n); });
+            m_scheduler->Wait(tasks);
+        }
+
+        for (size_t n = 0; n < groups.size(); ++n)
+        {
+            const MergeGroup& group = groups[n];
+            Merger& merger = *mergers[n];
+            registry.CommitMerge(group.files, group.outputFile, infos[n]);
+
+            RunStats run;
+            run.fileName = group.outputFile;
+            run.bytes = infos[n].size;
+            run.records = merger.m_mergedCount;
+            run.time = times[n];
+            run.counters = merger.m_mergeCounters;
+            GetMetrics().AddRun(run);
+
+            GetLog() << "Merge #" << group.index << " complete for [";
+            for (auto f : group.files) GetLog() << f << "; ";
+            GetLog() << "] -> " << group.outputFile;
+            GetLog() << ", Time:" << times[n] << "s, PureReadTime:" << merger.m_pureReadTime << "s"
+                     << PerfCounters::Format(merger.m_mergeCounters) << std::endl;
+
+            Clock c;
+            c.Start();
+            merger.Close();
+
+            GetLog() << "After deleting Time:" << times[n] + c.ElapsedTime()
+                     << ", TotalReclaimedBytes:" << registry.GetReclaimedBytes() << std::endl;
+        }
+        groups.clear();
+    }
+
+    bool IsBelowBound(const TEntry& entry) const
+    {
+        return !m_upperBound.IsValid() || Less(entry, m_upperBound);
+    }
+
+    bool IsCounted() const { return m_duplicates == DuplicateMode::Count; }
+
+    void BuildTree()
+    {
+        size_t N = m_files.size();
+        m_tree.assign(N, N);
+        if (N == 0)
+        {
+            m_topIndex = 0;
+            return;
+        }
+
+        // winners of subtrees, matches are played from leaves to the root
+        std::vector<size_t> winners(2 * N);
+        for (size_t n = 0; n < N; ++n)
+            winners[N + n] = n;
+        for (size_t node = N - 1; node > 0; --node)
+        {
+            size_t winner = winners[2 * node];
+            size_t loser = winners[2 * node + 1];
+            if (!Play(winner, loser))
+                std::swap(winner, loser);
+            winners[node] = winner;
+            m_tree[node] = loser;
+        }
+        SetTop(winners[1]);
+    }
+
+    void SetTop(size_t index)
+    {
+        m_topIndex = m_sources[index].currentEntry.IsValid() ? index : m_files.size();
+    }
+
+    // Returns true if the entry of source wins the match (it goes first), sets the code of the loser
+    // relative to the winner. Codes of both sources are relative to the same entry: different codes
+    // decide the match, the code of the loser is relative to the winner already.
+    // Equal entries go in order of sources, so the merge is stable.
+    bool Play(size_t source, size_t other)
+    {
+        Source& first = m_sources[source];
+        Source& second = m_sources[other];
+        if (first.code != second.code)
+            return first.code < second.code;
+        if (first.code == OffsetValueCode::Max)
+            return source < other; // both are exhausted
+
+        if (TEntry::UseOffsetValueCode)
+        {
+            uint64_t greaterCode = 0;
+            int cmp = OffsetValueCode::Compare(first.code, GetOrderKeyPtr(first.currentEntry),
+                                               GetOrderKeySize(first.currentEntry), GetOrderKeyPtr(second.currentEntry),
+                                               GetOrderKeySize(second.currentEntry), &greaterCode);
+            if (cmp != 0)
+            {
+                (cmp < 0 ? second : first).code = greaterCode;
+                return cmp < 0;
             }
 
-            if (index < N)
+            // keys are equal, entries are compared by the rest of them
+            bool isFirst = source < other ? !Less(second.currentEntry, first.currentEntry)
+                                          : Less(first.currentEntry, second.currentEntry);
+            (isFirst ? second : first).code = greaterCode;
+            return isFirst;
+        }
+
+        if (source < other)
+            return !Less(second.currentEntry, first.currentEntry);
+        return Less(first.currentEntry, second.currentEntry);
+    }
+
+    bool Less(const TEntry& entry, const TEntry& other) const
+    {
+        return RunLess(entry, other, m_duplicates);
+    }
+
+    // Equal lines are adjacent in merged order, the line is written when the next one differs.
+    // The line is copied, because Pop() can reload buffer it points to.
+    // Lines of external files must be sorted as runs are (LessByLine(), e.g. by sorter --unique),
+    // otherwise equal lines of equal entries could be apart (e.g. KeyEntry with a single key keeps
+    // the input order of equal keys), such files are rejected.
+    // Returns number of written lines.
+    size_t DoUniqueMergeIteration(FileWriter& file)
+    {
+        static const std::string eol = GetPlatformEol();
+        std::string line;
+        TEntry lineEntry; // entry of line, if there are external sources
+        uint64_t lineCount = 0; // 0 means there is no line yet
+        size_t count = 0;
+
+        for (const TEntry* entry = Top(); entry != nullptr && IsBelowBound(*entry); entry = Top())
+        {
+            uint64_t entryCount = m_sources[m_topIndex].currentCount;
+            if (lineCount > 0 && IsSameLine(*entry, line.data(), line.size()))
             {
-                // we found index of source with min entry
-                // write entry to file and fetch next
-                m_sources[index].currentEntry.ToStream(file);
-                m_sources[index].Next(m_pureReadTime);
+                lineCount += entryCount;
+                Pop();
                 continue;
             }
 
-            break; // all sources has invalid items, stop
+            if (lineCount > 0)
+            {
+                // merged lines of sorted sources are in the order of sources
+                if (m_hasExternalSources && !Less(lineEntry, *entry))
+                    throw std::runtime_error("File " + m_files[m_topIndex] + " is not sorted for unique merge, " +
+                                             "lines of equal keys must be sorted too (e.g. by sorter --unique)");
+
+                WriteLine(file, line, lineCount, eol);
+                if (++count == m_limit)
+                {
+                    lineCount = 0;
+                    break;
+                }
+            }
+
+            line.assign(entry->GetLinePtr(), entry->GetLineSize());
+            if (m_hasExternalSources)
+                lineEntry = TEntry(line.data(), line.size());
+            lineCount = entryCount;
+            Pop();
+        }
+
+        if (lineCount > 0)
+        {
+            WriteLine(file, line, lineCount, eol);
+            ++count;
         }
+        return count;
+    }
+
+    void WriteLine(FileWriter& file, const std::string& line, uint64_t count, const std::string& eol)
+    {
+        if (IsCounted())
+            WriteCount(file, count);
 
-        file.close();
+        file.write(line.data(), line.size());
+        file.write(eol.data(), eol.size());
     }
 };
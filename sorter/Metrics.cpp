@@ -0,0 +1,24 @@
+#include "Metrics.h"
+
+Metrics& GetMetrics()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+static std::ostream* logStream = nullptr;
+
+std::ostream& GetLog()
+{
+    static std::ostream discarded(nullptr);
+    return logStream ? *logStream : discarded;
+}
+
+void SetLogStream(std::ostream* stream)
+{
+    logStream = stream;
+}
+
+#ifdef SHANGHAI_COUNT_COMPARES
+thread_local CompareCounter threadCompares;
+#endif
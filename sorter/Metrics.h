@@ -0,0 +1,304 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <condition_variable>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "common/Clock.h"
+#include "PerfCounters.h"
+
+// Totals of one phase of sorting: "read", "parse", "sort", "write", "merge".
+struct PhaseStats
+{
+    size_t count = 0; // number of times the phase is done
+    double time = 0; // sec, sum of all threads
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+    PerfCounters::Values counters = PerfCounters::Unavailable(); // sum of all threads
+};
+
+// Run written by InitialSorter or Merger.
+struct RunStats
+{
+    std::string fileName;
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+    double time = 0; // sec, sorting/merging and writing
+    PerfCounters::Values counters = PerfCounters::Unavailable(); // of merging
+};
+
+// Performance data of sorting, shared by all threads.
+// It is reported as JSON, progress of the current stage can be printed periodically (see ProgressReporter).
+class Metrics : boost::noncopyable
+{
+    mutable std::mutex m_mutex;
+    std::map<std::string, PhaseStats> m_phases;
+    std::vector<RunStats> m_runs;
+    std::atomic<uint64_t> m_compares{0};
+
+    // progress of the current stage
+    std::string m_stage;
+    uint64_t m_stageBytes = 0;
+    Clock m_stageClock;
+    std::atomic<uint64_t> m_stageDoneBytes{0};
+
+public:
+    void AddPhase(const std::string& phase, double time, uint64_t bytes = 0, uint64_t records = 0,
+                  const PerfCounters::Values& counters = PerfCounters::Unavailable())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        PhaseStats& stats = m_phases[phase];
+        ++stats.count;
+        stats.time += time;
+        stats.bytes += bytes;
+        stats.records += records;
+        PerfCounters::Add(&stats.counters, counters);
+    }
+
+    void AddRun(const RunStats& run)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_runs.push_back(run);
+    }
+
+    void AddCompares(uint64_t count) { m_compares += count; }
+    uint64_t GetCompares() const { return m_compares; }
+
+    // Starts the next stage (e.g. "sort", "merge #1") which processes totalBytes.
+    void StartStage(const std::string& stage, uint64_t totalBytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stage = stage;
+        m_stageBytes = totalBytes;
+        m_stageClock.Start();
+        m_stageDoneBytes = 0;
+    }
+
+    void AddStageBytes(uint64_t bytes) { m_stageDoneBytes += bytes; }
+
+    // {"stage":"sort","doneBytes":N,"totalBytes":N,"throughput":bytes/sec,"eta":sec}
+    std::string GetProgress() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t done = m_stageDoneBytes;
+        double elapsed = const_cast<Clock&>(m_stageClock).ElapsedTime();
+        double throughput = elapsed > 0 ? done / elapsed : 0;
+
+        std::ostringstream json;
+        json << "{\"stage\":" << Quote(m_stage)
+             << ",\"doneBytes\":" << done
+             << ",\"totalBytes\":" << m_stageBytes
+             << ",\"throughput\":" << static_cast<uint64_t>(throughput)
+             << ",\"eta\":";
+        if (throughput > 0 && m_stageBytes >= done)
+            json << (m_stageBytes - done) / throughput;
+        else
+            json << "null";
+        json << "}";
+        return json.str();
+    }
+
+    std::map<std::string, PhaseStats> GetPhases() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_phases;
+    }
+
+    // All metrics as JSON object, totalTime: sec of the whole sorting.
+    std::string ToJson(double totalTime) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ostringstream json;
+        json << "{\n  \"totalTime\":" << totalTime << ",\n  \"compares\":";
+#ifdef SHANGHAI_COUNT_COMPARES
+        json << m_compares;
+#else
+        json << "null";
+#endif
+        json << ",\n  \"phases\":{";
+        const char* separator = "\n";
+        for (const auto& phase : m_phases)
+        {
+            const PhaseStats& stats = phase.second;
+            json << separator << "    " << Quote(phase.first) << ":{\"count\":" << stats.count
+                 << ",\"time\":" << stats.time << ",\"bytes\":" << stats.bytes
+                 << ",\"records\":" << stats.records << ",\"perf\":" << CountersToJson(stats.counters) << "}";
+            separator = ",\n";
+        }
+        json << "\n  },\n  \"runs\":[";
+        separator = "\n";
+        for (const RunStats& run : m_runs)
+        {
+            json << separator << "    {\"file\":" << Quote(run.fileName) << ",\"bytes\":" << run.bytes
+                 << ",\"records\":" << run.records << ",\"time\":" << run.time
+                 << ",\"perf\":" << CountersToJson(run.counters) << "}";
+            separator = ",\n";
+        }
+        json << "\n  ]\n}\n";
+        return json.str();
+    }
+
+    void SaveReport(const std::string& fileName, double totalTime) const
+    {
+        std::ofstream file(fileName);
+        file << ToJson(totalTime);
+        if (!file)
+            throw std::runtime_error("Cannot write metrics to " + fileName);
+    }
+
+    // {"cycles":N,...}, null if no counter is available
+    static std::string CountersToJson(const PerfCounters::Values& counters)
+    {
+        std::ostringstream json;
+        const char* separator = "{";
+        for (size_t n = 0; n < PerfCounters::EventCount; ++n)
+        {
+            if (counters[n] < 0)
+                continue;
+            json << separator << Quote(PerfCounters::GetName(n)) << ":" << counters[n];
+            separator = ",";
+        }
+        std::string result = json.str();
+        return result.empty() ? "null" : result + "}";
+    }
+
+    static std::string Quote(const std::string& text)
+    {
+        std::string result = "\"";
+        for (char ch : text)
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                result += '\\';
+                result += ch;
+            }
+            else if (static_cast<unsigned char>(ch) < 0x20)
+            {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", ch);
+                result += code;
+            }
+            else
+            {
+                result += ch;
+            }
+        }
+        return result + "\"";
+    }
+};
+
+// metrics of this process, defined in Metrics.cpp
+Metrics& GetMetrics();
+
+// Log of sorting steps (sorts, merges, checkpoints), it is discarded unless the application sets its stream,
+// so applications which embed the sorter (see ExternalSorter.h) get no messages in their stdout.
+std::ostream& GetLog();
+void SetLogStream(std::ostream* stream);
+
+#ifdef SHANGHAI_COUNT_COMPARES
+// Compares of the thread, they are added to metrics when the thread exits,
+// so counting doesn't share a cache line between threads.
+struct CompareCounter
+{
+    uint64_t count = 0;
+
+    ~CompareCounter() { Flush(); }
+
+    void Flush()
+    {
+        GetMetrics().AddCompares(count);
+        count = 0;
+    }
+};
+
+extern thread_local CompareCounter threadCompares;
+
+inline void CountCompare() { ++threadCompares.count; }
+
+// adds compares of the calling thread (e.g. main thread before report)
+inline void FlushCompares() { threadCompares.Flush(); }
+#else
+// compares are not counted, so hot compare functions have no overhead
+inline void CountCompare() {}
+inline void FlushCompares() {}
+#endif
+
+// Measures time and hardware counters of a phase of the calling thread,
+// the phase can be done in several parts between Start() and Stop().
+class PhaseTimer
+{
+    Clock m_clock;
+    PerfCounters::Values m_start = PerfCounters::Unavailable();
+    double m_time = 0;
+    PerfCounters::Values m_counters = PerfCounters::Unavailable();
+
+public:
+    void Start()
+    {
+        m_start = PerfCounters::Read();
+        m_clock.Start();
+    }
+
+    void Stop()
+    {
+        m_time += m_clock.ElapsedTime();
+        PerfCounters::Add(&m_counters, PerfCounters::Diff(m_start, PerfCounters::Read()));
+    }
+
+    double GetTime() const { return m_time; }
+    const PerfCounters::Values& GetCounters() const { return m_counters; }
+
+    // adds measured parts to metrics as one phase and resets the timer
+    void Commit(const std::string& phase, uint64_t bytes, uint64_t records)
+    {
+        GetMetrics().AddPhase(phase, m_time, bytes, records, m_counters);
+        m_time = 0;
+        m_counters = PerfCounters::Unavailable();
+    }
+};
+
+// Prints progress of metrics as JSON line every interval, while it exists.
+class ProgressReporter : boost::noncopyable
+{
+    std::mutex m_mutex;
+    std::condition_variable m_stop;
+    bool m_isStopped = false;
+    std::thread m_thread;
+
+public:
+    ProgressReporter(const Metrics& metrics, double interval, std::ostream& stream)
+    {
+        m_thread = std::thread([this, &metrics, interval, &stream]()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto period = std::chrono::milliseconds(static_cast<int64_t>(interval * 1000));
+            while (!m_stop.wait_for(lock, period, [this]() { return m_isStopped; }))
+            {
+                stream << "Progress:" << metrics.GetProgress() << std::endl;
+            }
+        });
+    }
+
+    ~ProgressReporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_stop.notify_all();
+        m_thread.join();
+    }
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// NUMA node: cpus and the memory node where their buffers are allocated.
+struct NumaNode
+{
+    int memoryNode = -1; // -1 means any memory (fake node)
+    std::vector<int> cpus; // empty means any cpu
+};
+
+// Nodes of the host, read from sysfs, so no libnuma is needed.
+struct NumaTopology
+{
+    std::vector<NumaNode> nodes;
+
+    // Topology of the host, a single node without binding if it is unknown.
+    static NumaTopology Detect()
+    {
+        NumaTopology topology;
+#ifdef __linux__
+        for (int node = 0; ; ++node)
+        {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string cpuList;
+            if (!file || !std::getline(file, cpuList))
+                break;
+
+            // nodes without cpus have memory only
+            NumaNode numaNode;
+            numaNode.memoryNode = node;
+            numaNode.cpus = ParseCpuList(cpuList);
+            if (!numaNode.cpus.empty())
+                topology.nodes.push_back(numaNode);
+        }
+#endif
+        if (topology.nodes.empty())
+            topology.nodes.push_back(NumaNode());
+        return topology;
+    }
+
+    // Splits cpus of the host to nodeCount fake nodes without memory binding,
+    // e.g. to test NUMA mode on a single node machine.
+    static NumaTopology Fake(size_t nodeCount)
+    {
+        if (nodeCount == 0)
+            throw std::logic_error("Invalid number of NUMA nodes");
+
+        NumaTopology topology;
+        topology.nodes.resize(nodeCount);
+
+        size_t cpuCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        for (size_t cpu = 0; cpu < std::max(cpuCount, nodeCount); ++cpu)
+            topology.nodes[cpu % nodeCount].cpus.push_back(static_cast<int>(cpu % cpuCount));
+        return topology;
+    }
+
+    // "0-3,8,10-11"
+    static std::vector<int> ParseCpuList(const std::string& text)
+    {
+        std::vector<int> cpus;
+        std::istringstream stream(text);
+        std::string range;
+        while (std::getline(stream, range, ','))
+        {
+            if (range.empty())
+                continue;
+
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+};
+
+// Binds the calling thread to cpus of the node, and its new memory to the memory of the node,
+// so buffers allocated and first touched by the thread are local.
+// Returns false if binding is not supported, the thread works anyway.
+inline bool BindThreadToNode(const NumaNode& node)
+{
+#ifdef __linux__
+    bool isOk = true;
+    if (!node.cpus.empty())
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : node.cpus)
+            CPU_SET(cpu, &cpus);
+        isOk = sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+    }
+
+    if (node.memoryNode >= 0)
+    {
+        // set_mempolicy(MPOL_PREFERRED): memory of other nodes is used if the node is full
+        const int mpolPreferred = 1;
+        const size_t bitsPerWord = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(node.memoryNode / bitsPerWord + 1);
+        mask[node.memoryNode / bitsPerWord] |= 1UL << (node.memoryNode % bitsPerWord);
+        isOk = syscall(SYS_set_mempolicy, mpolPreferred, mask.data(), mask.size() * bitsPerWord + 1) == 0 && isOk;
+    }
+    return isOk;
+#else
+    (void)node;
+    return false;
+#endif
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "FileRegistry.h"
+#include "FileReader.h"
+#include "InitialSorter.h"
+#include "Merger.h"
+#include "SortingEntry.h"
+
+#include "common/Clock.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <iostream>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+// The final merge to several output files with non-overlapping key ranges,
+// every file is written by its own thread.
+// Ranges are split by lines selected from run samples, so files have about the same size.
+template <class TEntry>
+class PartitionMerger
+{
+    size_t m_readBufSize;
+    DuplicateMode m_duplicates = DuplicateMode::Keep;
+
+public:
+    PartitionMerger(size_t readBufSize) : m_readBufSize(readBufSize)
+    {
+    }
+
+    void SetDuplicateMode(DuplicateMode mode) { m_duplicates = mode; }
+
+    // Name of the partition file: "<resultFile>.<index>", index has the same width for all files.
+    static std::string GetPartitionFile(const std::string& resultFile, size_t index, size_t count)
+    {
+        std::string number = std::to_string(index);
+        size_t width = std::to_string(count - 1).size();
+        return resultFile + "." + std::string(width - number.size(), '0') + number;
+    }
+
+    // Lines which split sorted samples to count parts of the same weight.
+    // Partition n contains lines in [splitters[n - 1], splitters[n]).
+    std::vector<std::string> ChooseSplitters(std::vector<RunSample> samples, size_t count) const
+    {
+        std::sort(samples.begin(), samples.end(), [this](const RunSample& a, const RunSample& b)
+        {
+            return Less(ToEntry(a.line), ToEntry(b.line));
+        });
+
+        size_t totalWeight = 0;
+        for (const RunSample& sample : samples)
+            totalWeight += sample.weight;
+
+        std::vector<std::string> splitters;
+        size_t weight = 0;
+        size_t index = 0;
+        for (size_t n = 1; n < count && !samples.empty(); ++n)
+        {
+            while (index + 1 < samples.size() && weight + samples[index].weight <= totalWeight / count * n)
+            {
+                weight += samples[index].weight;
+                ++index;
+            }
+            splitters.push_back(samples[index].line);
+        }
+        return splitters;
+    }
+
+    // Merges all files of registry to count partition files.
+    // samples: lines of runs collected by InitialSorter, if there are no samples
+    // (e.g. runs are created before restart), runs are sampled now.
+    void Process(FileRegistry& registry, const std::vector<RunSample>& samples,
+                 const std::string& resultFile, size_t count)
+    {
+        Clock c;
+        c.Start();
+
+        std::vector<std::string> files = registry.PopFront(registry.Count());
+        std::vector<std::string> splitters = ChooseSplitters(samples.empty() ? SampleFiles(registry, files) : samples, count);
+
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(count);
+        for (size_t n = 0; n < count; ++n)
+        {
+            threads.emplace_back([&, n]()
+            {
+                try
+                {
+                    const std::string* lower = n > 0 && n - 1 < splitters.size() ? &splitters[n - 1] : nullptr;
+                    const std::string* upper = n < splitters.size() ? &splitters[n] : nullptr;
+                    MergePartition(registry, files, lower, upper, GetPartitionFile(resultFile, n, count));
+                }
+                catch (...)
+                {
+                    errors[n] = std::current_exception();
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (const std::exception_ptr& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        // runs are read by all partitions, so they are deleted at the end
+        for (const std::string& file : files)
+        {
+            if (registry.IsTmpFile(file))
+            {
+                boost::system::error_code ec;
+                boost::filesystem::remove(file, ec);
+            }
+        }
+
+        GetLog() << "Partitions complete, Count:" << count << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+    }
+
+    // Evenly spaced lines of files, e.g. to choose splitters of files which are not sampled.
+    std::vector<RunSample> SampleFiles(const FileRegistry& registry, const std::vector<std::string>& files) const
+    {
+        const size_t samplesPerFile = 256;
+
+        std::vector<RunSample> samples;
+        for (const std::string& file : files)
+        {
+            FileReader reader(file.c_str());
+            size_t size = reader.GetFileSize();
+            size_t lineOffset = 0;
+
+            for (size_t n = 0; n < samplesPerFile; ++n)
+            {
+                RunSample sample;
+                sample.weight = size / samplesPerFile;
+                if (ReadLineAt(reader, size / samplesPerFile * n, IsCounted(registry, file), &sample.line, &lineOffset))
+                    samples.push_back(sample);
+            }
+        }
+        return samples;
+    }
+
+private:
+
+    static TEntry ToEntry(const std::string& line)
+    {
+        return TEntry(line.data(), line.size());
+    }
+
+    bool Less(const TEntry& entry, const TEntry& other) const
+    {
+        return RunLess(entry, other, m_duplicates);
+    }
+
+    // runs of InitialSorter and Merger contain counted lines, external files contain plain lines
+    bool IsCounted(const FileRegistry& registry, const std::string& file) const
+    {
+        return m_duplicates == DuplicateMode::Count && registry.IsRun(file);
+    }
+
+    // merges lines in [lower, upper) of all files, null bound means no bound
+    void MergePartition(FileRegistry& registry, const std::vector<std::string>& files,
+                        const std::string* lower, const std::string* upper, const std::string& outputFile)
+    {
+        Clock c;
+        c.Start();
+
+        // files where the partition is not empty
+        std::vector<std::string> sources;
+        std::vector<size_t> offsets;
+        size_t expectedSize = 0;
+        for (const std::string& file : files)
+        {
+            FileReader reader(file.c_str());
+            bool isCounted = IsCounted(registry, file);
+            size_t begin = lower ? FindLowerBound(reader, ToEntry(*lower), isCounted) : 0;
+            size_t end = upper ? FindLowerBound(reader, ToEntry(*upper), isCounted) : reader.GetFileSize();
+            if (begin < end)
+            {
+                sources.push_back(file);
+                offsets.push_back(begin);
+                expectedSize += end - begin;
+            }
+        }
+
+        Merger<TEntry> merger(std::max<size_t>(sources.size(), 1), m_readBufSize);
+        merger.SetDuplicateMode(m_duplicates);
+        merger.SetReclaimSpace(false);
+        merger.SetDeleteSources(false);
+        if (upper)
+            merger.SetUpperBound(*upper);
+
+        merger.Open(sources, registry, offsets);
+        merger.DoMergeIteration(outputFile, expectedSize, false, &registry.GetIndexSettings());
+        merger.Close();
+
+        GetLog() << "Partition complete, Sources:" << sources.size() << " -> " << outputFile
+                 << ", Time:" << c.ElapsedTime() << "sec" << std::endl;
+    }
+
+    // Reads the first line starting at offset or after it.
+    // Returns false if there is no such line.
+    bool ReadLineAt(FileReader& reader, size_t offset, bool isCounted,
+                    std::string* line, size_t* lineOffset) const
+    {
+        // lines are short usually, the reader keeps longer ones in its own storage
+        auto buffer = std::make_shared<std::vector<char>>(8*1024);
+        FileReader::Buffer data;
+        auto readLine = [&]()
+        {
+            return reader.TryGetLine(&data) || (reader.LoadNextChunk(buffer) && reader.TryGetLine(&data));
+        };
+
+        // the line containing the byte before offset is skipped
+        reader.Seek(offset > 0 ? offset - 1 : 0);
+        if (offset > 0 && !readLine())
+            return false;
+
+        *lineOffset = reader.GetConsumedBytes();
+        if (!readLine())
+            return false;
+
+        if (isCounted)
+            ParseCount(&data);
+
+        line->assign(data.data, data.size);
+        return true;
+    }
+
+    // Binary search of the first line which is not less than bound.
+    // Returns its offset, or file size if all lines are less.
+    size_t FindLowerBound(FileReader& reader, const TEntry& bound, bool isCounted) const
+    {
+        std::string line;
+        size_t lineOffset = 0;
+
+        // the line starting at low or after it is the result
+        size_t low = 0;
+        size_t high = reader.GetFileSize();
+        while (low < high)
+        {
+            size_t mid = low + (high - low) / 2;
+            if (!ReadLineAt(reader, mid, isCounted, &line, &lineOffset) || !Less(ToEntry(line), bound))
+                high = mid;
+            else
+                low = lineOffset + 1;
+        }
+
+        if (!ReadLineAt(reader, low, isCounted, &line, &lineOffset))
+            return reader.GetFileSize();
+        return lineOffset;
+    }
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <cerrno>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Hardware counters of the calling thread (Linux perf_event_open), user space only,
+// so they work with the default perf_event_paranoid. Counters which are not supported
+// by the host (e.g. VM without PMU) are unavailable, sorting works anyway.
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        Cycles,
+        Instructions,
+        LlcMisses,
+        BranchMisses,
+        DtlbMisses,
+        EventCount
+    };
+
+    // -1 means the counter is unavailable
+    typedef std::array<int64_t, EventCount> Values;
+
+    static Values Unavailable()
+    {
+        Values values;
+        values.fill(-1);
+        return values;
+    }
+
+    static const char* GetName(size_t event)
+    {
+        static const char* names[EventCount] = {"cycles", "instructions", "llcMisses", "branchMisses", "dtlbMisses"};
+        return names[event];
+    }
+
+    // Counters are opened by threads when they read them the first time.
+    static void Enable(bool isEnabled = true) { IsEnabledFlag() = isEnabled; }
+    static bool IsEnabled() { return IsEnabledFlag(); }
+
+    // Returns the current values of the calling thread,
+    // all values are unavailable if counters are disabled.
+    static Values Read()
+    {
+        if (!IsEnabled())
+            return Unavailable();
+        return GetThreadCounters().Read();
+    }
+
+    // Returns the reason if no counter can be opened, empty string otherwise.
+    static std::string GetError()
+    {
+        if (!IsEnabled())
+            return "disabled";
+        return GetThreadCounters().error;
+    }
+
+    // end - start, unavailable if any of them is unavailable
+    static Values Diff(const Values& start, const Values& end)
+    {
+        Values values;
+        for (size_t n = 0; n < EventCount; ++n)
+            values[n] = start[n] < 0 || end[n] < 0 ? -1 : end[n] - start[n];
+        return values;
+    }
+
+    // sum of available values
+    static void Add(Values* total, const Values& values)
+    {
+        for (size_t n = 0; n < EventCount; ++n)
+        {
+            if (values[n] >= 0)
+                (*total)[n] = std::max<int64_t>((*total)[n], 0) + values[n];
+        }
+    }
+
+    // ", cycles:N, instructions:N, ..." for log messages, empty if no counter is available
+    static std::string Format(const Values& values)
+    {
+        std::ostringstream text;
+        for (size_t n = 0; n < EventCount; ++n)
+        {
+            if (values[n] >= 0)
+                text << ", " << GetName(n) << ":" << values[n];
+        }
+        if (values[Cycles] > 0 && values[Instructions] >= 0)
+            text << ", ipc:" << static_cast<double>(values[Instructions]) / values[Cycles];
+        return text.str();
+    }
+
+private:
+
+    static std::atomic<bool>& IsEnabledFlag()
+    {
+        static std::atomic<bool> isEnabled(false);
+        return isEnabled;
+    }
+
+    struct ThreadCounters
+    {
+        std::array<int, EventCount> fds;
+        std::string error;
+
+        ThreadCounters()
+        {
+            fds.fill(-1);
+#ifdef __linux__
+            const std::array<std::pair<uint32_t, uint64_t>, EventCount> events = {{
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)}
+            }};
+
+            bool isAnyOpen = false;
+            for (size_t n = 0; n < EventCount; ++n)
+            {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = events[n].first;
+                attr.config = events[n].second;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                // this thread on any cpu
+                fds[n] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+                if (fds[n] >= 0)
+                    isAnyOpen = true;
+                else if (error.empty())
+                    error = strerror(errno);
+            }
+            if (isAnyOpen)
+                error.clear();
+#else
+            error = "not supported";
+#endif
+        }
+
+        ~ThreadCounters()
+        {
+#ifdef __linux__
+            for (int fd : fds)
+            {
+                if (fd >= 0)
+                    close(fd);
+            }
+#endif
+        }
+
+        Values Read() const
+        {
+            Values values = Unavailable();
+#ifdef __linux__
+            for (size_t n = 0; n < EventCount; ++n)
+            {
+                uint64_t data[3]; // value, time enabled, time running
+                if (fds[n] < 0 || read(fds[n], data, sizeof(data)) != sizeof(data))
+                    continue;
+
+                // counters are multiplexed if there are more events than hardware counters
+                double scale = data[2] > 0 && data[2] < data[1] ? static_cast<double>(data[1]) / data[2] : 1;
+                values[n] = static_cast<int64_t>(data[0] * scale);
+            }
+#endif
+            return values;
+        }
+    };
+
+    static ThreadCounters& GetThreadCounters()
+    {
+        static thread_local ThreadCounters counters;
+        return counters;
+    }
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "FileReader.h"
+#include "SortingEntry.h"
+
+#include "common/Clock.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <iostream>
+#include <algorithm>
+
+// Checks that file is sorted in TEntry order.
+// File is split to ranges which are checked by separate threads,
+// then the last line of every range is compared with the first line of the next one.
+template <class TEntry>
+class SortChecker
+{
+    struct Range
+    {
+        size_t begin = 0; // the range contains lines starting in [begin, end)
+        size_t end = 0;
+        size_t firstOffset = 0;
+        std::string firstLine; // empty if there are no lines in range
+        std::string lastLine;
+        size_t errorOffset = NotFound; // the first line out of order
+        std::exception_ptr error;
+    };
+
+    size_t m_threadCount;
+    size_t m_readBufSize;
+
+public:
+    static constexpr size_t NotFound = static_cast<size_t>(-1);
+
+    SortChecker(size_t threadCount, size_t readBufSize)
+        : m_threadCount(std::max<size_t>(threadCount, 1)), m_readBufSize(readBufSize)
+    {
+    }
+
+    // Returns offset of the first line which is less than the previous one, NotFound if file is sorted.
+    size_t Check(const std::string& fileName)
+    {
+        Clock c;
+        c.Start();
+
+        std::vector<Range> ranges = SplitFile(fileName);
+
+        std::vector<std::thread> threads;
+        for (Range& range : ranges)
+        {
+            threads.emplace_back([this, &fileName, &range]()
+            {
+                try
+                {
+                    CheckRange(fileName, range);
+                }
+                catch (...)
+                {
+                    range.error = std::current_exception();
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        GetLog() << "Check complete, Threads:" << ranges.size() << ", time:" << c.ElapsedTime() << "sec" << std::endl;
+
+        const Range* prev = nullptr; // the last range with lines
+        for (const Range& range : ranges)
+        {
+            if (range.error)
+                std::rethrow_exception(range.error);
+
+            if (range.firstLine.empty())
+                continue;
+
+            if (prev && ToEntry(range.firstLine) < ToEntry(prev->lastLine))
+                return range.firstOffset;
+
+            if (range.errorOffset != NotFound)
+                return range.errorOffset;
+
+            prev = &range;
+        }
+
+        return NotFound;
+    }
+
+private:
+
+    std::vector<Range> SplitFile(const std::string& fileName)
+    {
+        FileReader reader(fileName.c_str());
+        size_t size = reader.GetFileSize();
+
+        // stdin and small files are checked by one thread
+        size_t count = reader.IsSizeKnown() ? std::min(m_threadCount, size / m_readBufSize + 1) : 1;
+
+        std::vector<Range> ranges(count);
+        for (size_t n = 0; n < count; ++n)
+        {
+            ranges[n].begin = size / count * n;
+            ranges[n].end = n + 1 < count ? size / count * (n + 1) : NotFound;
+        }
+        return ranges;
+    }
+
+    static TEntry ToEntry(const std::string& line)
+    {
+        return TEntry(line.data(), line.size());
+    }
+
+    void CheckRange(const std::string& fileName, Range& range)
+    {
+        FileReader reader(fileName.c_str());
+        auto buffer = std::make_shared<std::vector<char>>(m_readBufSize);
+
+        std::string prevLine; // copy of prev line, when buffer is reloaded
+        TEntry prev;
+        FileReader::Buffer line;
+
+        if (range.begin > 0)
+        {
+            // the line containing the byte before range belongs to the previous range
+            reader.Seek(range.begin - 1);
+            if (!reader.TryGetLine(&line) && (!reader.LoadNextChunk(buffer) || !reader.TryGetLine(&line)))
+                return;
+        }
+
+        while (reader.GetConsumedBytes() < range.end)
+        {
+            size_t offset = reader.GetConsumedBytes();
+            if (!reader.TryGetLine(&line))
+            {
+                // prev points to the buffer which is reloaded
+                if (prev.IsValid())
+                {
+                    prevLine.assign(prev.GetLinePtr(), prev.GetLineSize());
+                    prev = ToEntry(prevLine);
+                }
+
+                if (!reader.LoadNextChunk(buffer) || !reader.TryGetLine(&line))
+                    break;
+            }
+
+            TEntry entry(line.data, line.size);
+            if (!prev.IsValid())
+            {
+                range.firstOffset = offset;
+                range.firstLine.assign(line.data, line.size);
+            }
+            else if (entry < prev)
+            {
+                range.errorOffset = offset;
+                break;
+            }
+
+            prev = entry;
+        }
+
+        if (prev.IsValid())
+            range.lastLine.assign(prev.GetLinePtr(), prev.GetLineSize());
+    }
+};
+
+template <class TEntry>
+constexpr size_t SortChecker<TEntry>::NotFound;
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include "FileReader.h"
+
+// Shape of input data, measured by a sample of lines before sorting.
+struct InputProfile
+{
+    size_t lineCount = 0; // sampled lines
+    double lineSize = 0; // average, bytes
+    double stringSize = 0; // average size of string part of line, from the dot
+    double sharedPrefix = 0; // average bytes shared by neighbour distinct strings of sorted sample
+    double duplicates = 0; // ratio of sampled strings equal to their neighbour
+    double inputLines = 0; // estimated lines of the whole input
+};
+
+// Layout of entry for the default order: all layouts give the same order, they differ in speed.
+struct SortPlan
+{
+    size_t prefixWords = 2; // 64bit words of PrefixEntry, 0 means SmallEntry (no prefix)
+    std::string reason;
+
+    std::string GetEntryName() const
+    {
+        return prefixWords == 0 ? "SmallEntry" : "PrefixEntry<" + std::to_string(prefixWords) + ">";
+    }
+};
+
+// Reads sampleCount blocks evenly spaced over input files, returns profile of their whole lines.
+// Blocks don't overlap: small input has less blocks, input smaller than a block is read as a whole.
+// Input which cannot be sampled (stdin) gives empty profile.
+inline InputProfile SampleInput(const std::vector<std::string>& files, size_t sampleCount = 64,
+                                size_t blockSize = 64 * 1024)
+{
+    InputProfile profile;
+    std::vector<uint64_t> sizes;
+    uint64_t totalSize = 0;
+    for (const std::string& file : files)
+    {
+        if (FileReader::IsStdStream(file))
+            return profile;
+        sizes.push_back(boost::filesystem::file_size(file));
+        totalSize += sizes.back();
+    }
+    if (totalSize == 0)
+        return profile;
+    sampleCount = std::max<uint64_t>(std::min<uint64_t>(sampleCount, totalSize / blockSize), 1);
+
+    std::vector<std::string> strings;
+    uint64_t lineBytes = 0;
+    uint64_t stringBytes = 0;
+    std::vector<char> block(blockSize);
+    for (size_t n = 0; n < sampleCount; ++n)
+    {
+        // file and offset of the block
+        uint64_t offset = totalSize * n / sampleCount;
+        size_t index = 0;
+        while (offset >= sizes[index])
+            offset -= sizes[index++];
+
+        std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(files[index].c_str(), "rb"), &fclose);
+        if (!file || fseeko(file.get(), static_cast<off_t>(offset), SEEK_SET) != 0)
+            throw std::runtime_error("Cannot read file " + files[index]);
+        size_t size = fread(block.data(), 1u, block.size(), file.get());
+
+        // whole lines only: the beginning of the first line can be in the previous block,
+        // the last line without EOL is whole at the end of file
+        const char* pos = block.data();
+        const char* end = pos + size;
+        if (offset > 0)
+        {
+            const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+            pos = eol ? eol + 1 : end;
+        }
+        bool isFileEnd = offset + size == sizes[index];
+        while (pos < end)
+        {
+            const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+            if (eol == nullptr && !isFileEnd)
+                break;
+            const char* lineEnd = eol ? eol : end;
+            if (lineEnd > pos && lineEnd[-1] == '\r')
+                --lineEnd;
+
+            const char* dot = static_cast<const char*>(memchr(pos, '.', lineEnd - pos));
+            if (dot != nullptr)
+            {
+                // the string of entries starts after the dot (see SmallEntry)
+                strings.emplace_back(dot + 1, lineEnd);
+                lineBytes += lineEnd - pos;
+                stringBytes += lineEnd - dot - 1;
+            }
+            pos = eol ? eol + 1 : end;
+        }
+    }
+
+    if (strings.empty())
+        return profile;
+
+    std::sort(strings.begin(), strings.end());
+    uint64_t sharedBytes = 0;
+    size_t distinctPairs = 0;
+    size_t duplicates = 0;
+    for (size_t n = 1; n < strings.size(); ++n)
+    {
+        const std::string& prev = strings[n - 1];
+        const std::string& str = strings[n];
+        if (prev == str)
+        {
+            ++duplicates;
+            continue;
+        }
+
+        size_t shared = std::mismatch(prev.begin(), prev.begin() + std::min(prev.size(), str.size()), str.begin()).first
+                        - prev.begin();
+        sharedBytes += shared;
+        ++distinctPairs;
+    }
+
+    profile.lineCount = strings.size();
+    profile.lineSize = static_cast<double>(lineBytes) / strings.size();
+    profile.stringSize = static_cast<double>(stringBytes) / strings.size();
+    profile.sharedPrefix = distinctPairs > 0 ? static_cast<double>(sharedBytes) / distinctPairs : 0;
+    profile.duplicates = static_cast<double>(duplicates) / strings.size();
+    profile.inputLines = totalSize / (profile.lineSize + 1);
+    return profile;
+}
+
+// Chooses the narrowest prefix which decides most compares: neighbour strings differ
+// in the byte after their shared prefix. Wider entries are moved slower by sort and merge,
+// so the prefix pays off only while it is short (micro/sort/PrefixEntry<4> of bench is slower
+// than micro/sort/SmallEntry), the smallest entry is chosen if strings share more bytes.
+// Equal strings are compared to their end by any entry, so duplicates choose the smallest one too.
+inline SortPlan ChooseSortPlan(const InputProfile& profile)
+{
+    SortPlan plan;
+    if (profile.lineCount == 0)
+    {
+        plan.reason = "no sample";
+        return plan;
+    }
+
+    const size_t maxWords = 2;
+    if (profile.duplicates >= 0.25)
+    {
+        plan.prefixWords = 0;
+        plan.reason = "duplicates";
+        return plan;
+    }
+
+    double neededBytes = profile.sharedPrefix + 1;
+    // neighbours of the whole input share more than neighbours of the sample,
+    // about 1/4 byte more (alphabet of 16 characters) per doubling of lines
+    if (profile.inputLines > profile.lineCount)
+        neededBytes += std::log2(profile.inputLines / profile.lineCount) / 4;
+
+    size_t words = static_cast<size_t>(std::ceil(neededBytes / sizeof(uint64_t)));
+    if (words > maxWords)
+    {
+        plan.prefixWords = 0;
+        plan.reason = "shared prefix is longer than " + std::to_string(maxWords * sizeof(uint64_t)) + " bytes";
+        return plan;
+    }
+
+    plan.prefixWords = std::max<size_t>(words, 1);
+    plan.reason = "shared prefix fits " + std::to_string(plan.prefixWords * sizeof(uint64_t)) + " bytes";
+    return plan;
+}
+
+// one line of log, e.g. "Sort plan: sampled lines:1000, ... entry:PrefixEntry<1> (shared prefix fits 8 bytes)"
+inline std::string FormatSortPlan(const InputProfile& profile, const SortPlan& plan)
+{
+    std::ostringstream text;
+    text << "Sort plan: sampled lines:" << profile.lineCount << ", line size:" << profile.lineSize
+         << ", string size:" << profile.stringSize << ", shared prefix:" << profile.sharedPrefix
+         << ", duplicates:" << profile.duplicates << ", entry:" << plan.GetEntryName() << " (" << plan.reason << ")";
+    return text.str();
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include "FileRegistry.h"
+#include "KeySpec.h"
+#include "common/Utils.h"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <glob.h>
+
+enum class SorterMode
+{
+    Sort,
+    Merge, // merge already sorted files
+    Check // check that file is sorted
+};
+
+// command line of sorter app
+struct SorterOptions
+{
+    SorterMode mode = SorterMode::Sort;
+    std::string inputFile; // the first input file
+    std::vector<std::string> inputFiles;
+    std::string outputFile;
+    std::string baseFile; // already sorted file, input is merged to it
+    size_t chunkSize = 0;
+    KeySpec keySpec;
+    bool planEntry = true; // entry of the default order is chosen by a sample of input (see SortPlanner.h)
+    size_t entryPrefixWords = 2; // --entry, it is set to keySpec.prefixWords
+    size_t limit = 0;
+    DuplicateMode duplicates = DuplicateMode::Keep;
+    size_t readers = 0; // 0 means a thread per input file, up to number of cores
+    size_t partitions = 0; // 0 means the single output file
+    size_t workers = 0; // 0 means sorting in this process
+    bool numa = false;
+    size_t fakeNumaNodes = 0; // 0 means the topology of the host
+    size_t indexBlockSize = 0; // 0 means no sparse index of output
+    std::string metricsFile; // empty means no metrics report
+    double progressInterval = 0; // sec, 0 means no progress
+    bool perfCounters = false;
+
+    std::vector<std::string> tmpDirs;
+    TmpDirPolicy tmpDirPolicy = TmpDirPolicy::RoundRobin;
+    bool reclaimSpace = true;
+    bool checkpoint = false;
+    bool resume = false;
+};
+
+inline const char* GetUsage()
+{
+    return
+        "Usage: sorter [options] <input-file>... <output-file> <chunk-size>\n"
+        "       sorter [options] --merge <input-file>... <output-file>\n"
+        "       sorter [options] --check <input-file>\n"
+        "Use '-' as input-file/output-file to read stdin/write stdout.\n"
+        "Input file can be a glob pattern, e.g. 'shards/*.txt'.\n"
+        "Options:\n"
+        "  --base <file>         merge sorted input with already sorted file (the result of previous sorting),\n"
+        "                        it can be the output file too\n"
+        "  --merge               merge already sorted files, inputs are not changed\n"
+        "  --check               check that file is sorted, exit code is 2 if it is not\n"
+        "  -k <keys>             sort order, comma separated keys 'string' and 'number' with optional ':desc',\n"
+        "                        default is 'string,number'; single key means stable sort by this key\n"
+        "  --collate <rules>     compare strings by collation rules, comma separated: icase (UTF-8 case folding),\n"
+        "                        noaccents (Latin-1 letters without diacritics), nopunct (ASCII punctuation is skipped)\n"
+        "  --entry <type>        entry of the default order: auto (default, chosen by a sample of input), small,\n"
+        "                        prefix8, prefix16, prefix24 or prefix32 (bytes of string prefix in entry)\n"
+        "  --limit <N>           output only the first N lines of sorted data\n"
+        "  --unique              output only the first of equal lines\n"
+        "  --count               output unique lines prefixed with the number of their occurrences and tab\n"
+        "  --output-partitions <N>  write N files <output-file>.<index> with non-overlapping key ranges\n"
+        "  --index <block-size>  write sparse index <output-file>.idx, a line per block (e.g. 64K)\n"
+        "  --readers <N>         number of threads reading input files\n"
+        "  --numa                bind reader threads and their chunks to NUMA nodes\n"
+        "  --numa-nodes <N>      NUMA mode with N fake nodes, e.g. for testing on a single node host\n"
+        "  --workers <N>         sort by N worker processes, each sorts its own key range\n"
+        "  --metrics <file>      write metrics of sorting (phase times, bytes, records, runs) to file as JSON\n"
+        "  --progress <sec>      print progress of the current stage with throughput and ETA to stderr every sec\n"
+        "  --perf-counters       measure cycles, instructions, LLC, branch and dTLB misses of every phase\n"
+        "  --tmp-dir <dir>       store tmp files in dir, can be repeated to stripe them over several dirs\n"
+        "  --tmp-policy <name>   how tmp files are distributed: round-robin (default) or free-space\n"
+        "  --no-reclaim          keep merged tmp files untouched until merge completes\n"
+        "  --checkpoint          save progress to <input-file>.manifest, so sorting can be resumed\n"
+        "  --resume              continue sorting from the saved checkpoint (starts from scratch if there is none)\n";
+}
+
+// Expands glob patterns, other names are kept as is.
+// throws std::logic_error if pattern matches no files
+inline std::vector<std::string> ExpandInputs(const std::vector<std::string>& names)
+{
+    std::vector<std::string> files;
+    for (const std::string& name : names)
+    {
+        if (name.find_first_of("*?[") == std::string::npos)
+        {
+            files.push_back(name);
+            continue;
+        }
+
+        glob_t matches;
+        int result = glob(name.c_str(), 0, nullptr, &matches);
+        if (result == 0)
+            files.insert(files.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+        globfree(&matches);
+
+        if (result != 0)
+            throw std::logic_error("No files match '" + name + "'");
+    }
+    return files;
+}
+
+// throws std::logic_error if command line is invalid
+inline SorterOptions ParseOptions(int argc, char** argv)
+{
+    SorterOptions options;
+    std::vector<std::string> positional;
+
+    for (int n = 1; n < argc; ++n)
+    {
+        std::string arg = argv[n];
+
+        auto value = [&]() -> std::string
+        {
+            if (n + 1 >= argc)
+                throw std::logic_error("Missing value of " + arg);
+            return argv[++n];
+        };
+
+        if (arg == "--merge")
+        {
+            options.mode = SorterMode::Merge;
+        }
+        else if (arg == "--check")
+        {
+            options.mode = SorterMode::Check;
+        }
+        else if (arg == "--base")
+        {
+            options.baseFile = value();
+        }
+        else if (arg == "-k" || arg == "--key")
+        {
+            uint32_t collation = options.keySpec.collation; // --collate before -k
+            options.keySpec = ParseKeySpec(value());
+            if (options.keySpec.collation == 0)
+                options.keySpec.collation = collation;
+        }
+        else if (arg == "--collate")
+        {
+            options.keySpec.collation = ParseCollation(value());
+        }
+        else if (arg == "--entry")
+        {
+            std::string entry = value();
+            options.planEntry = entry == "auto";
+            if (entry == "small")
+                options.entryPrefixWords = 0;
+            else if (entry == "prefix8" || entry == "prefix16" || entry == "prefix24" || entry == "prefix32")
+                options.entryPrefixWords = std::stoul(entry.substr(6)) / 8;
+            else if (!options.planEntry)
+                throw std::logic_error("Invalid entry type '" + entry + "'");
+        }
+        else if (arg == "--limit")
+        {
+            std::string limit = value();
+            try
+            {
+                options.limit = boost::lexical_cast<size_t>(limit);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid limit '" + limit + "'");
+            }
+        }
+        else if (arg == "--unique")
+        {
+            if (options.duplicates == DuplicateMode::Keep)
+                options.duplicates = DuplicateMode::Remove;
+        }
+        else if (arg == "--count")
+        {
+            options.duplicates = DuplicateMode::Count;
+        }
+        else if (arg == "--readers")
+        {
+            std::string readers = value();
+            try
+            {
+                options.readers = boost::lexical_cast<size_t>(readers);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid number of readers '" + readers + "'");
+            }
+        }
+        else if (arg == "--output-partitions")
+        {
+            std::string partitions = value();
+            try
+            {
+                options.partitions = boost::lexical_cast<size_t>(partitions);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid number of partitions '" + partitions + "'");
+            }
+        }
+        else if (arg == "--numa")
+        {
+            options.numa = true;
+        }
+        else if (arg == "--numa-nodes")
+        {
+            std::string nodes = value();
+            try
+            {
+                options.fakeNumaNodes = boost::lexical_cast<size_t>(nodes);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid number of NUMA nodes '" + nodes + "'");
+            }
+            if (options.fakeNumaNodes == 0)
+                throw std::logic_error("Invalid number of NUMA nodes '" + nodes + "'");
+            options.numa = true;
+        }
+        else if (arg == "--workers")
+        {
+            std::string workers = value();
+            try
+            {
+                options.workers = boost::lexical_cast<size_t>(workers);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid number of workers '" + workers + "'");
+            }
+        }
+        else if (arg == "--index")
+        {
+            options.indexBlockSize = GetSize(value());
+            if (options.indexBlockSize == 0)
+                throw std::logic_error("Invalid index block size");
+        }
+        else if (arg == "--metrics")
+        {
+            options.metricsFile = value();
+        }
+        else if (arg == "--progress")
+        {
+            std::string interval = value();
+            try
+            {
+                options.progressInterval = boost::lexical_cast<double>(interval);
+            }
+            catch (boost::bad_lexical_cast&)
+            {
+                throw std::logic_error("Invalid progress interval '" + interval + "'");
+            }
+            if (!(options.progressInterval > 0))
+                throw std::logic_error("Invalid progress interval '" + interval + "'");
+        }
+        else if (arg == "--perf-counters")
+        {
+            options.perfCounters = true;
+        }
+        else if (arg == "--tmp-dir")
+        {
+            options.tmpDirs.push_back(value());
+        }
+        else if (arg == "--tmp-policy")
+        {
+            std::string policy = value();
+            if (policy == "round-robin")
+                options.tmpDirPolicy = TmpDirPolicy::RoundRobin;
+            else if (policy == "free-space")
+                options.tmpDirPolicy = TmpDirPolicy::FreeSpace;
+            else
+                throw std::logic_error("Invalid tmp policy '" + policy + "'");
+        }
+        else if (arg == "--no-reclaim")
+        {
+            options.reclaimSpace = false;
+        }
+        else if (arg == "--checkpoint")
+        {
+            options.checkpoint = true;
+        }
+        else if (arg == "--resume")
+        {
+            options.resume = true;
+        }
+        else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+        {
+            throw std::logic_error("Unknown option " + arg);
+        }
+        else
+        {
+            positional.push_back(arg);
+        }
+    }
+
+    options.keySpec.prefixWords = options.entryPrefixWords; // -k after --entry
+
+    if (options.keySpec.collation != 0 && !options.keySpec.IsDefaultOrder())
+        throw std::logic_error("Collation is supported only for the default key order");
+
+    // other orders have own entries (see DispatchKeySpec())
+    if (!options.planEntry && !options.keySpec.IsDefault())
+        throw std::logic_error("Entry is supported only for the default order without collation");
+
+    if (options.mode != SorterMode::Sort && (options.checkpoint || options.resume))
+        throw std::logic_error("Checkpoint is supported only for sorting");
+
+    if (!options.baseFile.empty() && (options.mode != SorterMode::Sort || options.checkpoint || options.resume))
+        throw std::logic_error("Base file is supported only for sorting without checkpoint");
+
+    if (options.partitions > 0 && (options.mode != SorterMode::Sort || options.limit > 0))
+        throw std::logic_error("Partitions are supported only for sorting without limit");
+
+    if (options.workers > 0 && (options.mode != SorterMode::Sort || options.limit > 0 || options.partitions > 0 ||
+                                !options.baseFile.empty() || options.checkpoint || options.resume))
+        throw std::logic_error("Workers are supported only for sorting without limit, partitions, base file and checkpoint");
+
+    // metrics of workers stay in their processes, and the progress thread must not run while they are forked
+    if (options.workers > 0 && (!options.metricsFile.empty() || options.progressInterval > 0))
+        throw std::logic_error("Workers are not supported with metrics and progress");
+
+#ifndef __linux__
+    if (options.workers > 0)
+        throw std::logic_error("Workers are supported only on Linux");
+#endif
+
+    if (options.numa && (options.mode != SorterMode::Sort || options.checkpoint || options.resume))
+        throw std::logic_error("NUMA mode is supported only for sorting without checkpoint");
+
+    if (options.indexBlockSize > 0 && options.mode == SorterMode::Check)
+        throw std::logic_error("Index is supported only for sorting and merging");
+
+    if (options.mode == SorterMode::Merge)
+    {
+        if (positional.size() < 2)
+            throw std::logic_error("Invalid number of arguments");
+
+        options.inputFiles = ExpandInputs(std::vector<std::string>(positional.begin(), positional.end() - 1));
+        options.inputFile = options.inputFiles.front();
+        options.outputFile = positional.back();
+        if (std::find(options.inputFiles.begin(), options.inputFiles.end(), options.outputFile) != options.inputFiles.end())
+            throw std::logic_error("Output file cannot be one of merged files");
+        if (options.indexBlockSize > 0 && options.outputFile == "-")
+            throw std::logic_error("Index cannot be written for stdout");
+        return options;
+    }
+
+    if (options.mode == SorterMode::Check)
+    {
+        if (positional.size() != 1)
+            throw std::logic_error("Invalid number of arguments");
+
+        options.inputFile = positional[0];
+        options.inputFiles = positional;
+        return options;
+    }
+
+    if (positional.size() < 3)
+        throw std::logic_error("Invalid number of arguments");
+
+    options.inputFiles = ExpandInputs(std::vector<std::string>(positional.begin(), positional.end() - 2));
+    options.inputFile = options.inputFiles.front();
+    options.outputFile = positional[positional.size() - 2];
+    options.chunkSize = GetSize(positional.back());
+
+    if (options.partitions > 0 && options.outputFile == "-")
+        throw std::logic_error("Partitions cannot be written to stdout");
+    if (options.indexBlockSize > 0 && options.outputFile == "-")
+        throw std::logic_error("Index cannot be written for stdout");
+    return options;
+}
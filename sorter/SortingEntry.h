@@ -1,6 +1,8 @@
 #pragma once
 
 #include "common/Utils.h"
+#include "Metrics.h"
+#include "Collation.h"
 
 #include <iostream>
 #include <string>
@@ -8,8 +10,17 @@
 #include <cassert>
 #include <algorithm>
 #include <tuple>
+#include <type_traits>
 #include <stdint.h>
 
+// What to do with equal entries
+enum class DuplicateMode
+{
+    Keep,
+    Remove, // keep the first one only
+    Count // keep the first one and write number of equal entries before it
+};
+
 // Entry we are going to sort, primitive implementation (for comparing)
 // Time of std::sort of 1G data is ~18.5sec
 class SimpleEntry
@@ -19,6 +30,8 @@ class SimpleEntry
 public:
     static constexpr bool IsExternalBuffer = false;
     static constexpr bool UseHash = false;
+    static constexpr bool IsStable = false;
+    static constexpr bool UseOffsetValueCode = false;
 
     SimpleEntry() : m_number(-1) {}
     SimpleEntry(int number, const std::string& string) : m_number(number), m_string(string) {}
@@ -52,9 +65,6 @@ public:
 };
 
 
-size_t totalCmpCount = 0;
-size_t memCmpCount = 0;
-
 // Entry we are going to sort.
 // features:
 // * no memory copy, it stores ptr to buffer
@@ -66,12 +76,25 @@ class SmallEntry
     const char* m_linePtr = nullptr;
     uint64_t m_packedData = 0;
 
+    // Line size field of long line (rare): the number field holds the size,
+    // the number is parsed from the line again when it is needed.
+    static constexpr uint64_t LongLineMark = 0xffff;
 
-protected:
+    bool IsLongLine() const { return ((m_packedData >> 16) & 0xffff) == LongLineMark; }
 
+public:
+
+    // the whole line (without EOL)
     const char* GetLinePtr() const { return m_linePtr; }
-    uint64_t GetNumber() const { return m_packedData >> 32; }
-    uint64_t GetLineSize() const { return (m_packedData >> 16) & 0xffff; }
+    uint64_t GetLineSize() const
+    {
+        uint64_t size = (m_packedData >> 16) & 0xffff;
+        return size != LongLineMark ? size : m_packedData >> 32;
+    }
+
+protected:
+
+    uint64_t GetNumber() const { return !IsLongLine() ? m_packedData >> 32 : fast_atoi(m_linePtr); }
     uint64_t GetStringOffset() const { return m_packedData & 0xffff; }
 
     const char* GetStringPtr() const { return m_linePtr + GetStringOffset(); }
@@ -82,24 +105,39 @@ protected:
     }
 public:
 
+    // bytes which entries are ordered by first, see OffsetValueCode
+    const char* GetOrderKeyPtr() const { return GetStringPtr(); }
+    uint64_t GetOrderKeySize() const { return GetStringLen(); }
+
     static constexpr bool IsExternalBuffer = true;
     static constexpr bool UseHash = false;
+    static constexpr bool IsStable = false; // equal entries are reordered
+    static constexpr bool UseOffsetValueCode = true; // entries are ordered by bytes of GetOrderKey*() first
 
     SmallEntry() {}
 
     SmallEntry(const char* line, size_t size) : m_linePtr(line)
     {
-        assert(size <= 0xffff);
-
         const char* dotPos = reinterpret_cast<const char*>(memchr(line, '.', size));
         if (dotPos == nullptr)
             throw std::logic_error("Invalid line [" + std::string(line, line + std::min(1000LU, size)) + "]");
 
         size_t offset = dotPos - line + 1;
-        m_packedData = fast_atoi(line);
-        m_packedData = m_packedData << 32;
-        m_packedData = m_packedData | ((size & 0xffff) << 16);
-        m_packedData = m_packedData | ((offset & 0xffff) << 0);
+        if (offset > 0xffff || size > 0xffffffff)
+            throw std::logic_error("Line is too long [" + std::string(line, line + 1000) + "...]");
+
+        if (size < LongLineMark)
+        {
+            m_packedData = fast_atoi(line);
+            m_packedData = m_packedData << 32;
+            m_packedData = m_packedData | (size << 16);
+        }
+        else
+        {
+            m_packedData = static_cast<uint64_t>(size) << 32;
+            m_packedData = m_packedData | (LongLineMark << 16);
+        }
+        m_packedData = m_packedData | offset;
     }
 
     bool IsValid() const { return m_linePtr != nullptr; }
@@ -136,24 +174,33 @@ public:
 
 static_assert(sizeof(SmallEntry) == 16, "check SmallEntry");
 
+// Prefix of string as tuple of Words 64bit numbers, see GetPrefixTuple()
+template <size_t Words> struct PrefixTuple;
+template <> struct PrefixTuple<1> { typedef std::tuple<uint64_t> Type; };
+template <> struct PrefixTuple<2> { typedef std::tuple<uint64_t, uint64_t> Type; };
+template <> struct PrefixTuple<3> { typedef std::tuple<uint64_t, uint64_t, uint64_t> Type; };
+template <> struct PrefixTuple<4> { typedef std::tuple<uint64_t, uint64_t, uint64_t, uint64_t> Type; };
+
 // Extends SmallEntry
-// * first N bytes comparing as int64, not as array of char (N=2*sizeof(uint64))
-// Larger sizeof, but faster compare.
-// Time of std::sort of 1G data is ~3.5sec
-class FastEntry : public SmallEntry
+// * first N bytes comparing as int64, not as array of char (N=Words*sizeof(uint64))
+// Larger sizeof, but faster compare while strings differ in the first N bytes.
+// The best N depends on data: it should cover bytes shared by neighbour strings (see SortPlanner.h).
+template <size_t Words>
+class PrefixEntry : public SmallEntry
 {
-    std::tuple<uint64_t, uint64_t> m_prefix;
+    typename PrefixTuple<Words>::Type m_prefix;
 public:
+    static constexpr size_t PrefixSize = Words * sizeof(uint64_t);
 
-    FastEntry() {}
-    FastEntry(const char* line, size_t size) : SmallEntry(line, size)
+    PrefixEntry() {}
+    PrefixEntry(const char* line, size_t size) : SmallEntry(line, size)
     {
         GetPrefixTuple(GetStringPtr(), GetStringLen(), &m_prefix);
     }
 
-    bool operator<(const FastEntry& other) const
+    bool operator<(const PrefixEntry& other) const
     {
-        ++totalCmpCount;
+        CountCompare();
         if (m_prefix < other.m_prefix) return true;
         if (m_prefix > other.m_prefix) return false;
 
@@ -162,7 +209,7 @@ public:
         size_t size = GetStringLen();
         size_t size1 = other.GetStringLen();
 
-        constexpr size_t N = sizeof(m_prefix);
+        constexpr size_t N = PrefixSize;
 
         if (size > N && size1 > N)
         {
@@ -170,14 +217,331 @@ public:
 
             if (cmp < 0) return true;
             if (cmp > 0) return false;
-
-            if (size < size1) return true;
-            if (size > size1) return false;
         }
 
+        // one string is a prefix of the other one
+        if (size < size1) return true;
+        if (size > size1) return false;
+
         // strings are equal, compare numbers
         return GetNumber() < other.GetNumber();
     }
 };
 
+// Time of std::sort of 1G data is ~3.5sec
+typedef PrefixEntry<2> FastEntry;
+
+static_assert(sizeof(PrefixEntry<1>) == 24U, "check PrefixEntry");
 static_assert(sizeof(FastEntry) <= 32U, "check FastEntry");
+static_assert(sizeof(PrefixEntry<4>) == 48U, "check PrefixEntry");
+
+// Parts of the line which entries are compared by
+enum class SortKey { String, Number, None };
+
+// Compile-time sort order: First key, then Second key.
+// Without second key entries are stable (equal entries keep their input order).
+template <SortKey First, bool FirstDesc, SortKey Second, bool SecondDesc>
+struct KeyOrder
+{
+    static_assert(First != SortKey::None && First != Second, "check KeyOrder");
+
+    static constexpr bool NumberFirst = First == SortKey::Number;
+    static constexpr bool UseString = First == SortKey::String || Second == SortKey::String;
+    static constexpr bool UseNumber = First == SortKey::Number || Second == SortKey::Number;
+    static constexpr bool StringDesc = First == SortKey::String ? FirstDesc : SecondDesc;
+    static constexpr bool NumberDesc = First == SortKey::Number ? FirstDesc : SecondDesc;
+    static constexpr bool IsStable = Second == SortKey::None;
+};
+
+// FastEntry with configurable sort order.
+// The order is normalized into the prefix, so descending keys
+// and number-first order are compared as fast as the default order:
+// * string first: prefix is the first 16 bytes of string;
+// * number first: prefix is the number and the first 12 bytes of string;
+// descending keys are stored inverted.
+template <class TOrder>
+class KeyEntry : public SmallEntry
+{
+    std::tuple<uint64_t, uint64_t> m_prefix;
+
+    // bytes of string stored in prefix
+    static constexpr size_t N = TOrder::NumberFirst ? 12 : 16;
+
+public:
+    static constexpr bool IsStable = TOrder::IsStable;
+    static constexpr bool UseOffsetValueCode = false;
+
+    KeyEntry() {}
+    KeyEntry(const char* line, size_t size) : SmallEntry(line, size)
+    {
+        std::tuple<uint64_t, uint64_t> str(0, 0);
+        if (TOrder::UseString)
+        {
+            GetPrefixTuple(GetStringPtr(), GetStringLen(), &str);
+            if (TOrder::StringDesc)
+            {
+                std::get<0>(str) = ~std::get<0>(str);
+                std::get<1>(str) = ~std::get<1>(str);
+            }
+        }
+
+        uint64_t number = 0;
+        if (TOrder::UseNumber)
+        {
+            number = TOrder::NumberDesc ? (~GetNumber() & 0xffffffff) : GetNumber();
+        }
+
+        if (TOrder::NumberFirst)
+        {
+            // number (32bit) + string bytes [0, 4), string bytes [4, 12)
+            std::get<0>(m_prefix) = (number << 32) | (std::get<0>(str) >> 32);
+            std::get<1>(m_prefix) = (std::get<0>(str) << 32) | (std::get<1>(str) >> 32);
+        }
+        else
+        {
+            m_prefix = str;
+        }
+    }
+
+    bool operator<(const KeyEntry& other) const
+    {
+        CountCompare();
+        if (m_prefix < other.m_prefix) return true;
+        if (m_prefix > other.m_prefix) return false;
+
+        // prefixes are equal (number is equal too, if it is the first key)
+
+        if (TOrder::UseString)
+        {
+            int cmp = CompareStringTail(other);
+            if (cmp != 0) return TOrder::StringDesc ? cmp > 0 : cmp < 0;
+        }
+
+        if (TOrder::UseNumber && !TOrder::NumberFirst)
+        {
+            return TOrder::NumberDesc ? GetNumber() > other.GetNumber() : GetNumber() < other.GetNumber();
+        }
+
+        return false;
+    }
+
+private:
+
+    // compares strings after the first N bytes
+    int CompareStringTail(const KeyEntry& other) const
+    {
+        size_t size = GetStringLen();
+        size_t size1 = other.GetStringLen();
+
+        if (size > N && size1 > N)
+        {
+            int cmp = memcmp(GetStringPtr() + N, other.GetStringPtr() + N, std::min(size, size1) - N);
+            if (cmp != 0) return cmp;
+        }
+
+        // one string is a prefix of the other one
+        if (size < size1) return -1;
+        if (size > size1) return 1;
+        return 0;
+    }
+};
+
+static_assert(sizeof(KeyEntry<KeyOrder<SortKey::Number, true, SortKey::String, false>>) <= 32U, "check KeyEntry");
+
+// FastEntry ordered by collation keys of strings (see Collation.h), lines are output as is.
+// Rules are Collation::Rule flags, so entries of different rules don't share a collation.
+// The key is built once by constructor and stored in the current CollationKeys arena of the thread,
+// so compares are the prefix and memcmp of keys. Entries without arena (e.g. bounds of merge)
+// compare the rest of their keys by building them on the fly.
+// Second is SortKey::None to compare strings only (e.g. lookup by the first key).
+template <uint32_t Rules, SortKey Second = SortKey::Number>
+class CollatedEntry : public SmallEntry
+{
+    static_assert(Second == SortKey::Number || Second == SortKey::None, "check CollatedEntry");
+
+    uint64_t m_prefix = 0; // the first 8 bytes of key
+    const char* m_key = nullptr; // key size (uint32_t) and key in arena, nullptr if there is no arena
+
+public:
+
+    static constexpr bool IsStable = Second == SortKey::None;
+
+    // keys of the previous entries are cleared by the merge
+    static constexpr bool UseOffsetValueCode = false;
+
+    CollatedEntry() {}
+    CollatedEntry(const char* line, size_t size) : SmallEntry(line, size)
+    {
+        const Collation& collation = Collation::Get<Rules>();
+        CollationKeys* keys = CollationKeys::GetCurrent();
+        if (keys != nullptr)
+        {
+            m_key = keys->Add(collation, GetStringPtr(), GetStringLen());
+            m_prefix = GetPrefix(GetKeyPtr(), GetKeySize());
+        }
+        else
+        {
+            m_prefix = collation.GetKeyPrefix(GetStringPtr(), GetStringLen());
+        }
+    }
+
+    bool operator<(const CollatedEntry& other) const
+    {
+        CountCompare();
+        if (m_prefix < other.m_prefix) return true;
+        if (m_prefix > other.m_prefix) return false;
+
+        int cmp = m_key && other.m_key ? CompareKeyTail(other)
+                                       : Collation::Get<Rules>().Compare(GetStringPtr(), GetStringLen(),
+                                                                         other.GetStringPtr(), other.GetStringLen());
+        if (cmp != 0) return cmp < 0;
+
+        // keys are equal, compare numbers
+        return Second == SortKey::Number && GetNumber() < other.GetNumber();
+    }
+
+private:
+
+    const char* GetKeyPtr() const { return m_key + sizeof(uint32_t); }
+
+    size_t GetKeySize() const
+    {
+        uint32_t size;
+        memcpy(&size, m_key, sizeof(size));
+        return size;
+    }
+
+    // compares keys after the first N bytes (N = sizeof(m_prefix))
+    int CompareKeyTail(const CollatedEntry& other) const
+    {
+        constexpr size_t N = sizeof(m_prefix);
+        size_t size = GetKeySize();
+        size_t size1 = other.GetKeySize();
+
+        if (size > N && size1 > N)
+        {
+            int cmp = memcmp(GetKeyPtr() + N, other.GetKeyPtr() + N, std::min(size, size1) - N);
+            if (cmp != 0) return cmp;
+        }
+
+        // one key is a prefix of the other one
+        if (size < size1) return -1;
+        if (size > size1) return 1;
+        return 0;
+    }
+};
+
+static_assert(sizeof(CollatedEntry<Collation::IgnoreCase>) <= 32U, "check CollatedEntry");
+
+// Equal entries may have different lines (e.g. "1. a" and "01. a", or any lines with the same key
+// of KeyEntry with a single key), so duplicates are the entries with the same line.
+// This order puts them next to each other: equal entries are ordered by their lines.
+template <class TEntry>
+bool LessByLine(const TEntry& entry, const TEntry& other)
+{
+    if (entry < other) return true;
+    if (other < entry) return false;
+
+    size_t size = entry.GetLineSize();
+    size_t size1 = other.GetLineSize();
+    int cmp = memcmp(entry.GetLinePtr(), other.GetLinePtr(), std::min(size, size1));
+    return cmp < 0 || (cmp == 0 && size < size1);
+}
+
+// The order of sorted runs: if duplicates are removed, equal lines must be adjacent.
+template <class TEntry>
+bool RunLess(const TEntry& entry, const TEntry& other, DuplicateMode duplicates)
+{
+    if (duplicates != DuplicateMode::Keep)
+        return LessByLine(entry, other);
+
+    return entry < other;
+}
+
+template <class TEntry>
+bool IsSameLine(const TEntry& entry, const char* line, size_t size)
+{
+    return entry.GetLineSize() == size && memcmp(entry.GetLinePtr(), line, size) == 0;
+}
+
+// Offset-value code of an entry relative to a base entry which is not greater (e.g. the previous
+// entry of a sorted run): the offset of the first byte where their order keys differ
+// and the value of this byte (0 if the key ends there, so the keys are equal).
+// Codes of entries relative to the same base are ordered as the entries are, a smaller code
+// means a smaller entry. Entries with equal codes are compared from the offset (see Compare()).
+class OffsetValueCode
+{
+public:
+    static constexpr uint64_t Max = UINT64_MAX; // code of invalid entry, greater than codes of entries
+
+    static uint64_t Make(size_t offset, const char* key, size_t size)
+    {
+        uint64_t value = offset < size ? static_cast<unsigned char>(key[offset]) + 1 : 0;
+        return (static_cast<uint64_t>(0xffffffff - offset) << 9) | value;
+    }
+
+    // code of key relative to base (base <= key), the first from bytes are known to be equal
+    static uint64_t Make(const char* key, size_t size, const char* base, size_t baseSize, size_t from = 0)
+    {
+        return Make(Mismatch(key, base, std::min(size, baseSize), from), key, size);
+    }
+
+    // Compares keys with equal codes relative to the same base, returns memcmp-like result.
+    // The code of the greater key relative to the smaller one is set to greaterCode,
+    // keys are equal if it returns 0 (the code of equal key is set then).
+    static int Compare(uint64_t code, const char* key, size_t size, const char* key1, size_t size1,
+                       uint64_t* greaterCode)
+    {
+        size_t from = 0xffffffff - (code >> 9) + 1; // the byte of code is equal too
+        size_t offset = Mismatch(key, key1, std::min(size, size1), from);
+        int cmp = (size > size1) - (size < size1);
+        if (offset < std::min(size, size1))
+            cmp = static_cast<unsigned char>(key[offset]) - static_cast<unsigned char>(key1[offset]);
+        *greaterCode = cmp < 0 ? Make(offset, key1, size1) : Make(offset, key, size);
+        return cmp;
+    }
+
+private:
+
+    // the first offset where bytes differ, size if they are equal
+    static size_t Mismatch(const char* key, const char* key1, size_t size, size_t from)
+    {
+        size_t offset = std::min(from, size);
+        for (; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t))
+        {
+            uint64_t word, word1;
+            memcpy(&word, key + offset, sizeof(word));
+            memcpy(&word1, key1 + offset, sizeof(word1));
+            if (word != word1)
+                break;
+        }
+        while (offset < size && key[offset] == key1[offset])
+            ++offset;
+        return offset;
+    }
+};
+
+// order key of entries which use offset-value codes, other entries have no key
+template <class TEntry>
+typename std::enable_if<TEntry::UseOffsetValueCode, const char*>::type GetOrderKeyPtr(const TEntry& entry)
+{
+    return entry.GetOrderKeyPtr();
+}
+
+template <class TEntry>
+typename std::enable_if<!TEntry::UseOffsetValueCode, const char*>::type GetOrderKeyPtr(const TEntry&)
+{
+    return nullptr;
+}
+
+template <class TEntry>
+typename std::enable_if<TEntry::UseOffsetValueCode, size_t>::type GetOrderKeySize(const TEntry& entry)
+{
+    return entry.GetOrderKeySize();
+}
+
+template <class TEntry>
+typename std::enable_if<!TEntry::UseOffsetValueCode, size_t>::type GetOrderKeySize(const TEntry&)
+{
+    return 0;
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+
+// Sparse index of sorted file: the first line starting in every block of file with its offset,
+// so lines of a key range are found by binary search in index and one short read of file.
+//
+// Binary format (native byte order):
+//     "SHIDX001"
+//     uint32 flags, uint32 size of sort order, sort order (e.g. "string,number")
+//     uint64 block size, uint64 number of entries
+//     entries: uint64 offset, uint16 line size, line
+struct SparseIndexSettings
+{
+    size_t blockSize = 0; // 0 means no index
+    std::string keySpec; // sort order of file
+    bool isCounted = false; // lines start with "<count>\t"
+
+    static constexpr uint32_t CountedFlag = 1;
+};
+
+// index file of the sorted file
+inline std::string GetIndexFile(const std::string& fileName)
+{
+    return fileName + ".idx";
+}
+
+class SparseIndex
+{
+public:
+    struct Entry
+    {
+        uint64_t offset;
+        std::string line;
+    };
+
+    // lines are stored as is, longer lines are not indexed (the next line of block is used)
+    static constexpr size_t MaxLineSize = 1024;
+
+    SparseIndexSettings settings;
+    std::vector<Entry> entries;
+
+    void Save(const std::string& fileName) const
+    {
+        std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(fileName.c_str(), "wb"), &fclose);
+        if (!file)
+            throw std::runtime_error("Cannot open index file " + fileName);
+
+        uint32_t flags = settings.isCounted ? SparseIndexSettings::CountedFlag : 0;
+        Write(file.get(), Magic(), 8);
+        WriteValue(file.get(), flags);
+        WriteValue(file.get(), static_cast<uint32_t>(settings.keySpec.size()));
+        Write(file.get(), settings.keySpec.data(), settings.keySpec.size());
+        WriteValue(file.get(), static_cast<uint64_t>(settings.blockSize));
+        WriteValue(file.get(), static_cast<uint64_t>(entries.size()));
+
+        for (const Entry& entry : entries)
+        {
+            WriteValue(file.get(), entry.offset);
+            WriteValue(file.get(), static_cast<uint16_t>(entry.line.size()));
+            Write(file.get(), entry.line.data(), entry.line.size());
+        }
+
+        if (fflush(file.get()) != 0)
+            throw std::runtime_error("Cannot write index file " + fileName);
+    }
+
+    void Load(const std::string& fileName)
+    {
+        std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(fileName.c_str(), "rb"), &fclose);
+        if (!file)
+            throw std::runtime_error("Cannot open index file " + fileName);
+
+        char magic[8];
+        Read(file.get(), magic, sizeof(magic));
+        if (memcmp(magic, Magic(), sizeof(magic)) != 0)
+            throw std::runtime_error("Invalid index file " + fileName);
+
+        uint32_t flags = ReadValue<uint32_t>(file.get());
+        settings.isCounted = (flags & SparseIndexSettings::CountedFlag) != 0;
+        settings.keySpec.resize(ReadValue<uint32_t>(file.get()));
+        Read(file.get(), &settings.keySpec[0], settings.keySpec.size());
+        settings.blockSize = ReadValue<uint64_t>(file.get());
+
+        entries.resize(ReadValue<uint64_t>(file.get()));
+        for (Entry& entry : entries)
+        {
+            entry.offset = ReadValue<uint64_t>(file.get());
+            entry.line.resize(ReadValue<uint16_t>(file.get()));
+            Read(file.get(), &entry.line[0], entry.line.size());
+        }
+    }
+
+    // Returns [begin, end) offsets of file which contain all lines of a key range.
+    // isBefore(line): true if line is before the range, isAfter(line): true if line is after the range.
+    template <class TBefore, class TAfter>
+    std::pair<uint64_t, uint64_t> FindRange(TBefore isBefore, TAfter isAfter, uint64_t fileSize) const
+    {
+        // the last entry before the range: lines before it are before the range too
+        auto first = std::partition_point(entries.begin(), entries.end(),
+                                          [&isBefore](const Entry& entry) { return isBefore(entry.line); });
+        uint64_t begin = first == entries.begin() ? 0 : (first - 1)->offset;
+
+        // the first entry after the range
+        auto last = std::partition_point(first, entries.end(),
+                                         [&isAfter](const Entry& entry) { return !isAfter(entry.line); });
+        uint64_t end = last == entries.end() ? fileSize : last->offset;
+
+        return std::make_pair(begin, end);
+    }
+
+private:
+
+    static const char* Magic() { return "SHIDX001"; }
+
+    static void Write(FILE* file, const void* data, size_t size)
+    {
+        if (size > 0 && fwrite(data, 1u, size, file) != size)
+            throw std::runtime_error("Cannot write index file");
+    }
+
+    template <class T>
+    static void WriteValue(FILE* file, T value)
+    {
+        Write(file, &value, sizeof(value));
+    }
+
+    static void Read(FILE* file, void* data, size_t size)
+    {
+        if (size > 0 && fread(data, 1u, size, file) != size)
+            throw std::runtime_error("Invalid index file");
+    }
+
+    template <class T>
+    static T ReadValue(FILE* file)
+    {
+        T value;
+        Read(file, &value, sizeof(value));
+        return value;
+    }
+};
+
+// Builds index of data written sequentially.
+// Only the data after block boundary is scanned for the next line, so it is cheap.
+class SparseIndexBuilder
+{
+    SparseIndex m_index;
+    uint64_t m_offset = 0; // offset of the next data
+    uint64_t m_searchFrom = 0; // the next entry is the first line starting after this offset
+    bool m_isCapturing = true; // the first line is indexed
+    bool m_isTooLong = false;
+    uint64_t m_lineOffset = 0;
+    std::string m_line;
+
+public:
+    SparseIndexBuilder(const SparseIndexSettings& settings)
+    {
+        m_index.settings = settings;
+    }
+
+    void Add(const char* data, size_t size)
+    {
+        const char* end = data + size;
+        while (data < end)
+        {
+            if (m_isCapturing)
+            {
+                const char* eol = reinterpret_cast<const char*>(memchr(data, '\n', end - data));
+                size_t partSize = (eol ? eol : end) - data;
+
+                if (m_line.size() + partSize <= SparseIndex::MaxLineSize)
+                    m_line.append(data, partSize);
+                else
+                    m_isTooLong = true;
+
+                Skip(&data, partSize);
+                if (eol)
+                {
+                    Skip(&data, 1);
+                    CompleteLine();
+                }
+                continue;
+            }
+
+            if (m_offset < m_searchFrom)
+            {
+                Skip(&data, std::min<uint64_t>(end - data, m_searchFrom - m_offset));
+                continue;
+            }
+
+            const char* eol = reinterpret_cast<const char*>(memchr(data, '\n', end - data));
+            if (eol == nullptr)
+            {
+                Skip(&data, end - data);
+                continue;
+            }
+
+            Skip(&data, eol + 1 - data);
+            StartLine();
+        }
+    }
+
+    // the index is ready when all data is added
+    const SparseIndex& GetIndex()
+    {
+        if (m_isCapturing && !m_line.empty())
+        {
+            // the last line without EOL
+            CompleteLine();
+            m_isCapturing = false;
+        }
+        return m_index;
+    }
+
+private:
+
+    void Skip(const char** data, size_t size)
+    {
+        *data += size;
+        m_offset += size;
+    }
+
+    void StartLine()
+    {
+        m_isCapturing = true;
+        m_isTooLong = false;
+        m_lineOffset = m_offset;
+        m_line.clear();
+    }
+
+    void CompleteLine()
+    {
+        if (m_isTooLong)
+        {
+            // index the next line instead
+            StartLine();
+            return;
+        }
+
+        m_index.entries.push_back(SparseIndex::Entry{m_lineOffset, m_line});
+        m_isCapturing = false;
+
+        // the line starting after this offset is the first line of the next block
+        m_searchFrom = m_lineOffset + m_index.settings.blockSize - 1;
+    }
+};
+
+// Builds index of existing file (e.g. the result which is not written by FileWriter).
+inline void BuildIndex(const std::string& fileName, const SparseIndexSettings& settings)
+{
+    std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(fileName.c_str(), "rb"), &fclose);
+    if (!file)
+        throw std::runtime_error("Cannot open file " + fileName);
+
+    SparseIndexBuilder builder(settings);
+    std::vector<char> buffer(4*1024*1024);
+    while (size_t size = fread(buffer.data(), 1u, buffer.size(), file.get()))
+    {
+        builder.Add(buffer.data(), size);
+    }
+
+    builder.GetIndex().Save(GetIndexFile(fileName));
+}
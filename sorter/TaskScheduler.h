@@ -0,0 +1,230 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+#include <stdint.h>
+
+#include <boost/noncopyable.hpp>
+
+// Tasks which are waited together (e.g. stages of one sort),
+// the first exception of them is rethrown by TaskScheduler::Wait().
+class TaskGroup : boost::noncopyable
+{
+    friend class TaskScheduler;
+
+    std::atomic<size_t> m_pending{0};
+    std::mutex m_mutex;
+    std::exception_ptr m_error;
+
+public:
+    // A task has failed, so tasks waiting for its results shouldn't wait any more.
+    bool HasError()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error != nullptr;
+    }
+};
+
+// Work-stealing executor of small tasks.
+// Every worker has its own queue: tasks submitted by a task go to the queue of its worker and
+// are taken from its back (the newest one, its data is still in cache), idle workers steal
+// from the front of other queues (the oldest ones). Threads which wait for tasks or for a
+// condition (Wait(), WaitUntil()) run queued tasks meanwhile, so a task can wait for another
+// one without deadlock, and the waiting thread is one of threadCount threads doing the work.
+//
+// Stages are connected by bounded resources (e.g. a pool of chunks): a task which needs
+// a resource waits for it by WaitUntil(), running tasks of later stages which free it.
+class TaskScheduler : boost::noncopyable
+{
+public:
+    typedef std::function<void()> Task;
+
+    // threadCount: threads doing the work including the thread which waits for tasks,
+    // 0 means number of cores
+    explicit TaskScheduler(size_t threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+        m_queues.resize(threadCount);
+        for (std::unique_ptr<Queue>& queue : m_queues)
+            queue.reset(new Queue);
+
+        // the last queue is shared by threads which are not workers
+        for (size_t n = 0; n + 1 < threadCount; ++n)
+            m_workers.emplace_back([this, n]() { WorkerLoop(n); });
+    }
+
+    // all tasks must be waited before
+    ~TaskScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_isStopped = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& worker : m_workers)
+            worker.join();
+    }
+
+    size_t GetThreadCount() const { return m_queues.size(); }
+
+    void Submit(TaskGroup& group, Task task)
+    {
+        ++group.m_pending;
+        {
+            Queue& queue = *m_queues[GetQueueIndex()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.items.push_back(Item{std::move(task), &group});
+        }
+        Notify();
+    }
+
+    // Runs tasks until all tasks of the group are done, rethrows the first exception of the group.
+    void Wait(TaskGroup& group)
+    {
+        WaitUntil([&group]() { return group.m_pending == 0; });
+
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(group.m_mutex);
+            std::swap(error, group.m_error);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Runs tasks until predicate is true. The predicate is checked after every task and
+    // every Notify(), so the state it checks must be changed by tasks or followed by Notify().
+    template <class TPredicate>
+    void WaitUntil(TPredicate predicate)
+    {
+        for (;;)
+        {
+            uint64_t epoch = m_epoch;
+            if (predicate())
+                return;
+
+            if (RunNextTask())
+                continue;
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, epoch]() { return m_epoch != epoch; });
+        }
+    }
+
+    // wakes threads waiting in WaitUntil()
+    void Notify()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_epoch;
+        }
+        m_wake.notify_all();
+    }
+
+private:
+
+    struct Item
+    {
+        Task task;
+        TaskGroup* group;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    // index of the queue of the calling thread
+    size_t GetQueueIndex() const
+    {
+        const size_t index = WorkerIndex();
+        return index < m_queues.size() ? index : m_queues.size() - 1;
+    }
+
+    static size_t& WorkerIndex()
+    {
+        static thread_local size_t index = SIZE_MAX;
+        return index;
+    }
+
+    // runs a task of the own queue or a stolen one, returns false if all queues are empty
+    bool RunNextTask()
+    {
+        const size_t own = GetQueueIndex();
+        Item item;
+        bool isFound = false;
+        for (size_t n = 0; n < m_queues.size() && !isFound; ++n)
+        {
+            size_t index = (own + n) % m_queues.size();
+            Queue& queue = *m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.items.empty())
+                continue;
+
+            if (index == own)
+            {
+                item = std::move(queue.items.back());
+                queue.items.pop_back();
+            }
+            else
+            {
+                item = std::move(queue.items.front());
+                queue.items.pop_front();
+            }
+            isFound = true;
+        }
+
+        if (!isFound)
+            return false;
+
+        try
+        {
+            item.task();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(item.group->m_mutex);
+            if (!item.group->m_error)
+                item.group->m_error = std::current_exception();
+        }
+
+        item.task = nullptr; // captured data is released before the task is done
+        --item.group->m_pending;
+        Notify();
+        return true;
+    }
+
+    void WorkerLoop(size_t index)
+    {
+        WorkerIndex() = index;
+        for (;;)
+        {
+            uint64_t epoch = m_epoch;
+            if (RunNextTask())
+                continue;
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, epoch]() { return m_isStopped || m_epoch != epoch; });
+            if (m_isStopped)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::atomic<uint64_t> m_epoch{0}; // changed by every submitted and completed task
+    bool m_isStopped = false;
+};
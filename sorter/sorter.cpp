@@ -5,49 +5,286 @@
 #include "FileRegistry.h"
 #include "InitialSorter.h"
 #include "Merger.h"
+#include "SortChecker.h"
+#include "PartitionMerger.h"
+#include "Coordinator.h"
+#include "FileWriter.h"
+#include "SorterOptions.h"
+#include "KeySpec.h"
+#include "SortPlanner.h"
+#include "Metrics.h"
+#include "TaskScheduler.h"
 
 #include <iostream>
 #include <stdexcept>
 #include <cstdlib>
 #include <vector>
+#include <thread>
+#include <memory>
 
 #include <boost/filesystem.hpp>
 
+const size_t MergeSourceCount = 8;
+const size_t MergeBufferSize = GetSize("32M");
+
+// Parallel merges take the memory of chunk, when initial sorting is done.
+inline size_t GetParallelMerges(size_t chunkSize)
+{
+    return std::max<size_t>(chunkSize / (MergeSourceCount * MergeBufferSize), 1);
+}
+
+// Sorting stages, instantiated for the entry type selected by command line.
+// Stages are tasks of the scheduler: reading and sorting of chunks overlap, merges of a pass run in parallel.
+struct SortJob
+{
+    const SorterOptions& options;
+    FileRegistry& registry;
+
+    template <class TEntry>
+    int Run()
+    {
+        Clock c;
+        c.Start();
+
+#ifdef __linux__
+        if (options.workers > 0)
+        {
+            Coordinator<TEntry> coordinator(options.workers, options.chunkSize,
+                                            std::max(GetSize("32M") / options.workers, GetSize("1M")));
+            coordinator.SetDuplicateMode(options.duplicates);
+            coordinator.Process(registry, options.outputFile);
+            return 0;
+        }
+#endif
+
+        TaskScheduler scheduler;
+
+        InitialSorter<TEntry> sorter(options.chunkSize);
+        sorter.SetScheduler(&scheduler);
+        sorter.SetLimit(options.limit);
+        sorter.SetReaderCount(options.readers > 0 ? options.readers : std::thread::hardware_concurrency());
+        sorter.SetDuplicateMode(options.duplicates);
+        if (options.numa)
+        {
+            NumaTopology topology = options.fakeNumaNodes > 0 ? NumaTopology::Fake(options.fakeNumaNodes)
+                                                             : NumaTopology::Detect();
+            std::cout << "NUMA nodes:" << topology.nodes.size() << std::endl;
+            sorter.EnableNuma(topology);
+        }
+        if (options.partitions > 0)
+            sorter.EnableSampling(256);
+        sorter.Process(registry);
+
+        std::cout << "Merging, totalTime:" << c.ElapsedTime() << "sec" << std::endl;
+
+        Merger<TEntry> merger(MergeSourceCount, MergeBufferSize);
+        merger.SetScheduler(&scheduler, GetParallelMerges(options.chunkSize));
+        // merge sources must be intact until merge is completed, otherwise it cannot be resumed
+        merger.SetReclaimSpace(options.reclaimSpace && !registry.IsCheckpointEnabled());
+        merger.SetLimit(options.limit);
+        merger.SetDuplicateMode(options.duplicates);
+
+        // runs are merged to the base file by the last merge, so it is read only once
+        bool hasBase = !registry.GetBaseFile().empty();
+        if (hasBase)
+        {
+            merger.Process(registry, merger.GetMaxSourceCount() - 1);
+            registry.PushBaseFile();
+        }
+
+        if (options.partitions > 0)
+        {
+            // the rest of runs is merged by partitions in parallel
+            if (!hasBase)
+                merger.Process(registry, merger.GetMaxSourceCount());
+
+            // samples of runs don't cover the base file, all files are sampled then
+            std::vector<RunSample> samples = sorter.TakeSamples();
+            if (hasBase)
+                samples.clear();
+
+            PartitionMerger<TEntry> partitionMerger(GetSize("4M"));
+            partitionMerger.SetDuplicateMode(options.duplicates);
+            partitionMerger.Process(registry, samples, options.outputFile, options.partitions);
+            return 0;
+        }
+
+        merger.Process(registry);
+        return 0;
+    }
+};
+
+// Merges already sorted input files.
+struct MergeJob
+{
+    const SorterOptions& options;
+    FileRegistry& registry;
+
+    template <class TEntry>
+    int Run()
+    {
+        TaskScheduler scheduler;
+        Merger<TEntry> merger(MergeSourceCount, MergeBufferSize);
+        merger.SetScheduler(&scheduler, GetParallelMerges(options.chunkSize));
+        merger.SetLimit(options.limit);
+        merger.SetDuplicateMode(options.duplicates);
+        merger.SetReclaimSpace(options.reclaimSpace);
+        merger.Process(registry);
+        return 0;
+    }
+};
+
+// Checks that input file is sorted, returns 2 if it is not.
+struct CheckJob
+{
+    const SorterOptions& options;
+
+    template <class TEntry>
+    int Run()
+    {
+        SortChecker<TEntry> checker(std::thread::hardware_concurrency(), GetSize("32M"));
+        size_t offset = checker.Check(options.inputFile);
+        if (offset != SortChecker<TEntry>::NotFound)
+        {
+            std::cout << "Not sorted, the first unordered line at offset:" << offset << std::endl;
+            return 2;
+        }
+
+        std::cout << "Sorted" << std::endl;
+        return 0;
+    }
+};
+
 int main(int argc, char** argv)
 {
-    if (argc != 4)
+    SorterOptions options;
+    try
+    {
+        options = ParseOptions(argc, argv);
+    }
+    catch(std::exception& e)
     {
-        std::cerr << "Usage: sorter <input-file> <output-file> <chunk-size>" << std::endl;
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        std::cerr << GetUsage();
         return 1;
     }
 
+    // stdout is used for data, send log messages to stderr
+    if (options.outputFile == "-")
+        std::cout.rdbuf(std::cerr.rdbuf());
+    SetLogStream(&std::cout);
+
     try
     {
+        if (options.mode == SorterMode::Check)
+        {
+            CheckJob job = {options};
+            return DispatchKeySpec(options.keySpec, job);
+        }
+
         Clock c;
         c.Start();
 
-        FileRegistry registry(argv[1]);
+        if (options.perfCounters)
+        {
+            PerfCounters::Enable();
+            std::string error = PerfCounters::GetError();
+            if (!error.empty())
+                std::cout << "Perf counters are unavailable: " << error << std::endl;
+        }
 
-        //InitialSorter<SmallEntry> sorter(GetSize(argv[3]));
-        InitialSorter<FastEntry> sorter(GetSize(argv[3]));
-        //InitialSorter<SimpleEntry> sorter;
-        sorter.Process(registry);
+        std::unique_ptr<ProgressReporter> progress;
+        if (options.progressInterval > 0)
+            progress.reset(new ProgressReporter(GetMetrics(), options.progressInterval, std::cerr));
 
-        std::cout << "Merging, totalTime:" << c.ElapsedTime() << "sec" << std::endl;
+        // inputs of merge are external files,
+        // partitions are written by PartitionMerger, the registry has no result file.
+        // The base file is read by the last merge, so it is replaced by renaming.
+        std::string resultFile = options.outputFile;
+        if (options.partitions > 0)
+            resultFile.clear();
+        else if (options.outputFile == options.baseFile)
+            resultFile += ".new";
 
-        Merger<FastEntry> merger(8, GetSize("32M"));
-        merger.Process(registry);
+        FileRegistry registry(options.mode == SorterMode::Merge ? std::vector<std::string>{options.inputFile} : options.inputFiles,
+                              resultFile);
+        if (!options.baseFile.empty())
+            registry.SetBaseFile(options.baseFile);
+        for (const std::string& dir : options.tmpDirs)
+            registry.AddTmpDir(dir);
+        registry.SetTmpDirPolicy(options.tmpDirPolicy);
+
+        SparseIndexSettings index;
+        index.blockSize = options.indexBlockSize;
+        index.keySpec = FormatKeySpec(options.keySpec);
+        index.isCounted = options.duplicates == DuplicateMode::Count;
+        registry.SetIndexSettings(index);
 
-        std::cout << "Renaming, totalTime:" << c.ElapsedTime() << "sec" << std::endl;
+        if (options.resume)
+            registry.Resume();
+        else if (options.checkpoint)
+            registry.EnableCheckpoint();
+
+        if (options.mode == SorterMode::Merge)
+        {
+            for (const std::string& file : options.inputFiles)
+                registry.AddExternalFile(file);
+
+            MergeJob job = {options, registry};
+            DispatchKeySpec(options.keySpec, job);
+        }
+        else
+        {
+            if (options.planEntry && options.keySpec.IsDefault())
+            {
+                InputProfile profile = SampleInput(options.inputFiles);
+                SortPlan plan = ChooseSortPlan(profile);
+                std::cout << FormatSortPlan(profile, plan) << std::endl;
+                options.keySpec.prefixWords = plan.prefixWords;
+            }
+
+            SortJob job = {options, registry};
+            DispatchKeySpec(options.keySpec, job);
+        }
 
         std::vector<std::string> result = registry.PopFront(100);
-        assert(result.size() == 1);
-        boost::filesystem::rename(result.at(0), argv[2]);
+        assert(result.size() <= 1);
+        if (options.partitions > 0 || options.workers > 0)
+        {
+            // partition files or the result of workers are already written
+        }
+        else if (result.empty())
+        {
+            // empty input file
+            FileWriter file(options.outputFile);
+            file.EnableIndex(index);
+            file.Close();
+        }
+        else if (result.at(0) != options.outputFile)
+        {
+            std::cout << "Renaming, totalTime:" << c.ElapsedTime() << "sec" << std::endl;
+            boost::filesystem::rename(result.at(0), options.outputFile);
+
+            // the index is written with the final merge, but not with runs
+            std::string resultIndex = GetIndexFile(result.at(0));
+            if (index.blockSize > 0 && boost::filesystem::exists(resultIndex))
+                boost::filesystem::rename(resultIndex, GetIndexFile(options.outputFile));
+            else if (index.blockSize > 0)
+                BuildIndex(options.outputFile, index);
+        }
+
+        registry.RemoveCheckpoint();
+        progress.reset();
+
+        FlushCompares();
+        if (!options.metricsFile.empty())
+            GetMetrics().SaveReport(options.metricsFile, c.ElapsedTime());
 
-        std::cout << "Success, totalTime:" << c.ElapsedTime() << "sec"
-                  << ", totalCmpCount:" << totalCmpCount << ""
-                  << ", memCmpCount:" << memCmpCount << ""
-                  << std::endl;
+        std::cout << "Success, totalTime:" << c.ElapsedTime() << "sec";
+#ifdef SHANGHAI_COUNT_COMPARES
+        std::cout << ", compares:" << GetMetrics().GetCompares();
+#endif
+        std::cout << std::endl;
     }
     catch(std::exception& e)
     {
@@ -2,9 +2,24 @@
 
 #include <boost/test/unit_test.hpp>
 #include <fstream>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "sorter/FileReader.h"
+#include "sorter/FileWriter.h"
 #include "sorter/SortingEntry.h"
+#include "sorter/ExternalSorter.h"
+#include "sorter/FileRegistry.h"
+#include "sorter/KeySpec.h"
+#include "sorter/SortChecker.h"
+#include "sorter/PartitionMerger.h"
+#include "sorter/SparseIndex.h"
+#include "sorter/Coordinator.h"
+#include "sorter/TaskScheduler.h"
+#include "sorter/SortPlanner.h"
+#include "generator/DataGenerator.h"
+#include "lookup/Lookup.h"
 
 inline std::string ToStr(const FileReader::Buffer& b)
 {
@@ -178,6 +193,78 @@ BOOST_AUTO_TEST_CASE(TestFileReaderSimpleReadChunksNoLastEol)
     BOOST_CHECK(!reader.LoadNextChunk(chunk));
 }
 
+BOOST_AUTO_TEST_CASE(TestFileReaderEof)
+{
+    std::ofstream file(filename);
+    file << "ABC\n";
+    file << "DEF";
+    file.close();
+
+    // buffer size is equal to file size, so fread() doesn't reach EOF
+    FileReader reader(filename, "\n");
+    auto chunk = std::make_shared<std::vector<char>>(7);
+    BOOST_CHECK(reader.LoadNextChunk(chunk));
+    BOOST_CHECK(!reader.IsEof());
+
+    FileReader::Buffer b;
+    BOOST_CHECK(reader.TryGetLine(&b));
+    BOOST_CHECK_EQUAL("ABC", ToStr(b));
+    BOOST_CHECK(reader.TryGetLine(&b));
+    BOOST_CHECK_EQUAL("DEF", ToStr(b));
+    BOOST_CHECK(reader.IsEof());
+}
+
+BOOST_AUTO_TEST_CASE(TestFileWriter)
+{
+    {
+        FileWriter writer(filename, 1024);
+        writer.write("AAA\n", 4);
+        writer.write("BBB\n", 4);
+        writer.write("DDD\n", 4);
+        BOOST_CHECK_EQUAL(12, writer.GetBytesWritten());
+        writer.Close();
+    }
+
+    // preallocation doesn't change the file size
+    FileReader reader(filename, "\n");
+    BOOST_CHECK_EQUAL(12, reader.GetFileSize());
+
+    auto chunk = std::make_shared<std::vector<char>>(500);
+    Expect_AAA_BBB_DDD(reader, chunk);
+}
+
+BOOST_AUTO_TEST_CASE(TestFileReaderReclaimSpace)
+{
+    const std::string line(99, 'A');
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 1000; ++n)
+            file << line << "\n";
+    }
+
+    FileReader reader(filename, "\n");
+    bool isSupported = reader.EnableSpaceReclaim(filename);
+
+    size_t count = 0;
+    auto chunk = std::make_shared<std::vector<char>>(10000);
+    while (reader.LoadNextChunk(chunk))
+    {
+        FileReader::Buffer b;
+        while (reader.TryGetLine(&b))
+        {
+            BOOST_CHECK_EQUAL(line, ToStr(b));
+            ++count;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(1000, count);
+    if (isSupported)
+    {
+        // all data except the last partial block is consumed
+        BOOST_CHECK_EQUAL(100000 / 4096 * 4096, reader.GetReclaimedBytes());
+    }
+}
+
 BOOST_AUTO_TEST_CASE(TestGetPrefix)
 {
     BOOST_CHECK(GetPrefix("ABC", 3) < GetPrefix("BCA", 3));
@@ -194,6 +281,10 @@ BOOST_AUTO_TEST_CASE(TestGetPrefix)
     BOOST_CHECK(GetPrefix("ABCDEFGH", 8) < GetPrefix("ABCDEFZH", 8));
     BOOST_CHECK(GetPrefix("ABCDEFGH", 8) < GetPrefix("ABCDEFHZ", 8));
 
+    // bytes are unsigned, like in memcmp
+    BOOST_CHECK(GetPrefix("z", 1) < GetPrefix("\xc3\xa9", 2));
+    BOOST_CHECK(GetPrefix("ABCDEFG\x7f", 8) < GetPrefix("ABCDEFG\x80", 8));
+
 }
 
 template<typename TEntry>
@@ -283,6 +374,9 @@ void TestEntryCmp()
     // ignore trash after ending
     EXPECT_LESS1("123. AAAAAZTRASH", "124. AAAAATRASH", 10, 10);
     EXPECT_EQUAL1("124. AAAAAAAAABCDEFGZTRASH", "124. AAAAAAAAABCDEFGTRASH", 20, 20);
+    // Cmp diff by len, the shorter string fills the whole prefix
+    EXPECT_LESS("124. AAAAAAAAAAAAAAA", "1. AAAAAAAAAAAAAAAB");
+
     // cmp by number
     EXPECT_LESS("5. AAAAAAAAAA", "124. AAAAAAAAAA");
 }
@@ -293,5 +387,1402 @@ BOOST_AUTO_TEST_CASE(TestFastEntryCmp)
     TestEntryCmp<SimpleEntry>();
     TestEntryCmp<SmallEntry>();
     TestEntryCmp<FastEntry>();
+    TestEntryCmp<PrefixEntry<1>>();
+    TestEntryCmp<PrefixEntry<3>>();
+    TestEntryCmp<PrefixEntry<4>>();
+    TestEntryCmp<KeyEntry<KeyOrder<SortKey::String, false, SortKey::Number, false>>>();
+}
+
+BOOST_AUTO_TEST_CASE(TestPrefixEntryCmp)
+{
+    // strings differ in the 3rd and the 4th word of prefix
+    {
+        typedef PrefixEntry<3> TEntry;
+        EXPECT_LESS("1. AAAAAAAAAAAAAAAAAAAB", "1. AAAAAAAAAAAAAAAAAAAC");
+        EXPECT_LESS("1. AAAAAAAAAAAAAAAAAAA", "1. AAAAAAAAAAAAAAAAAAAA");
+        EXPECT_LESS("1. AAAAAAAAAAAAAAAAAAAAAAAAAAAB", "1. AAAAAAAAAAAAAAAAAAAAAAAAAAAC");
+        EXPECT_EQUAL("1. AAAAAAAAAAAAAAAAAAAB", "1. AAAAAAAAAAAAAAAAAAAB");
+    }
+    {
+        typedef PrefixEntry<4> TEntry;
+        EXPECT_LESS("1. AAAAAAAAAAAAAAAAAAAAAAAAAAAB", "1. AAAAAAAAAAAAAAAAAAAAAAAAAAAC");
+        EXPECT_LESS("2. AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", "1. AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAB");
+        EXPECT_EQUAL("1. AAAAAAAAAAAAAAAAAAAAAAAAAAAB", "1. AAAAAAAAAAAAAAAAAAAAAAAAAAAB");
+    }
+
+    std::tuple<uint64_t, uint64_t, uint64_t> tuple;
+    GetPrefixTuple("abcdefgh12345678ABCDEFGH", 24, &tuple);
+    BOOST_CHECK_EQUAL(GetPrefix("ABCDEFGH", 8), std::get<2>(tuple));
+}
+
+BOOST_AUTO_TEST_CASE(TestKeyEntryCmp)
+{
+    {
+        typedef KeyEntry<KeyOrder<SortKey::String, true, SortKey::Number, false>> TEntry;
+        EXPECT_LESS("124. ZBCDEFA", "124. ABCDEFG");
+        EXPECT_LESS("124. AA", "124. A");
+        EXPECT_LESS("124. AAAAAAAAAAAAAAAAAAB", "124. AAAAAAAAAAAAAAAAAAA");
+        EXPECT_LESS("124. AAAAAAAAAAAAAAAAAAAA", "124. AAAAAAAAAAAAAAAAAAA");
+        EXPECT_LESS("5. AA", "124. AA");
+    }
+    {
+        typedef KeyEntry<KeyOrder<SortKey::String, false, SortKey::Number, true>> TEntry;
+        EXPECT_LESS("124. AA", "5. AA");
+        EXPECT_LESS("1. AA", "124. AB");
+    }
+    {
+        typedef KeyEntry<KeyOrder<SortKey::Number, false, SortKey::String, false>> TEntry;
+        EXPECT_LESS("5. ZZ", "124. AA");
+        EXPECT_LESS("5. AA", "5. AB");
+        EXPECT_LESS("5. AAAAAAAAAAAA", "5. AAAAAAAAAAAAB");
+        EXPECT_LESS("5. AAAAAAAAAAAAAAAA", "5. AAAAAAAAAAAAAAAB");
+        EXPECT_EQUAL("5. AAAAAAAAAAAAAAAA", "5. AAAAAAAAAAAAAAAA");
+    }
+    {
+        typedef KeyEntry<KeyOrder<SortKey::Number, true, SortKey::String, true>> TEntry;
+        EXPECT_LESS("124. AA", "5. ZZ");
+        EXPECT_LESS("5. AB", "5. AA");
+        EXPECT_LESS("5. AAAAAAAAAAAAAAAB", "5. AAAAAAAAAAAAAAAA");
+    }
+    {
+        // stable, numbers are ignored
+        typedef KeyEntry<KeyOrder<SortKey::String, false, SortKey::None, false>> TEntry;
+        BOOST_CHECK(TEntry::IsStable);
+        EXPECT_EQUAL("5. AA", "124. AA");
+        EXPECT_LESS("124. AA", "5. AB");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestCollatedEntryCmp)
+{
+    typedef CollatedEntry<Collation::IgnoreCase | Collation::IgnoreAccents> TEntry;
+
+    std::vector<std::string> lines = {"3. b", "2. A", "1. \xc3\x89" "clair", "4. eclairs", "5. \xd0\x96\xd0\xb0\xd0\xb1\xd0\xb0",
+                                      "6. \xd0\xb6\xd0\xb0\xd0\xb1\xd0\xb0", "7. STRASSE", "7. Stra\xc3\x9f" "e",
+                                      "8. AAAAAAAAAAAAAAAAAAAB", "9. aaaaaaaaaaaaaaaaaaaa"};
+    std::vector<std::string> expected = {"2. A", "9. aaaaaaaaaaaaaaaaaaaa", "8. AAAAAAAAAAAAAAAAAAAB", "3. b",
+                                         "1. \xc3\x89" "clair", "4. eclairs", "7. STRASSE", "7. Stra\xc3\x9f" "e",
+                                         "5. \xd0\x96\xd0\xb0\xd0\xb1\xd0\xb0", "6. \xd0\xb6\xd0\xb0\xd0\xb1\xd0\xb0"};
+
+    // keys in arena and built on the fly give the same order
+    for (bool useArena : {true, false})
+    {
+        CollationKeys keys;
+        CollationKeys::Scope scope(useArena ? &keys : nullptr);
+
+        std::vector<TEntry> entries;
+        for (const std::string& line : lines)
+            entries.emplace_back(line.data(), line.size());
+        std::stable_sort(entries.begin(), entries.end());
+
+        std::vector<std::string> result;
+        for (const TEntry& entry : entries)
+            result.emplace_back(entry.GetLinePtr(), entry.GetLineSize());
+        BOOST_CHECK(result == expected);
+    }
+
+    EXPECT_EQUAL("1. \xc3\xa9", "1. E");
+    {
+        // entries of other rules have own collation
+        typedef CollatedEntry<Collation::IgnorePunct> TEntry;
+        EXPECT_EQUAL("1. a-b.c", "1. abc");
+        EXPECT_LESS("1. A", "1. a");
+    }
+    EXPECT_EQUAL("1. A", "1. a");
+}
+
+BOOST_AUTO_TEST_CASE(TestParseKeySpec)
+{
+    BOOST_CHECK(ParseKeySpec("string,number").IsDefault());
+    BOOST_CHECK(ParseKeySpec("string:asc,number:asc").IsDefault());
+
+    KeySpec spec = ParseKeySpec("number:desc,string");
+    BOOST_CHECK(spec.first == SortKey::Number);
+    BOOST_CHECK(spec.firstDesc);
+    BOOST_CHECK(spec.second == SortKey::String);
+    BOOST_CHECK(!spec.secondDesc);
+
+    spec = ParseKeySpec("string");
+    BOOST_CHECK(spec.first == SortKey::String);
+    BOOST_CHECK(spec.second == SortKey::None);
+
+    BOOST_CHECK_THROW(ParseKeySpec(""), std::logic_error);
+    BOOST_CHECK_THROW(ParseKeySpec("string,string"), std::logic_error);
+    BOOST_CHECK_THROW(ParseKeySpec("string:up"), std::logic_error);
+    BOOST_CHECK_THROW(ParseKeySpec("line"), std::logic_error);
+    BOOST_CHECK_THROW(ParseKeySpec("string,number,string"), std::logic_error);
+
+    spec = ParseKeySpec("string,number;icase,nopunct");
+    BOOST_CHECK(spec.IsDefaultOrder() && !spec.IsDefault());
+    BOOST_CHECK_EQUAL(Collation::IgnoreCase | Collation::IgnorePunct, spec.collation);
+    BOOST_CHECK_EQUAL("string,number;icase,nopunct", FormatKeySpec(spec));
+    BOOST_CHECK_THROW(ParseKeySpec("string,number;upper"), std::logic_error);
+    BOOST_CHECK_THROW(ParseKeySpec("number,string;icase"), std::logic_error);
+}
+
+
+static std::vector<std::string> PullAll(ExternalSorter<FastEntry>& sorter)
+{
+    std::vector<std::string> result;
+    sorter.ForEach([&result](const char* data, size_t size) { result.emplace_back(data, size); });
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(TestExternalSorterInMemory)
+{
+    ExternalSorter<FastEntry> sorter("test", 1024);
+    sorter.Push("2. BBB", 6);
+    sorter.PushBatch("3. AAA\n1. BBB\n4. CCC", 20);
+    sorter.Finish();
+
+    std::vector<std::string> expected = {"3. AAA", "1. BBB", "2. BBB", "4. CCC"};
+    BOOST_CHECK(PullAll(sorter) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(TestExternalSorterSpill)
+{
+    // chunk fits 2 records, so 5 runs are merged with 2 merge sources
+    ExternalSorter<FastEntry> sorter("test", 12, 2, 64);
+
+    std::vector<std::string> expected;
+    for (int n = 9; n >= 0; --n)
+    {
+        std::string line = std::to_string(n) + ". " + char('A' + n % 5);
+        sorter.Push(line.data(), line.size());
+        expected.push_back(line);
+    }
+    sorter.Finish();
+
+    std::sort(expected.begin(), expected.end(), [](const std::string& a, const std::string& b)
+    {
+        return FastEntry(a.data(), a.size()) < FastEntry(b.data(), b.size());
+    });
+    BOOST_CHECK(PullAll(sorter) == expected);
+
+    // record bigger than chunk
+    ExternalSorter<FastEntry> sorter2("test", 12);
+    sorter2.Push("2. B", 4);
+    sorter2.Push("1. TOO LONG RECORD", 18);
+    sorter2.Push("3. A", 4);
+    sorter2.Finish();
+    expected = {"3. A", "2. B", "1. TOO LONG RECORD"};
+    BOOST_CHECK(PullAll(sorter2) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(TestFileRegistryTmpDirs)
+{
+    FileRegistry noDirs("data/input.txt");
+    BOOST_CHECK_EQUAL("data/input.txt.1", noDirs.GetNext());
+    BOOST_CHECK_EQUAL("data/input.txt.m.2", noDirs.GetNext("m"));
+
+    boost::filesystem::create_directory("tmp1");
+    boost::filesystem::create_directory("tmp2");
+
+    FileRegistry registry("data/input.txt");
+    registry.AddTmpDir("tmp1");
+    registry.AddTmpDir("tmp2");
+
+    // round robin
+    BOOST_CHECK_EQUAL("tmp1/input.txt.1", registry.GetNext());
+    BOOST_CHECK_EQUAL("tmp2/input.txt.2", registry.GetNext());
+    BOOST_CHECK_EQUAL("tmp1/input.txt.m.3", registry.GetNext("m"));
+    BOOST_CHECK_EQUAL(3, registry.Count());
+
+    // names of tmp files which are not added to registry
+    BOOST_CHECK_EQUAL("tmp2/input.txt.w.4", registry.MakeTmpFileName("w"));
+    BOOST_CHECK_EQUAL(3, registry.Count());
+
+    BOOST_CHECK_THROW(registry.AddTmpDir("InvalidDir"), std::exception);
+}
+
+static FileInfo WriteTestFile(const std::string& fileName, const std::string& data)
+{
+    FileWriter writer(fileName);
+    writer.EnableChecksum();
+    writer.write(data.data(), data.size());
+    writer.Close();
+    return writer.GetInfo();
+}
+
+BOOST_AUTO_TEST_CASE(TestFileRegistryCheckpoint)
+{
+    WriteTestFile(filename, "1. B\n2. A\n3. C\n");
+
+    {
+        FileRegistry registry(filename, "result.txt");
+        registry.EnableCheckpoint();
+
+        std::string run1 = registry.GetNext();
+        registry.CommitRun(run1, WriteTestFile(run1, "2. A\n1. B\n"), 10);
+        std::string run2 = registry.GetNext();
+        WriteTestFile(run2, "3. C\n"); // crash before commit
+    }
+
+    {
+        FileRegistry registry(filename, "result.txt");
+        BOOST_CHECK(registry.Resume());
+        BOOST_CHECK_EQUAL(10, registry.GetInputOffset());
+        BOOST_CHECK_EQUAL(1, registry.Count());
+
+        std::string run2 = registry.GetNext();
+        BOOST_CHECK_EQUAL(std::string(filename) + ".2", run2);
+        registry.CommitRun(run2, WriteTestFile(run2, "3. C\n"), 15);
+
+        std::vector<std::string> files = registry.PopFront(2);
+        std::string result = registry.GetResult();
+        registry.CommitMerge(files, result, WriteTestFile(result, "2. A\n1. B\n3. C\n"));
+        BOOST_CHECK_EQUAL(1, registry.GetMergeCount());
+    }
+
+    {
+        FileRegistry registry(filename, "result.txt");
+        BOOST_CHECK(registry.Resume());
+        BOOST_CHECK_EQUAL(1, registry.Count());
+        BOOST_CHECK_EQUAL("result.txt", registry.PopFront(1).at(0));
+        registry.RemoveCheckpoint();
+    }
+
+    {
+        FileRegistry registry(filename, "result.txt");
+        BOOST_CHECK(!registry.Resume());
+        std::string result = registry.GetResult();
+        registry.CommitRun(result, WriteTestFile(result, "1. B\n"), 15);
+    }
+
+    // corrupted file
+    WriteTestFile("result.txt", "1. X\n");
+    FileRegistry registry(filename, "result.txt");
+    BOOST_CHECK_THROW(registry.Resume(), std::exception);
+    registry.RemoveCheckpoint();
+}
+
+BOOST_AUTO_TEST_CASE(TestExternalSorterStable)
+{
+    typedef KeyEntry<KeyOrder<SortKey::String, false, SortKey::None, false>> TEntry;
+
+    // 2 records per run, 3 merge sources: several merge passes
+    ExternalSorter<TEntry> sorter("test", 12, 3, 64);
+
+    std::vector<std::string> expected[2];
+    for (int n = 0; n < 23; ++n)
+    {
+        std::string line = std::to_string(n % 10) + ". " + char('A' + n % 2);
+        sorter.Push(line.data(), line.size());
+        expected[n % 2].push_back(line);
+    }
+    sorter.Finish();
+
+    expected[0].insert(expected[0].end(), expected[1].begin(), expected[1].end());
+
+    std::vector<std::string> result;
+    sorter.ForEach([&result](const char* data, size_t size) { result.emplace_back(data, size); });
+    BOOST_CHECK(result == expected[0]);
+}
+
+static std::vector<std::string> ReadLines(const std::string& fileName)
+{
+    std::vector<std::string> result;
+    std::ifstream file(fileName.c_str());
+    std::string line;
+    while (std::getline(file, line))
+        result.push_back(line);
+    return result;
 }
 
+// sorts "test.txt" to "result.txt" with given options
+template <class TEntry>
+static void SortTestFile(size_t chunkSize, size_t limit, DuplicateMode duplicates = DuplicateMode::Keep)
+{
+    FileRegistry registry(filename, "result.txt");
+
+    InitialSorter<TEntry> sorter(chunkSize);
+    sorter.SetLimit(limit);
+    sorter.SetDuplicateMode(duplicates);
+    sorter.Process(registry);
+
+    Merger<TEntry> merger(2, 64);
+    merger.SetLimit(limit);
+    merger.SetDuplicateMode(duplicates);
+    merger.Process(registry);
+
+    BOOST_CHECK_EQUAL(1, registry.Count());
+}
+
+BOOST_AUTO_TEST_CASE(TestSortLimit)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 100; ++n)
+            file << n << ". " << char('A' + (n * 7) % 26) << "\n";
+    }
+
+    // carried in chunk
+    SortTestFile<FastEntry>(100, 3);
+    std::vector<std::string> expected = {"0. A", "26. A", "52. A"};
+    BOOST_CHECK(ReadLines("result.txt") == expected);
+
+    // too big to carry, tmp files are merged
+    SortTestFile<FastEntry>(100, 10);
+    std::vector<std::string> result = ReadLines("result.txt");
+    BOOST_CHECK_EQUAL(10, result.size());
+    BOOST_CHECK_EQUAL("78. A", result[3]);
+    BOOST_CHECK_EQUAL("15. B", result[4]);
+
+    // the first chunk contains the whole file
+    SortTestFile<FastEntry>(1000, 2);
+    BOOST_CHECK_EQUAL(2, ReadLines("result.txt").size());
+
+    // carried lines don't overwrite the beginning of the next line, which takes more than a half of chunk
+    std::mt19937 random(7);
+    for (int n = 0; n < 200; ++n)
+    {
+        std::vector<std::string> lines;
+        {
+            std::ofstream file(filename);
+            for (int k = 0; k < 20; ++k)
+            {
+                size_t size = random() % 4 == 0 ? 40 + random() % 120 : 1 + random() % 4;
+                std::string line = std::to_string(random() % 100) + ". " + std::string(size, char('A' + random() % 26));
+                file << line << "\n";
+                lines.push_back(line);
+            }
+        }
+        std::sort(lines.begin(), lines.end(), [](const std::string& a, const std::string& b)
+        {
+            return FastEntry(a.data(), a.size()) < FastEntry(b.data(), b.size());
+        });
+        lines.resize(3);
+
+        SortTestFile<FastEntry>(100, 3);
+        BOOST_CHECK(ReadLines("result.txt") == lines);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestSortDuplicates)
+{
+    {
+        // "1. A" x 25, "2. B" x 25, ... in different chunks
+        std::ofstream file(filename);
+        for (int n = 0; n < 100; ++n)
+            file << n % 4 + 1 << ". " << char('A' + n % 4) << "\n";
+        file << "01. A\n";
+    }
+
+    std::vector<std::string> expected = {"01. A", "1. A", "2. B", "3. C", "4. D"};
+    std::vector<std::string> counted = {"1\t01. A", "25\t1. A", "25\t2. B", "25\t3. C", "25\t4. D"};
+
+    for (size_t chunkSize : {20, 1000})
+    {
+        SortTestFile<FastEntry>(chunkSize, 0, DuplicateMode::Remove);
+        BOOST_CHECK(ReadLines("result.txt") == expected);
+
+        SortTestFile<FastEntry>(chunkSize, 0, DuplicateMode::Count);
+        BOOST_CHECK(ReadLines("result.txt") == counted);
+
+        SortTestFile<FastEntry>(chunkSize, 3, DuplicateMode::Count);
+        BOOST_CHECK(ReadLines("result.txt") == std::vector<std::string>(counted.begin(), counted.begin() + 3));
+    }
+}
+
+// Replaces stdin or stdout of the process while it is alive:
+// stdout is written to the file, stdin is a pipe with the data (it fits the pipe buffer).
+class StdStreamRedirect
+{
+    FILE* m_stream;
+    int m_saved;
+public:
+    StdStreamRedirect(FILE* stream, const std::string& fileOrData) : m_stream(stream)
+    {
+        fflush(stream);
+        m_saved = dup(fileno(stream));
+        int fd = -1;
+        if (stream == stdin)
+        {
+            int fds[2];
+            BOOST_REQUIRE(pipe(fds) == 0);
+            BOOST_REQUIRE(write(fds[1], fileOrData.data(), fileOrData.size()) == static_cast<ssize_t>(fileOrData.size()));
+            close(fds[1]);
+            fd = fds[0];
+        }
+        else
+        {
+            fd = open(fileOrData.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        dup2(fd, fileno(stream));
+        close(fd);
+    }
+
+    ~StdStreamRedirect()
+    {
+        fflush(m_stream);
+        dup2(m_saved, fileno(m_stream));
+        close(m_saved);
+        clearerr(m_stream);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(TestSortStdStreams)
+{
+    {
+        std::ofstream output(filename);
+        for (int n = 0; n < 100; ++n)
+            output << (n * 7) % 100 << ". " << char('A' + n % 26) << "\n";
+    }
+    std::ifstream file(filename, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    const size_t size = data.size();
+    SortTestFile<FastEntry>(size * 10, 0);
+    const std::vector<std::string> expected = ReadLines("result.txt");
+
+    // the end of stdin is unknown when a chunk is filled exactly,
+    // so input of a single chunk can be a run, it is copied to stdout
+    for (size_t chunkSize : {size / 3, size, size + 1, 2 * size, 10 * size})
+    {
+        size_t resultCount = 0;
+        {
+            StdStreamRedirect input(stdin, data);
+            StdStreamRedirect output(stdout, "stdout.txt");
+            std::streambuf* log = std::cout.rdbuf(std::cerr.rdbuf()); // stdout is used for data
+
+            FileRegistry registry("-", "-");
+            InitialSorter<FastEntry> sorter(chunkSize);
+            sorter.SetReaderCount(1);
+            sorter.Process(registry);
+
+            Merger<FastEntry> merger(2, 64);
+            merger.Process(registry);
+            resultCount = registry.Count();
+            std::cout.rdbuf(log);
+        }
+        BOOST_CHECK_EQUAL(1, resultCount);
+        BOOST_CHECK(ReadLines("stdout.txt") == expected);
+        BOOST_CHECK(!boost::filesystem::exists("-"));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestMergeExternalFiles)
+{
+    {
+        std::ofstream("merge1.txt") << "1. A\n3. B\n";
+        std::ofstream("merge2.txt") << "2. A\n1. C";
+        std::ofstream("merge3.txt") << "1. B\n";
+    }
+
+    FileRegistry registry("merge1.txt", "result.txt");
+    for (const char* file : {"merge1.txt", "merge2.txt", "merge3.txt"})
+        registry.AddExternalFile(file);
+
+    Merger<FastEntry> merger(2, 64);
+    merger.Process(registry);
+
+    std::vector<std::string> expected = {"1. A", "2. A", "1. B", "3. B", "1. C"};
+    BOOST_CHECK(ReadLines("result.txt") == expected);
+
+    // inputs are intact
+    BOOST_CHECK_EQUAL(2, ReadLines("merge1.txt").size());
+    BOOST_CHECK_EQUAL(2, ReadLines("merge2.txt").size());
+
+    // the only file is not the result, it is copied
+    FileRegistry single("merge3.txt", "result.txt");
+    single.AddExternalFile("merge3.txt");
+    merger.Process(single);
+    BOOST_CHECK(ReadLines("result.txt") == std::vector<std::string>{"1. B"});
+    BOOST_CHECK(ReadLines("merge3.txt") == std::vector<std::string>{"1. B"});
+
+    // files sorted by a single key with --unique, lines of equal keys are sorted, equal lines of files are collapsed
+    {
+        std::ofstream("merge1.txt") << "1. A\n2. A\n1. B\n";
+        std::ofstream("merge2.txt") << "1. A\n2. A\n3. A\n1. B\n2. B\n";
+    }
+    typedef KeyEntry<KeyOrder<SortKey::String, false, SortKey::None, false>> TKeyEntry;
+    for (DuplicateMode mode : {DuplicateMode::Remove, DuplicateMode::Count})
+    {
+        FileRegistry keyRegistry("merge1.txt", "result.txt");
+        keyRegistry.AddExternalFile("merge1.txt");
+        keyRegistry.AddExternalFile("merge2.txt");
+        Merger<TKeyEntry> keyMerger(2, 64);
+        keyMerger.SetDuplicateMode(mode);
+        keyMerger.Process(keyRegistry);
+        if (mode == DuplicateMode::Remove)
+            expected = {"1. A", "2. A", "3. A", "1. B", "2. B"};
+        else
+            expected = {"2\t1. A", "2\t2. A", "1\t3. A", "2\t1. B", "1\t2. B"};
+        BOOST_CHECK(ReadLines("result.txt") == expected);
+    }
+
+    // the limit counts unique lines
+    FileRegistry limitRegistry("merge1.txt", "result.txt");
+    limitRegistry.AddExternalFile("merge1.txt");
+    limitRegistry.AddExternalFile("merge2.txt");
+    Merger<TKeyEntry> limitMerger(2, 64);
+    limitMerger.SetDuplicateMode(DuplicateMode::Remove);
+    limitMerger.SetLimit(2);
+    limitMerger.Process(limitRegistry);
+    BOOST_CHECK(ReadLines("result.txt") == (std::vector<std::string>{"1. A", "2. A"}));
+
+    // the input order of equal keys (sorted without --unique) would need all lines of a key in memory
+    std::ofstream("merge1.txt") << "2. A\n1. A\n1. B\n";
+    FileRegistry unsortedRegistry("merge1.txt", "result.txt");
+    unsortedRegistry.AddExternalFile("merge1.txt");
+    unsortedRegistry.AddExternalFile("merge2.txt");
+    Merger<TKeyEntry> unsortedMerger(2, 64);
+    unsortedMerger.SetDuplicateMode(DuplicateMode::Remove);
+    BOOST_CHECK_THROW(unsortedMerger.Process(unsortedRegistry), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(TestOffsetValueCode)
+{
+    // codes relative to "ab": longer shared prefix goes first, then the value of the first different byte
+    uint64_t base = OffsetValueCode::Make("ab", 2, "ab", 2);
+    uint64_t abc = OffsetValueCode::Make("abc", 3, "ab", 2);
+    uint64_t abd = OffsetValueCode::Make("abd", 3, "ab", 2);
+    uint64_t b = OffsetValueCode::Make("b", 1, "ab", 2);
+    BOOST_CHECK(base < abc);
+    BOOST_CHECK(abc < abd);
+    BOOST_CHECK(abd < b);
+    BOOST_CHECK(b < OffsetValueCode::Max);
+
+    // equal codes are resolved by bytes after the offset, the greater key gets the code relative to the smaller one
+    uint64_t code = 0;
+    BOOST_CHECK(OffsetValueCode::Compare(abc, "abcdef", 6, "abcxyz", 6, &code) < 0);
+    BOOST_CHECK_EQUAL(OffsetValueCode::Make("abcxyz", 6, "abcdef", 6), code);
+    BOOST_CHECK(OffsetValueCode::Compare(abc, "abcdefghijk", 11, "abcdefghij", 10, &code) > 0);
+    BOOST_CHECK_EQUAL(OffsetValueCode::Make("abcdefghijk", 11, "abcdefghij", 10), code);
+    BOOST_CHECK_EQUAL(0, OffsetValueCode::Compare(abc, "abc", 3, "abc", 3, &code));
+    BOOST_CHECK_EQUAL(OffsetValueCode::Make("abc", 3, "abc", 3), code);
+}
+
+BOOST_AUTO_TEST_CASE(TestMergeManySources)
+{
+    // runs share long prefixes, buffers of merge are reloaded between lines of a run
+    std::mt19937 random(3);
+    std::vector<std::string> lines;
+    std::vector<std::string> files;
+    for (size_t n = 0; n < 7; ++n)
+    {
+        std::vector<SmallEntry> entries;
+        std::vector<std::string> run;
+        for (size_t line = 0; line < 50; ++line)
+        {
+            std::string prefix(random() % 20, 'a');
+            run.push_back(std::to_string(random() % 3) + ". " + prefix + static_cast<char>('a' + random() % 3));
+        }
+        for (const std::string& line : run)
+            entries.emplace_back(line.data(), line.size());
+        std::sort(entries.begin(), entries.end());
+
+        files.push_back("merge" + std::to_string(n) + ".txt");
+        std::ofstream file(files.back());
+        for (const SmallEntry& entry : entries)
+        {
+            lines.emplace_back(entry.GetLinePtr(), entry.GetLineSize());
+            file << lines.back() << "\n";
+        }
+    }
+
+    auto less = [](const std::string& line, const std::string& other)
+    {
+        return SmallEntry(line.data(), line.size()) < SmallEntry(other.data(), other.size());
+    };
+    std::stable_sort(lines.begin(), lines.end(), less);
+
+    FileRegistry registry(files[0], "result.txt");
+    for (const std::string& file : files)
+        registry.AddExternalFile(file);
+    Merger<FastEntry> merger(files.size(), 64);
+    merger.Process(registry);
+    BOOST_CHECK(ReadLines("result.txt") == lines);
+
+    // the same with entries which are compared without codes
+    FileRegistry keyRegistry(files[0], "result.txt");
+    for (const std::string& file : files)
+        keyRegistry.AddExternalFile(file);
+    Merger<KeyEntry<KeyOrder<SortKey::String, false, SortKey::Number, false>>> keyMerger(files.size(), 64);
+    keyMerger.Process(keyRegistry);
+    BOOST_CHECK(ReadLines("result.txt") == lines);
+}
+
+BOOST_AUTO_TEST_CASE(TestSortBaseFile)
+{
+    {
+        std::ofstream("base.txt") << "2\t1. A\n1\t1. C\n";
+        std::ofstream file(filename);
+        for (int n = 0; n < 20; ++n)
+            file << "1. " << char('A' + n % 4) << "\n";
+    }
+
+    // base file is merged once by the last merge, runs of input are merged before
+    for (size_t chunkSize : {10, 1000})
+    {
+        FileRegistry registry(filename, "result.txt");
+        registry.SetBaseFile("base.txt");
+
+        InitialSorter<FastEntry> sorter(chunkSize);
+        sorter.SetDuplicateMode(DuplicateMode::Count);
+        sorter.Process(registry);
+        BOOST_CHECK(registry.Count() > 0);
+
+        Merger<FastEntry> merger(3, 64);
+        merger.SetDuplicateMode(DuplicateMode::Count);
+        merger.Process(registry, merger.GetMaxSourceCount() - 1);
+        registry.PushBaseFile();
+        BOOST_CHECK(registry.Count() <= merger.GetMaxSourceCount());
+        merger.Process(registry);
+
+        std::vector<std::string> expected = {"7\t1. A", "5\t1. B", "6\t1. C", "5\t1. D"};
+        BOOST_CHECK(ReadLines("result.txt") == expected);
+        BOOST_CHECK_EQUAL(2, ReadLines("base.txt").size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestSortLongLines)
+{
+    // lines bigger than chunk and read buffers, sizes above 0xffff don't fit the size field of entry
+    const std::string a(200000, 'a');
+    const std::string b(0x10000, 'b');
+    {
+        std::ofstream file(filename);
+        file << "5. c\n2. " << a << "\n70000. " << b << "\n1. " << a << "\n3. a\n";
+    }
+
+    // lines are read in parts and returned whole
+    FileReader reader(filename, "\n");
+    auto chunk = std::make_shared<std::vector<char>>(32);
+    FileReader::Buffer line;
+    std::vector<std::string> lines;
+    while (reader.LoadNextChunk(chunk))
+    {
+        while (reader.TryGetLine(&line))
+        {
+            BOOST_CHECK_EQUAL(line.size > chunk->size(), reader.IsLongLine(line));
+            lines.push_back(ToStr(line));
+        }
+    }
+    std::vector<std::string> expected = {"5. c", "2. " + a, "70000. " + b, "1. " + a, "3. a"};
+    BOOST_CHECK(lines == expected);
+
+    FastEntry entry(lines[2].data(), lines[2].size());
+    BOOST_CHECK_EQUAL(lines[2].size(), entry.GetLineSize());
+
+    SortTestFile<FastEntry>(100, 0);
+    expected = {"3. a", "1. " + a, "2. " + a, "70000. " + b, "5. c"};
+    BOOST_CHECK(ReadLines("result.txt") == expected);
+}
+
+BOOST_AUTO_TEST_CASE(TestTaskScheduler)
+{
+    for (size_t threadCount : {1, 4})
+    {
+        TaskScheduler scheduler(threadCount);
+        BOOST_CHECK_EQUAL(threadCount, scheduler.GetThreadCount());
+
+        // tasks submit and wait for their own tasks
+        std::atomic<size_t> count(0);
+        TaskGroup tasks;
+        for (int n = 0; n < 10; ++n)
+        {
+            scheduler.Submit(tasks, [&scheduler, &count]()
+            {
+                TaskGroup subtasks;
+                for (int k = 0; k < 10; ++k)
+                    scheduler.Submit(subtasks, [&count]() { ++count; });
+                scheduler.Wait(subtasks);
+                ++count;
+            });
+        }
+        scheduler.Wait(tasks);
+        BOOST_CHECK_EQUAL(110, count);
+
+        // bounded resource: at most 2 tasks hold it
+        std::mutex mutex;
+        size_t free = 2;
+        size_t maxUsed = 0;
+        for (int n = 0; n < 20; ++n)
+        {
+            scheduler.Submit(tasks, [&]()
+            {
+                scheduler.WaitUntil([&]()
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (free == 0)
+                        return false;
+                    --free;
+                    return true;
+                });
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    maxUsed = std::max(maxUsed, 2 - free);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                ++free;
+            });
+        }
+        scheduler.Wait(tasks);
+        BOOST_CHECK_EQUAL(2, free);
+        BOOST_CHECK(maxUsed >= 1 && maxUsed <= 2);
+
+        // the first exception is rethrown, other tasks are done anyway
+        count = 0;
+        for (int n = 0; n < 5; ++n)
+            scheduler.Submit(tasks, [&count, n]() { ++count; if (n == 2) throw std::runtime_error("task"); });
+        BOOST_CHECK_THROW(scheduler.Wait(tasks), std::runtime_error);
+        BOOST_CHECK_EQUAL(5, count);
+        scheduler.Wait(tasks);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestSortTasks)
+{
+    typedef KeyEntry<KeyOrder<SortKey::String, false, SortKey::None, false>> TEntry;
+
+    // several chunks and parallel merges of several passes, equal strings keep the input order
+    std::vector<std::string> expected[3];
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+        {
+            std::string line = std::to_string(n) + ". " + char('A' + n % 3);
+            file << line << "\n";
+            expected[n % 3].push_back(line);
+        }
+    }
+    expected[0].insert(expected[0].end(), expected[1].begin(), expected[1].end());
+    expected[0].insert(expected[0].end(), expected[2].begin(), expected[2].end());
+
+    for (size_t threadCount : {1, 3})
+    {
+        TaskScheduler scheduler(threadCount);
+        FileRegistry registry(filename, "result.txt");
+
+        InitialSorter<TEntry> sorter(150);
+        sorter.SetScheduler(&scheduler);
+        sorter.Process(registry);
+        BOOST_CHECK(registry.Count() > 10);
+
+        Merger<TEntry> merger(3, 64);
+        merger.SetScheduler(&scheduler, 4);
+        merger.Process(registry);
+
+        BOOST_CHECK_EQUAL(1, registry.Count());
+        BOOST_CHECK(ReadLines("result.txt") == expected[0]);
+
+        // the single reader has the whole chunk, input which fits it is the result
+        FileRegistry single(filename, "result.txt");
+        InitialSorter<TEntry> singleSorter(boost::filesystem::file_size(filename) + 1);
+        singleSorter.SetScheduler(&scheduler);
+        singleSorter.Process(single);
+        BOOST_CHECK(single.PopFront(2) == std::vector<std::string>{"result.txt"});
+        BOOST_CHECK(ReadLines("result.txt") == expected[0]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestSortTasksWriteError)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+            file << n << ". " << char('A' + n % 3) << "\n";
+    }
+
+    // a failed write releases its chunk, readers waiting for chunks stop and the error is rethrown
+    for (size_t threadCount : {1, 3})
+    {
+        for (size_t readerCount : {1, 2})
+        {
+            TaskScheduler scheduler(threadCount);
+
+            // the whole input is the result, its dir doesn't exist
+            FileRegistry single(filename, "nonexistent/result.txt");
+            InitialSorter<FastEntry> singleSorter(boost::filesystem::file_size(filename) + 1);
+            singleSorter.SetScheduler(&scheduler);
+            singleSorter.SetReaderCount(readerCount);
+            BOOST_CHECK_THROW(singleSorter.Process(single), std::exception);
+
+            // runs are written to the tmp dir which is removed
+            boost::filesystem::create_directory("tmp1");
+            FileRegistry registry(filename, "result.txt");
+            registry.AddTmpDir("tmp1");
+            boost::filesystem::remove_all("tmp1");
+            InitialSorter<FastEntry> sorter(150);
+            sorter.SetScheduler(&scheduler);
+            sorter.SetReaderCount(readerCount);
+            BOOST_CHECK_THROW(sorter.Process(registry), std::exception);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestMetrics)
+{
+    Metrics metrics;
+    metrics.AddPhase("read", 0.5, 100, 10);
+    metrics.AddPhase("read", 0.25, 50, 5);
+    RunStats run;
+    run.fileName = "run\"1";
+    run.bytes = 150;
+    run.records = 15;
+    metrics.AddRun(run);
+
+    PhaseStats read = metrics.GetPhases()["read"];
+    BOOST_CHECK_EQUAL(2, read.count);
+    BOOST_CHECK_EQUAL(0.75, read.time);
+    BOOST_CHECK_EQUAL(150, read.bytes);
+    BOOST_CHECK_EQUAL(15, read.records);
+
+    std::string json = metrics.ToJson(1);
+    BOOST_CHECK(json.find("\"read\":{\"count\":2,\"time\":0.75,\"bytes\":150,\"records\":15,\"perf\":null}") != std::string::npos);
+    BOOST_CHECK(json.find("{\"file\":\"run\\\"1\",\"bytes\":150,\"records\":15,") != std::string::npos);
+
+    metrics.StartStage("merge", 400);
+    metrics.AddStageBytes(100);
+    BOOST_CHECK(metrics.GetProgress().find("\"stage\":\"merge\",\"doneBytes\":100,\"totalBytes\":400") != std::string::npos);
+
+    // phases of sorting are added to the metrics of process
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 100; ++n)
+            file << n << ". " << char('A' + (n * 7) % 26) << "\n";
+    }
+    std::map<std::string, PhaseStats> before = GetMetrics().GetPhases();
+    SortTestFile<FastEntry>(300, 0);
+    std::map<std::string, PhaseStats> after = GetMetrics().GetPhases();
+
+    BOOST_CHECK_EQUAL(100, after["parse"].records - before["parse"].records);
+    BOOST_CHECK_EQUAL(100, after["sort"].records - before["sort"].records);
+    // every merge pass writes all lines
+    BOOST_CHECK(after["merge"].count > before["merge"].count);
+    BOOST_CHECK_EQUAL(0, (after["merge"].records - before["merge"].records) % 100);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size("result.txt"), after["read"].bytes - before["read"].bytes);
+}
+
+BOOST_AUTO_TEST_CASE(TestPerfCounters)
+{
+    PerfCounters::Values start = {{100, 200, -1, 5, 1}};
+    PerfCounters::Values end = {{300, 600, 7, 5, -1}};
+    PerfCounters::Values diff = PerfCounters::Diff(start, end);
+    BOOST_CHECK(diff == (PerfCounters::Values{{200, 400, -1, 0, -1}}));
+
+    PerfCounters::Values total = PerfCounters::Unavailable();
+    PerfCounters::Add(&total, diff);
+    PerfCounters::Add(&total, diff);
+    BOOST_CHECK(total == (PerfCounters::Values{{400, 800, -1, 0, -1}}));
+    BOOST_CHECK_EQUAL(", cycles:400, instructions:800, branchMisses:0, ipc:2", PerfCounters::Format(total));
+    BOOST_CHECK_EQUAL("{\"cycles\":400,\"instructions\":800,\"branchMisses\":0}", Metrics::CountersToJson(total));
+    BOOST_CHECK_EQUAL("null", Metrics::CountersToJson(PerfCounters::Unavailable()));
+
+    // counters are not read while disabled
+    BOOST_CHECK(PerfCounters::Read() == PerfCounters::Unavailable());
+
+    // the host may have no counters, then all of them are unavailable and the reason is known
+    PerfCounters::Enable();
+    PhaseTimer timer;
+    timer.Start();
+    std::vector<int> values(100000);
+    for (size_t n = 0; n < values.size(); ++n)
+        values[n] = static_cast<int>((n * 7919) % 1000);
+    std::sort(values.begin(), values.end());
+    timer.Stop();
+    if (PerfCounters::GetError().empty())
+        BOOST_CHECK(timer.GetCounters()[PerfCounters::Instructions] > 100000);
+    else
+        BOOST_CHECK(timer.GetCounters() == PerfCounters::Unavailable());
+    PerfCounters::Enable(false);
+}
+
+BOOST_AUTO_TEST_CASE(TestDataGenerator)
+{
+    GeneratorSettings settings;
+    settings.seed = 5;
+    settings.duplicates = 0.5;
+    settings.duplicatePool = 3;
+    settings.prefixSize = 4;
+    settings.nonAscii = 0.5;
+    DataGenerator generator(settings);
+
+    // blocks have exact size and whole lines
+    std::string block;
+    for (size_t size : {5, 6, 100, 10000})
+    {
+        generator.GenerateBlock(1, size, &block);
+        BOOST_CHECK_EQUAL(size, block.size());
+        BOOST_CHECK_EQUAL('\n', block.back());
+        SmallEntry entry(block.data(), block.find('\n'));
+        BOOST_CHECK(entry.IsValid());
+    }
+
+    // the block depends on seed and index only
+    std::string other;
+    DataGenerator(settings).GenerateBlock(1, 10000, &other);
+    BOOST_CHECK(block == other);
+    generator.GenerateBlock(2, 10000, &other);
+    BOOST_CHECK(block != other);
+
+    // sorted lines are in ascending order
+    settings.duplicates = 0;
+    settings.sorted = 1;
+    DataGenerator(settings).GenerateBlock(0, 10000, &block);
+    block.erase(block.rfind('\n', block.size() - 2) + 1); // the last line fills the block
+    std::vector<std::string> lines;
+    std::istringstream stream(block);
+    for (std::string line; std::getline(stream, line); )
+        lines.push_back(line.substr(line.find('.')));
+    BOOST_CHECK(lines.size() > 10);
+    BOOST_CHECK(std::is_sorted(lines.begin(), lines.end()));
+}
+
+BOOST_AUTO_TEST_CASE(TestSortPlanner)
+{
+    InputProfile profile;
+    BOOST_CHECK_EQUAL(2u, ChooseSortPlan(profile).prefixWords); // no sample, FastEntry
+
+    profile.lineCount = profile.inputLines = 1000;
+    profile.lineSize = profile.stringSize = 30;
+    profile.sharedPrefix = 5;
+    BOOST_CHECK_EQUAL(1u, ChooseSortPlan(profile).prefixWords);
+    profile.sharedPrefix = 12;
+    BOOST_CHECK_EQUAL(2u, ChooseSortPlan(profile).prefixWords);
+    profile.sharedPrefix = 20;
+    BOOST_CHECK_EQUAL(0u, ChooseSortPlan(profile).prefixWords);
+
+    // the whole input has more lines than the sample, so its neighbours share more
+    profile.sharedPrefix = 6;
+    BOOST_CHECK_EQUAL(1u, ChooseSortPlan(profile).prefixWords);
+    profile.inputLines = 1000 * 1000;
+    BOOST_CHECK_EQUAL(2u, ChooseSortPlan(profile).prefixWords);
+
+    // equal strings are compared to their end
+    profile.inputLines = 1000;
+    profile.duplicates = 0.5;
+    BOOST_CHECK_EQUAL(0u, ChooseSortPlan(profile).prefixWords);
+
+    // samples of generated files
+    GeneratorSettings settings;
+    settings.maxWords = 4;
+    auto sample = [&settings]()
+    {
+        std::string block;
+        DataGenerator(settings).GenerateBlock(0, 200 * 1000, &block);
+        std::ofstream(filename, std::ios::binary) << block;
+        return SampleInput({filename}, 8, 4096);
+    };
+
+    profile = sample();
+    BOOST_CHECK(profile.lineCount > 100);
+    BOOST_CHECK(profile.lineCount < 8 * 4096 / DataGenerator::MinLineSize);
+    BOOST_CHECK(profile.stringSize > 1 && profile.stringSize < profile.lineSize);
+    BOOST_CHECK(profile.duplicates < 0.1);
+    BOOST_CHECK_EQUAL(1u, ChooseSortPlan(profile).prefixWords);
+
+    settings.prefixSize = 8;
+    profile = sample();
+    BOOST_CHECK(profile.sharedPrefix > 8);
+    BOOST_CHECK_EQUAL(2u, ChooseSortPlan(profile).prefixWords);
+
+    settings.prefixSize = 20;
+    BOOST_CHECK_EQUAL(0u, ChooseSortPlan(sample()).prefixWords);
+
+    settings.prefixSize = 0;
+    settings.duplicates = 0.8;
+    profile = sample();
+    BOOST_CHECK(profile.duplicates > 0.5);
+    BOOST_CHECK_EQUAL(0u, ChooseSortPlan(profile).prefixWords);
+
+    BOOST_CHECK_EQUAL(0u, SampleInput({"-"}).lineCount);
+
+    // blocks of small input don't overlap, every line is sampled once
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 500; ++n)
+            file << n << ". line " << n * 7 << "\n";
+    }
+    profile = SampleInput({filename});
+    BOOST_CHECK_EQUAL(500u, profile.lineCount);
+    BOOST_CHECK_EQUAL(0, profile.duplicates);
+    profile = SampleInput({filename}, 64, 1024);
+    BOOST_CHECK(profile.lineCount <= 500);
+    BOOST_CHECK_EQUAL(0, profile.duplicates);
+}
+
+BOOST_AUTO_TEST_CASE(TestSortChecker)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 1000; ++n)
+            file << n << ". " << n / 100 << "\n";
+    }
+
+    // ranges of 3 threads, the smallest buffer to fit a line
+    SortChecker<FastEntry> checker(3, 16);
+    BOOST_CHECK_EQUAL(SortChecker<FastEntry>::NotFound, checker.Check(filename));
+
+    // unordered line in every position, including range boundaries
+    std::vector<std::string> lines = ReadLines(filename);
+    for (size_t n : {1, 333, 334, 500, 999})
+    {
+        std::vector<std::string> unordered = lines;
+        std::swap(unordered[n - 1], unordered[n]);
+
+        size_t offset = 0;
+        {
+            std::ofstream file(filename);
+            for (size_t k = 0; k < unordered.size(); ++k)
+            {
+                if (k == n)
+                    offset = file.tellp();
+                file << unordered[k] << "\n";
+            }
+        }
+
+        BOOST_CHECK_EQUAL(offset, checker.Check(filename));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestSortMultipleFiles)
+{
+    std::vector<std::string> inputs = {"input1.txt", "input2.txt", "input3.txt", "input4.txt"};
+    std::vector<std::string> expected;
+    for (size_t n = 0; n < 3; ++n)
+    {
+        std::ofstream file(inputs[n]);
+        for (int k = 0; k < 30; ++k)
+        {
+            std::string line = std::to_string(k) + ". " + char('A' + (k * 7 + n) % 26);
+            file << line << (n == 1 && k == 29 ? "" : "\n"); // the last line without EOL
+            expected.push_back(line);
+        }
+    }
+    std::ofstream("input4.txt"); // empty file
+
+    std::sort(expected.begin(), expected.end(), [](const std::string& a, const std::string& b)
+    {
+        return FastEntry(a.data(), a.size()) < FastEntry(b.data(), b.size());
+    });
+
+    // the first file fills the chunk exactly, it is not the result while other files are pending
+    size_t firstSize = boost::filesystem::file_size(inputs[0]);
+    for (size_t readers : {1, 3})
+    {
+        for (size_t chunkSize : {size_t(64), size_t(300), size_t(10000), firstSize})
+        {
+            for (bool useScheduler : {false, true})
+            {
+                TaskScheduler scheduler(2);
+                FileRegistry registry(inputs, "result.txt");
+                boost::filesystem::remove("result.txt");
+
+                InitialSorter<FastEntry> sorter(chunkSize);
+                sorter.SetReaderCount(readers);
+                if (useScheduler)
+                    sorter.SetScheduler(&scheduler);
+                sorter.Process(registry);
+                BOOST_CHECK(!boost::filesystem::exists("result.txt") || registry.Count() == 1);
+
+                Merger<FastEntry> merger(4, 64);
+                merger.Process(registry);
+
+                // the only run of several readers is a tmp file
+                std::vector<std::string> files = registry.PopFront(2);
+                BOOST_REQUIRE_EQUAL(1, files.size());
+                std::vector<std::string> result = ReadLines(files[0]);
+                if (files[0] != "result.txt")
+                    boost::filesystem::remove(files[0]);
+                BOOST_CHECK_EQUAL(expected.size(), result.size());
+                BOOST_CHECK(std::is_permutation(result.begin(), result.end(), expected.begin()));
+                BOOST_CHECK(std::is_sorted(result.begin(), result.end(), [](const std::string& a, const std::string& b)
+                {
+                    return FastEntry(a.data(), a.size()) < FastEntry(b.data(), b.size());
+                }));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestPartitionMerger)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+            file << n << ". " << char('A' + (n * 7) % 26) << char('a' + n % 26) << "\n";
+    }
+
+    SortTestFile<FastEntry>(100000, 0);
+    std::vector<std::string> expected = ReadLines("result.txt");
+
+    for (bool useSamples : {true, false})
+    {
+        FileRegistry registry(filename);
+        InitialSorter<FastEntry> sorter(500);
+        sorter.EnableSampling(16);
+        sorter.Process(registry);
+        BOOST_CHECK(registry.Count() > 4);
+
+        Merger<FastEntry> merger(4, 64);
+        merger.Process(registry, 4);
+
+        std::vector<RunSample> samples = sorter.TakeSamples();
+        BOOST_CHECK(!samples.empty());
+
+        PartitionMerger<FastEntry> partitionMerger(64);
+        partitionMerger.Process(registry, useSamples ? samples : std::vector<RunSample>(), "result.txt", 3);
+        BOOST_CHECK_EQUAL(0, registry.Count());
+
+        std::vector<std::string> result;
+        for (size_t n = 0; n < 3; ++n)
+        {
+            std::vector<std::string> lines = ReadLines(PartitionMerger<FastEntry>::GetPartitionFile("result.txt", n, 3));
+            BOOST_CHECK(lines.size() > 50);
+            result.insert(result.end(), lines.begin(), lines.end());
+        }
+        BOOST_CHECK(result == expected);
+    }
+
+    BOOST_CHECK_EQUAL("result.txt.07", PartitionMerger<FastEntry>::GetPartitionFile("result.txt", 7, 12));
+}
+
+BOOST_AUTO_TEST_CASE(TestPartitionMergerLongLines)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 40; ++n)
+            file << n << ". " << std::string(n % 5 == 0 ? 300 * 1024 : 10, char('A' + (n * 7) % 26)) << "\n";
+    }
+
+    SortTestFile<FastEntry>(100000, 0);
+    std::vector<std::string> expected = ReadLines("result.txt");
+
+    FileRegistry registry(filename);
+    InitialSorter<FastEntry> sorter(1000);
+    sorter.EnableSampling(4);
+    sorter.Process(registry);
+    BOOST_CHECK(registry.Count() > 1);
+
+    PartitionMerger<FastEntry> partitionMerger(64);
+    partitionMerger.Process(registry, sorter.TakeSamples(), "result.txt", 3);
+    BOOST_CHECK_EQUAL(0, registry.Count());
+
+    std::vector<std::string> result;
+    for (size_t n = 0; n < 3; ++n)
+    {
+        std::vector<std::string> lines = ReadLines(PartitionMerger<FastEntry>::GetPartitionFile("result.txt", n, 3));
+        result.insert(result.end(), lines.begin(), lines.end());
+    }
+    BOOST_CHECK(result == expected);
+}
+
+BOOST_AUTO_TEST_CASE(TestSparseIndex)
+{
+    SparseIndexSettings settings;
+    settings.blockSize = 64;
+    settings.keySpec = "string,number";
+
+    std::vector<std::string> lines;
+    std::vector<size_t> lineOffsets;
+    size_t offset = 0;
+    {
+        FileWriter file(filename, 0, 50); // buffer is smaller than block
+        file.EnableIndex(settings);
+        for (int n = 0; n < 200; ++n)
+        {
+            // some lines are too long to be indexed
+            std::string line = std::to_string(n) + ". " + std::string(n % 50 == 7 ? 2000 : n % 13 + 1, 'a' + n / 10);
+            lines.push_back(line);
+            lineOffsets.push_back(offset);
+            offset += line.size() + 1;
+
+            file.write(line.data(), line.size());
+            file.write("\n", 1);
+        }
+        file.Close();
+    }
+
+    SparseIndex index;
+    index.Load(GetIndexFile(filename));
+    BOOST_CHECK_EQUAL(64, index.settings.blockSize);
+    BOOST_CHECK_EQUAL("string,number", index.settings.keySpec);
+    BOOST_CHECK(!index.settings.isCounted);
+
+    // the first line of every block, which is not too long
+    std::vector<SparseIndex::Entry> expected;
+    for (size_t n = 0; n < lines.size(); ++n)
+    {
+        if (lines[n].size() <= SparseIndex::MaxLineSize &&
+            (expected.empty() || lineOffsets[n] >= expected.back().offset + settings.blockSize))
+        {
+            expected.push_back(SparseIndex::Entry{lineOffsets[n], lines[n]});
+        }
+    }
+
+    BOOST_CHECK(expected.size() > 10);
+    BOOST_REQUIRE_EQUAL(expected.size(), index.entries.size());
+    for (size_t n = 0; n < expected.size(); ++n)
+    {
+        BOOST_CHECK_EQUAL(expected[n].offset, index.entries[n].offset);
+        BOOST_CHECK_EQUAL(expected[n].line, index.entries[n].line);
+    }
+
+    // the same index is built from the file
+    BuildIndex(filename, settings);
+    SparseIndex built;
+    built.Load(GetIndexFile(filename));
+    BOOST_CHECK_EQUAL(index.entries.size(), built.entries.size());
+
+    // lines with chars in ['d', 'f'] are inside the range
+    auto isBefore = [](const std::string& line) { return line.back() < 'd'; };
+    auto isAfter = [](const std::string& line) { return line.back() > 'f'; };
+    auto range = index.FindRange(isBefore, isAfter, offset);
+    BOOST_CHECK(range.first <= lineOffsets[30]);
+    BOOST_CHECK(range.second >= lineOffsets[60]);
+    BOOST_CHECK(range.second - range.first < offset / 2);
+}
+
+BOOST_AUTO_TEST_CASE(TestLookupCollated)
+{
+    const char* words[] = {"apple", "Banana", "CHERRY", "banana", "date", "BANANA"};
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+            file << n << ". " << words[(n * 7) % 6] << "\n";
+    }
+
+    // the result with index is sorted by collation keys
+    SparseIndexSettings settings;
+    settings.blockSize = 64;
+    settings.keySpec = "string,number;icase";
+    FileRegistry registry(filename, "result.txt");
+    registry.SetIndexSettings(settings);
+    InitialSorter<CollatedEntry<Collation::IgnoreCase>> sorter(100000);
+    sorter.Process(registry);
+
+    std::vector<std::string> expected;
+    for (const std::string& line : ReadLines("result.txt"))
+    {
+        std::string word = line.substr(line.find(' ') + 1);
+        if (word == "banana" || word == "Banana" || word == "BANANA")
+            expected.push_back(line);
+    }
+    BOOST_CHECK_EQUAL(150, expected.size());
+
+    // lines of all numbers with the string key, compared by collation
+    SparseIndex index;
+    index.Load(GetIndexFile("result.txt"));
+    BOOST_CHECK(index.entries.size() > 10);
+    KeySpec spec = ParseKeySpec(index.settings.keySpec);
+    std::string resultFile = "result.txt";
+    for (const char* key : {"banana", "BaNaNa"})
+    {
+        std::unique_ptr<FILE, int(*)(FILE*)> output(fopen("lookup.txt", "wb"), &fclose);
+        LookupJob job = {resultFile, index, MakeLine(spec.first, key), MakeLine(spec.first, key), output.get()};
+        BOOST_CHECK_EQUAL(0, DispatchFirstKeySpec(spec, job));
+        output.reset();
+        BOOST_CHECK(ReadLines("lookup.txt") == expected);
+    }
+
+    std::unique_ptr<FILE, int(*)(FILE*)> output(fopen("lookup.txt", "wb"), &fclose);
+    LookupJob job = {resultFile, index, MakeLine(spec.first, "grape"), MakeLine(spec.first, "grape"), output.get()};
+    BOOST_CHECK_EQUAL(2, DispatchFirstKeySpec(spec, job));
+}
+
+BOOST_AUTO_TEST_CASE(TestNumaSort)
+{
+    BOOST_CHECK((NumaTopology::ParseCpuList("0-2,8,10-11\n") == std::vector<int>{0, 1, 2, 8, 10, 11}));
+
+    NumaTopology topology = NumaTopology::Fake(3);
+    BOOST_CHECK_EQUAL(3, topology.nodes.size());
+    for (const NumaNode& node : topology.nodes)
+    {
+        BOOST_CHECK_EQUAL(-1, node.memoryNode);
+        BOOST_CHECK(!node.cpus.empty());
+    }
+    BOOST_CHECK(!NumaTopology::Detect().nodes.empty());
+
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+            file << n << ". " << char('A' + (n * 7) % 26) << char('a' + n % 26) << "\n";
+    }
+
+    // slices start at lines and cover the file
+    InputQueue queue({filename}, 4);
+    InputSlice slice;
+    size_t end = 0;
+    size_t count = 0;
+    while (queue.Pop(&slice))
+    {
+        BOOST_CHECK_EQUAL(end, slice.begin);
+        end = slice.end;
+        ++count;
+    }
+    BOOST_CHECK_EQUAL(4, count);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(filename), end);
+
+    SortTestFile<FastEntry>(100000, 0);
+    std::vector<std::string> expected = ReadLines("result.txt");
+
+    // every node sorts its own sub-chunks of slices of the single file,
+    // the scheduler is not used, so chunks are not passed to threads of other nodes
+    TaskScheduler scheduler(2);
+    for (TaskScheduler* sorterScheduler : {static_cast<TaskScheduler*>(nullptr), &scheduler})
+    {
+        FileRegistry registry(filename, "result.txt");
+        InitialSorter<FastEntry> sorter(900);
+        sorter.EnableNuma(topology);
+        sorter.SetScheduler(sorterScheduler);
+        sorter.Process(registry);
+        BOOST_CHECK(registry.Count() > 3);
+
+        Merger<FastEntry> merger(4, 64);
+        merger.Process(registry);
+        BOOST_CHECK(ReadLines("result.txt") == expected);
+    }
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(TestCoordinator)
+{
+    {
+        std::ofstream file(filename);
+        for (int n = 0; n < 300; ++n)
+            file << n % 40 << ". " << char('A' + (n * 7) % 26) << char('a' + n % 26) << "\n";
+    }
+
+    for (DuplicateMode duplicates : {DuplicateMode::Keep, DuplicateMode::Count})
+    {
+        SortTestFile<FastEntry>(100000, 0, duplicates);
+        std::vector<std::string> expected = ReadLines("result.txt");
+
+        // workers are processes on this host, several chunks per range
+        for (size_t workers : {1, 3})
+        {
+            FileRegistry registry(filename);
+            Coordinator<FastEntry> coordinator(workers, 300, 256);
+            coordinator.SetDuplicateMode(duplicates);
+            coordinator.Process(registry, "result.txt");
+            BOOST_CHECK(ReadLines("result.txt") == expected);
+        }
+
+        // files exchanged by workers are stored in tmp dir
+        boost::filesystem::create_directory("tmp1");
+        FileRegistry registry(filename);
+        registry.AddTmpDir("tmp1");
+        Coordinator<FastEntry> coordinator(2, 300, 256);
+        coordinator.SetDuplicateMode(duplicates);
+        coordinator.Process(registry, "result.txt");
+        BOOST_CHECK(ReadLines("result.txt") == expected);
+        BOOST_CHECK_EQUAL("tmp1/test.txt.w.5", registry.MakeTmpFileName("w")); // after 2 part prefixes and 2 ranges
+    }
+
+    // errors of workers are reported
+    {
+        std::ofstream(filename) << "1. A\ninvalid\n";
+    }
+    FileRegistry registry(filename);
+    Coordinator<FastEntry> coordinator(2, 300, 256);
+    BOOST_CHECK_THROW(coordinator.Process(registry, "result.txt"), std::runtime_error);
+
+    // parts and ranges written by workers are removed
+    for (boost::filesystem::directory_iterator it("."), end; it != end; ++it)
+    {
+        std::string name = it->path().filename().string();
+        BOOST_CHECK_MESSAGE(name.find("test.txt.w.") != 0 && name.find("test.txt.r.") != 0, name);
+    }
+}
+#endif